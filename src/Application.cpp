@@ -1,24 +1,39 @@
 #include <iostream>
 #include <filesystem>
+#include <algorithm>
+#include <thread>
+#include <exception>
 
 #include "Utilities/Common.h"
 #include "DiskImages/DiskImage.h"
+#include "DiskImages/NullDiskImage.h"
 #include "FileSystems/FileSystem.h"
+#include "FileSystems/Inventory.h"
 #include "MBR.h"
+#include "GPT.h"
+#include "Sources/Manifest.h"
+#include "Sources/Archive.h"
 
 int main(int argc, char** argv)
 {
     ArgParser args;
-    args.add_param("mbr", 'm', "Path to an MBR (Master Boot Record)", false)
-        .add_param("filesystem", 'x', "Filesystem to use followed by <,option=value>")
+    args.add_param("mbr", 'm', "Path to an MBR (Master Boot Record), only the boot code is used with a GPT")
+        .add_param("partition-table", 'P', "Partition table to generate, mbr (default) or gpt")
+        .add_param("filesystem", 'x', "Filesystem to use followed by <,option=value>, FAT32 takes <,cluster_size=bytes or auto>")
         .add_list("files", 'f', "Paths to additional files to be put inside root directory")
         .add_list("store", 't', "List of <file>,<sector> to store outside of the filesystem")
         .add_param("directory", 'd', "Path to the root directory for this disk (copied recursively)")
-        .add_param("size", 's', "Hard disk size to be generated (in megabytes)")
-        .add_param("image-format", 'g', "Generated image format, currently only valid is vmdk")
+        .add_list("partition", 'r', "Partitions as <filesystem>[,size=<MB>][,directory=<path>][,option=value], built concurrently, only the last one can omit its size")
+        .add_list("archive", 'a', "Paths to tar or cpio archives (optionally gzip compressed) to unpack into the root directory, - for stdin")
+        .add_list("manifest", 'M', "Paths to manifest files listing <destination>\t<source>[\t<hints>] per line")
+        .add_param("size", 's', "Hard disk size to be generated (in megabytes), auto to fit the contents")
+        .add_param("headroom", 'H', "Free space left on automatically sized partitions, in percent of what their contents need (defaults to 10)")
+        .add_flag("dry-run", 'D', "Take stock of all inputs and report what every partition needs without writing anything")
+        .add_param("image-format", 'g', "Generated image format, vmdk or raw, followed by <,in_memory=yes><,huge_pages=yes><,mmap=yes><,io_uring=yes><,bmap=yes><,preallocate=yes><,sector_size=512 or 4096>, raw takes <,path=file or device><,direct=yes>")
         .add_param("image-directory", 'i', "Path to a directory to output image files")
         .add_param("image-name", 'n', "Name of the image to be generated")
-        .add_param("part-align", 'p', "Partition alignment (in 512 byte sectors)")
+        .add_param("part-align", 'p', "Partition alignment (in sectors), defaults to 4K for mbr and 1M for gpt")
+        .add_param("jobs", 'j', "Number of threads used to build top-level directories of --directory")
         .add_flag("verbose", 'v', "Enable verbose logging")
         .add_help("help", 'h', "Display this menu and exit",
                   [&]() { std::cout << "How to use VirtualHDDCreator:\n" << args; exit(1); });
@@ -29,76 +44,385 @@ int main(int argc, char** argv)
         if (args.is_set("verbose"))
             Logger::the().set_level(Logger::Level::INFO);
 
-        auto image_size = args.get_uint_or("size", 64) * MB;
+        auto image_format = args.get_or("image-format", "vmdk");
+        auto sector_size = DiskImage::sector_size_of(image_format);
+        auto is_dry_run = args.is_set("dry-run");
+
+        // partitions without a size are made just big enough for their contents, the image fits around them
+        auto is_auto_sized = args.get_or("size", "") == "auto";
+        size_t image_size = 0;
 
-         // align for sector size
-        image_size = image_size - (image_size % DiskImage::sector_size);
-        auto image_sector_count = image_size / DiskImage::sector_size;
+        if (!is_auto_sized) {
+            // raw images default to the size of their target, e.g. a block device
+            auto default_size = extract_main_value(image_format) == "raw" ? 0 : 64;
+            image_size = args.get_uint_or("size", default_size) * MB;
+
+             // align for sector size
+            image_size = image_size - (image_size % sector_size);
+        }
 
         auto image_dir = std::filesystem::current_path().string();
         if (args.is_set("image-directory"))
             image_dir = args.get("image-directory");
         auto image_name = args.get_or("image-name", "MyHDD");
 
-        auto image_format = args.get_or("image-format", "vmdk");
-        auto image = DiskImage::create(image_format, image_dir, image_name, image_size);
+        auto partition_table = args.get_or("partition-table", "mbr");
+        std::transform(partition_table.begin(), partition_table.end(), partition_table.begin(), ::tolower);
+
+        if (partition_table != "mbr" && partition_table != "gpt")
+            throw std::runtime_error("unknown partition table " + partition_table);
+
+        auto use_gpt = partition_table == "gpt";
 
-        auto partition_alignment = args.get_uint_or("part-align", DiskImage::partition_alignment);
-        MBR mbr(args.get("mbr"), image->geometry(), partition_alignment);
+        struct PartitionSpec {
+            std::string filesystem;
+            additional_options_t options;
+
+            // zero takes the rest of the disk
+            size_t sector_count { 0 };
+            std::string directory;
+
+            size_t lba_offset { 0 };
+        };
+
+        // <filesystem>[,size=<MB>][,directory=<path>][,<filesystem option>=<value>...]
+        auto parse_partition = [sector_size](std::string_view raw) {
+            PartitionSpec spec;
+            spec.filesystem = extract_main_value(raw);
+            spec.options = parse_options(raw);
+
+            auto size = spec.options.find("size");
+            if (size != spec.options.end()) {
+                spec.sector_count = std::stoull(size->second) * MB / sector_size;
+                if (!spec.sector_count)
+                    throw std::runtime_error("invalid partition size " + size->second);
+
+                spec.options.erase(size);
+            }
 
-        MBR::Partition partition_1(image_sector_count - partition_alignment);
-        auto partition_offset = mbr.add_partition(partition_1);
-        mbr.write_into(*image);
+            auto directory = spec.options.find("directory");
+            if (directory != spec.options.end()) {
+                spec.directory = directory->second;
+                spec.options.erase(directory);
+            }
+
+            return spec;
+        };
+
+        std::vector<PartitionSpec> partitions;
+
+        if (args.is_set("partition")) {
+            if (args.is_set("filesystem") || args.is_set("directory"))
+                throw std::runtime_error("--filesystem and --directory cannot be combined with --partition");
+
+            for (const auto& raw : args.get_list_or("partition", {}))
+                partitions.push_back(parse_partition(raw));
+        } else {
+            partitions.push_back(parse_partition(args.get_or("filesystem", "FAT32")));
+            partitions.back().directory = args.get_or("directory", "");
+        }
+
+        auto sector_count_of = [&](const PartitionSpec& partition, size_t free_sector_count) {
+            if (partition.sector_count)
+                return partition.sector_count;
+
+            if (&partition != &partitions.back())
+                throw std::runtime_error("only the last partition can omit its size");
+
+            return free_sector_count;
+        };
+
+        auto lowercase_filesystem_of = [](const PartitionSpec& partition) {
+            auto filesystem = partition.filesystem;
+            std::transform(filesystem.begin(), filesystem.end(), filesystem.begin(), ::tolower);
+            return filesystem;
+        };
 
-        auto fs = FileSystem::create(*image, partition_offset, partition_1.sector_count(), args);
+        // assigns every partition its place on 'image' and writes the partition table
+        auto lay_out_partitions = [&](DiskImage& image) {
+            if (use_gpt) {
+                auto partition_alignment = args.get_uint_or("part-align", GPT::default_alignment / sector_size);
+                GPT gpt(image.geometry(), partition_alignment, args.get_or("mbr", ""));
 
-        FSObject obj {};
+                for (auto& partition : partitions) {
+                    auto filesystem = lowercase_filesystem_of(partition);
+                    auto partition_type = GPT::Partition::Type::BASIC_DATA;
+                    if (filesystem == "ext2" || filesystem == "ext4")
+                        partition_type = GPT::Partition::Type::LINUX_FILESYSTEM;
 
-        auto path_rooted_at = [](const std::string& root, const std::string& sub_directory_path) -> std::string
+                    GPT::Partition gpt_partition(sector_count_of(partition, gpt.free_sector_count()), partition_type, {}, &partition == &partitions.front());
+                    partition.lba_offset = gpt.add_partition(gpt_partition);
+                    partition.sector_count = gpt_partition.sector_count();
+                }
+
+                gpt.write_into(image);
+            } else {
+                if (!args.is_set("mbr"))
+                    throw std::runtime_error("expected an MBR (--mbr) for the mbr partition table");
+
+                auto partition_alignment = args.get_uint_or("part-align", DiskImage::partition_alignment / sector_size);
+                MBR mbr(args.get("mbr"), image.geometry(), partition_alignment);
+
+                for (auto& partition : partitions) {
+                    auto filesystem = lowercase_filesystem_of(partition);
+                    auto partition_type = MBR::Partition::Type::FAT32_LBA;
+                    if (filesystem == "ext2" || filesystem == "ext4")
+                        partition_type = MBR::Partition::Type::LINUX;
+                    else if (filesystem == "exfat")
+                        partition_type = MBR::Partition::Type::EXFAT;
+
+                    auto status = &partition == &partitions.front() ? MBR::Partition::Status::BOOTABLE : MBR::Partition::Status::INACTIVE;
+
+                    MBR::Partition mbr_partition(sector_count_of(partition, mbr.free_sector_count()), status, partition_type);
+                    partition.lba_offset = mbr.add_partition(mbr_partition);
+                    partition.sector_count = mbr_partition.sector_count();
+                }
+
+                mbr.write_into(image);
+            }
+        };
+
+        // stores 'file' inside 'parent' of 'sink' (a FileSystem or a Subtree of one),
+        // returns the handle of the new directory if 'file' is one
+        auto store_entry = [](FSObjectSink& sink, directory_handle_t parent, const std::filesystem::directory_entry& file) -> directory_handle_t
+        {
+            auto name = file.path().filename().string();
+
+            Logger::the().info("storing file ", file.path().string());
+
+            if (file.is_directory())
+                return sink.store_directory_in(parent, name);
+
+            if (file.is_regular_file()) {
+                HostFile host_file(file.path().string());
+                sink.store_file_in(parent, name, host_file);
+                return nullptr;
+            }
+
+            Logger::the().warning("Not going to store unknown file type at ", file.path().string());
+            return nullptr;
+        };
+
+        // copies everything under 'host_root' into the root of 'sink', the handles
+        // of the directories we're currently in are kept around so that no paths
+        // have to be resolved on the filesystem side
+        auto store_tree = [&](FSObjectSink& sink, const std::string& host_root)
         {
-            auto rooted_path = std::filesystem::path("/");
-            rooted_path = rooted_path / std::filesystem::path(std::string(sub_directory_path.data() + root.size()));
+            std::vector<directory_handle_t> parents { sink.open_directory("/") };
+
+            std::filesystem::recursive_directory_iterator end;
+            for (auto file = std::filesystem::recursive_directory_iterator(host_root); file != end; ++file) {
+                auto depth = static_cast<size_t>(file.depth());
+                parents.resize(depth + 1);
 
-            return rooted_path.string();
+                auto directory = store_entry(sink, parents[depth], *file);
+                if (directory)
+                    parents.push_back(directory);
+            }
         };
 
-        auto directory = args.get_or("directory", "");
-        if (!directory.empty()) {
-            auto path_to_root = std::filesystem::path(directory);
+        auto jobs = args.get_uint_or("jobs", 1);
 
-            for (auto& file : std::filesystem::recursive_directory_iterator(path_to_root)) {
-                auto path_on_disk_image = path_rooted_at(directory, file.path().string());
-                obj.path = path_on_disk_image;
+        // the first partition also gets everything passed via --files, --archive and --manifest,
+        // 'sink' is either its FileSystem or an Inventory taking stock of it
+        auto populate = [&](auto& sink, DiskImage& image, const std::string& directory, bool is_first) {
+            auto root = sink.open_directory("/");
 
-                Logger::the().info("storing file ", file.path().string());
+            if (!directory.empty() && jobs > 1) {
+                // top-level directories are built concurrently, everything else is stored right away
+                std::vector<std::string> subtree_names;
+                std::vector<std::string> subtree_paths;
 
-                if (file.is_directory()) {
-                    obj.type = FSObject::Type::DIRECTORY;
-                    fs->store(obj);
-                    continue;
+                for (auto& file : std::filesystem::directory_iterator(directory)) {
+                    if (file.is_directory()) {
+                        subtree_names.emplace_back(file.path().filename().string());
+                        subtree_paths.emplace_back(file.path().string());
+                        continue;
+                    }
+
+                    store_entry(sink, root, file);
                 }
 
-                if (file.is_regular_file()) {
-                    obj.type = FSObject::Type::FILE;
-                    obj.data = read_entire(file.path().string());
-                    fs->store(obj);
+                sink.store_subtrees(subtree_names, [&](size_t index, FileSystem::Subtree& subtree) {
+                    store_tree(subtree, subtree_paths[index]);
+                }, jobs);
+            } else if (!directory.empty()) {
+                store_tree(sink, directory);
+            }
+
+            if (!is_first)
+                return;
+
+            for (const auto& file : args.get_list_or("files", {})) {
+                Logger::the().info("storing file ", file);
+
+                HostFile host_file(file);
+                sink.store_file_in(root, std::filesystem::path(file).filename().string(), host_file);
+            }
+
+            for (const auto& path : args.get_list_or("archive", {})) {
+                Logger::the().info("storing files from ", path == "-" ? "standard input" : path);
+
+                Archive(path).store_into(sink);
+            }
+
+            for (const auto& path : args.get_list_or("manifest", {})) {
+                Logger::the().info("storing files listed in ", path);
+
+                Manifest(path).store_into(sink, image);
+            }
+        };
+
+        // auto sized partitions are laid out on a disk this big first, the image ends where the last one does
+        static constexpr size_t max_auto_image_size = 16 * TB;
+
+        // options like cluster_size=auto are worked out from the contents as well
+        auto is_tuned = std::any_of(partitions.begin(), partitions.end(), [](const PartitionSpec& partition) {
+            auto cluster_size = partition.options.find("cluster_size");
+            return cluster_size != partition.options.end() && cluster_size->second == "auto";
+        });
+
+        // planning only records the sizes of host files without reading them and nothing is written,
+        // archives are the exception as their contents are only known by reading through them
+        std::vector<Inventory> inventories(is_dry_run || is_auto_sized || is_tuned ? partitions.size() : 0);
+
+        if (!inventories.empty()) {
+            auto archives = args.get_list_or("archive", {});
+
+            if (!is_dry_run && std::find(archives.begin(), archives.end(), "-") != archives.end())
+                throw std::runtime_error("standard input can only be read once, --archive - cannot be combined with --size auto or cluster_size=auto");
+
+            // data that --manifest stores outside of the filesystem goes nowhere as well
+            NullDiskImage scratch(image_size ? image_size : max_auto_image_size, sector_size);
+
+            for (size_t i = 0; i < partitions.size(); ++i) {
+                Logger::the().info("taking stock of the contents of partition ", i + 1);
+                populate(inventories[i], scratch, partitions[i].directory, i == 0);
+            }
+        }
+
+        if (is_auto_sized) {
+            auto headroom = args.get_uint_or("headroom", 10);
+
+            for (size_t i = 0; i < partitions.size(); ++i) {
+                auto& partition = partitions[i];
+
+                if (partition.sector_count)
                     continue;
-                }
 
-                Logger::the().warning("Not going to store unknown file type at ", file.path().string());
+                partition.sector_count = FileSystem::minimal_sector_count(partition.filesystem, partition.options, sector_size, inventories[i], headroom);
+                Logger::the().info("partition ", i + 1, " needs ", partition.sector_count * sector_size / MB, " MB");
             }
+
+            NullDiskImage scratch(max_auto_image_size, sector_size);
+            lay_out_partitions(scratch);
+
+            auto& last = partitions.back();
+            auto end_of_disk = last.lba_offset + last.sector_count;
+
+            if (use_gpt)
+                end_of_disk += GPT::backup_sector_count(sector_size);
+
+            image_size = ceiling_divide<size_t>(end_of_disk * sector_size, MB) * MB;
+            Logger::the().info("image needs ", image_size / MB, " MB");
         }
 
-        obj.type = FSObject::Type::FILE;
+        std::shared_ptr<DiskImage> image;
 
-        for (const auto& file : args.get_list_or("files", {})) {
-            auto path_on_disk = "/" + std::filesystem::path(file).filename().string();
-            obj.path = path_on_disk;
+        if (is_dry_run) {
+            if (!image_size)
+                throw std::runtime_error("a dry run needs the size of the raw image, pass --size");
 
-            Logger::the().info("storing file ", file);
+            image = std::make_shared<NullDiskImage>(image_size, sector_size);
+        } else {
+            image = DiskImage::create(image_format, image_dir, image_name, image_size);
+        }
 
-            obj.data = read_entire(file);
-            fs->store(obj);
+        lay_out_partitions(*image);
+
+        if (is_tuned) {
+            for (size_t i = 0; i < partitions.size(); ++i) {
+                auto& partition = partitions[i];
+                partition.options = FileSystem::tune(partition.filesystem, partition.options, partition.sector_count, sector_size, inventories[i]);
+
+                auto cluster_size = partition.options.find("cluster_size");
+                if (cluster_size != partition.options.end())
+                    Logger::the().info("partition ", i + 1, " uses clusters of ", cluster_size->second, " bytes");
+            }
+        }
+
+        if (is_dry_run) {
+            auto megabytes = [](size_t bytes) { return ceiling_divide<size_t>(bytes, MB); };
+            bool everything_fits = true;
+
+            std::cout << "image: " << megabytes(image->geometry().total_sector_count * sector_size) << " MB\n";
+
+            for (size_t i = 0; i < partitions.size(); ++i) {
+                auto& partition = partitions[i];
+                auto& inventory = inventories[i];
+
+                auto estimate = FileSystem::plan(partition.filesystem, partition.options, partition.sector_count, sector_size, inventory);
+
+                std::cout << "partition " << i + 1 << ": " << partition.filesystem << " at LBA " << partition.lba_offset << ", "
+                          << megabytes(partition.sector_count * sector_size) << " MB\n";
+                std::cout << "    contents: " << inventory.file_count() << " files in " << inventory.directory_count() << " directories, "
+                          << megabytes(inventory.data_size()) << " MB of data\n";
+                std::cout << "    allocation units of " << estimate.unit_size << " bytes: " << estimate.units_needed << " needed, "
+                          << estimate.units_free << " free\n";
+
+                if (estimate.inodes_free)
+                    std::cout << "    inodes: " << estimate.inodes_needed << " needed, " << estimate.inodes_free << " free\n";
+
+                if (estimate.units_needed > estimate.units_free) {
+                    everything_fits = false;
+                    std::cout << "    doesn't fit, " << megabytes((estimate.units_needed - estimate.units_free) * estimate.unit_size) << " MB short\n";
+                } else if (estimate.inodes_needed > estimate.inodes_free) {
+                    everything_fits = false;
+                    std::cout << "    doesn't fit, " << estimate.inodes_needed - estimate.inodes_free << " inodes short\n";
+                } else {
+                    std::cout << "    fits, " << (estimate.units_free - estimate.units_needed) * estimate.unit_size / MB << " MB to spare\n";
+                }
+            }
+
+            if (!everything_fits)
+                throw std::runtime_error("the contents don't fit, try a larger size or --size auto");
+
+            return 0;
+        }
+
+        // the filesystem is finalized on the same thread that built it, errors are passed on from there
+        auto build_partition = [&](const PartitionSpec& partition) {
+            Logger::the().info("building ", partition.filesystem, " partition at LBA ", partition.lba_offset);
+
+            auto fs = FileSystem::create(*image, partition.lba_offset, partition.sector_count, partition.filesystem, partition.options);
+            populate(*fs, *image, partition.directory, &partition == &partitions.front());
+            fs->finalize();
+        };
+
+        if (partitions.size() == 1) {
+            build_partition(partitions.front());
+        } else {
+            // partitions never overlap, so their filesystems can write into the image concurrently
+            std::vector<std::exception_ptr> errors(partitions.size());
+            std::vector<std::thread> builders;
+
+            for (size_t i = 0; i < partitions.size(); ++i) {
+                builders.emplace_back([&, i]() {
+                    try {
+                        build_partition(partitions[i]);
+                    } catch (...) {
+                        errors[i] = std::current_exception();
+                    }
+                });
+            }
+
+            for (auto& builder : builders)
+                builder.join();
+
+            for (auto& error : errors) {
+                if (error)
+                    std::rethrow_exception(error);
+            }
         }
 
         for (auto& arg : args.get_list_or("store", {})) {
@@ -114,8 +438,11 @@ int main(int argc, char** argv)
                 throw std::runtime_error("invalid sector value " + std::to_string(sector));
 
             auto entire_file = read_entire(file_path);
-            image->write_at(entire_file.data(), entire_file.size(), sector * DiskImage::sector_size);
+            image->write_at(entire_file.data(), entire_file.size(), sector * sector_size);
         }
+
+        // while errors can still be reported, the destructor can't
+        image->finalize();
     } catch (const std::exception& ex) {
         Logger::the().error(ex.what());
         return 1;
@@ -0,0 +1,167 @@
+#include <vector>
+#include <algorithm>
+
+#include "Utilities/SHA256.h"
+#include "BlockMapDiskImage.h"
+
+BlockMapDiskImage::BlockMapDiskImage(std::shared_ptr<DiskImage> target, std::string block_map_path)
+    : DiskImage(target->geometry())
+    , m_target(std::move(target))
+    , m_block_map_path(std::move(block_map_path))
+    , m_size(m_target->geometry().total_sector_count * m_target->sector_size())
+    , m_block_count(ceiling_divide(m_size, block_size))
+    , m_written_blocks(new std::atomic<uint64_t>[ceiling_divide(m_block_count, bits_per_word)]())
+{
+    if (m_target->data_path().empty())
+        throw std::runtime_error("a block map needs an image that is backed by a file");
+}
+
+void BlockMapDiskImage::write_at(const void* data, size_t size, size_t offset)
+{
+    m_target->write_at(data, size, offset);
+    mark_written(size, offset);
+}
+
+void BlockMapDiskImage::write_fresh_at(const void* data, size_t size, size_t offset)
+{
+    m_target->write_fresh_at(data, size, offset);
+    mark_written(size, offset);
+}
+
+void BlockMapDiskImage::write_at(const IOSlice* slices, size_t count, size_t offset)
+{
+    m_target->write_at(slices, count, offset);
+
+    for (size_t i = 0; i < count; ++i) {
+        mark_written(slices[i].size, offset);
+        offset += slices[i].size;
+    }
+}
+
+void BlockMapDiskImage::mark_zeroed(size_t size, size_t offset)
+{
+    m_target->mark_zeroed(size, offset);
+    mark_written(size, offset);
+}
+
+void BlockMapDiskImage::mark_written(size_t size, size_t offset)
+{
+    if (!size)
+        return;
+
+    auto last_block = (offset + size - 1) / block_size;
+
+    for (auto block = offset / block_size; block <= last_block; ++block)
+        m_written_blocks[block / bits_per_word].fetch_or(uint64_t(1) << (block % bits_per_word), std::memory_order_relaxed);
+}
+
+void BlockMapDiskImage::write(const void* data, size_t size)
+{
+    write_at(data, size, m_offset);
+    m_offset += size;
+}
+
+void BlockMapDiskImage::set_offset(size_t offset)
+{
+    if (offset >= m_size)
+        throw std::runtime_error("offset past end of image");
+
+    m_offset = offset;
+}
+
+void BlockMapDiskImage::skip(size_t bytes)
+{
+    if (m_offset + bytes >= m_size)
+        throw std::runtime_error("skipped past the end of image");
+
+    m_offset += bytes;
+}
+
+void BlockMapDiskImage::write_block_map()
+{
+    auto is_written = [this](size_t block) {
+        return (m_written_blocks[block / bits_per_word].load(std::memory_order_relaxed) >> (block % bits_per_word)) & 1;
+    };
+
+    AutoFile image(m_target->data_path(), AutoFile::READ);
+    std::vector<uint8_t> buffer(4 * MB);
+
+    std::string ranges;
+    size_t mapped_blocks = 0;
+
+    for (size_t block = 0; block < m_block_count;) {
+        if (!is_written(block)) {
+            ++block;
+            continue;
+        }
+
+        auto first = block;
+        while (block < m_block_count && is_written(block))
+            ++block;
+
+        // the last block might be partial, the image size is only sector aligned
+        auto offset = first * block_size;
+        auto end = std::min(block * block_size, m_size);
+
+        SHA256 hash;
+        while (offset < end) {
+            auto chunk = std::min(end - offset, buffer.size());
+            image.read_at(buffer.data(), chunk, offset);
+            hash.update(buffer.data(), chunk);
+            offset += chunk;
+        }
+
+        mapped_blocks += block - first;
+
+        ranges += "        <Range chksum=\"" + SHA256::to_hex(hash.digest()) + "\"> " + std::to_string(first);
+        if (block - first > 1)
+            ranges += "-" + std::to_string(block - 1);
+        ranges += " </Range>\n";
+    }
+
+    // the checksum of the file itself is taken with the checksum field zeroed
+    static const std::string checksum_placeholder(64, '0');
+
+    std::string bmap;
+    bmap += "<?xml version=\"1.0\" ?>\n";
+    bmap += "<bmap version=\"2.0\">\n";
+    bmap += "    <ImageSize> " + std::to_string(m_size) + " </ImageSize>\n";
+    bmap += "    <BlockSize> " + std::to_string(block_size) + " </BlockSize>\n";
+    bmap += "    <BlocksCount> " + std::to_string(m_block_count) + " </BlocksCount>\n";
+    bmap += "    <MappedBlocksCount> " + std::to_string(mapped_blocks) + " </MappedBlocksCount>\n";
+    bmap += "    <ChecksumType> sha256 </ChecksumType>\n";
+    bmap += "    <BmapFileChecksum> " + checksum_placeholder + " </BmapFileChecksum>\n";
+    bmap += "    <BlockMap>\n";
+    bmap += ranges;
+    bmap += "    </BlockMap>\n";
+    bmap += "</bmap>\n";
+
+    auto checksum = SHA256::to_hex(SHA256::of(bmap.data(), bmap.size()));
+    bmap.replace(bmap.find(checksum_placeholder), checksum_placeholder.size(), checksum);
+
+    AutoFile file(m_block_map_path, AutoFile::WRITE | AutoFile::TRUNCATE);
+    file.write(bmap);
+}
+
+void BlockMapDiskImage::finalize()
+{
+    if (m_is_finalized)
+        return;
+
+    m_is_finalized = true;
+
+    // checksums are taken from what actually ended up in the image
+    m_target->finalize();
+
+    write_block_map();
+}
+
+BlockMapDiskImage::~BlockMapDiskImage()
+{
+    // normally finalized already, this is for images dropped because of an error elsewhere
+    try {
+        finalize();
+    } catch (const std::exception& ex) {
+        Logger::the().error(ex.what());
+    }
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <memory>
+#include <atomic>
+#include <string>
+
+#include "Utilities/Common.h"
+#include "DiskImage.h"
+
+// Passes every write on to 'target' and keeps track of the blocks that were written.
+// Once finalized a bmap file (as understood by bmaptool) listing those blocks along with
+// their checksums is written to 'block_map_path', so that flashing and copying tools can
+// skip everything else. Blocks written as zeros are listed as well, the target
+// of a copy might have anything in them.
+class BlockMapDiskImage final : public DiskImage
+{
+public:
+    static constexpr size_t block_size = 4 * KB;
+
+    BlockMapDiskImage(std::shared_ptr<DiskImage> target, std::string block_map_path);
+
+    void write_at(const void* data, size_t size, size_t offset) override;
+    void write_fresh_at(const void* data, size_t size, size_t offset) override;
+    void write_at(const IOSlice* slices, size_t count, size_t offset) override;
+    void mark_zeroed(size_t size, size_t offset) override;
+    void write(const void* data, size_t size) override;
+    void set_offset(size_t) override;
+    void skip(size_t) override;
+
+    std::string data_path() const override { return m_target->data_path(); }
+
+    void finalize() override;
+
+    ~BlockMapDiskImage();
+
+private:
+    void mark_written(size_t size, size_t offset);
+    void write_block_map();
+
+    static constexpr size_t bits_per_word = 64;
+
+    std::shared_ptr<DiskImage> m_target;
+    std::string m_block_map_path;
+    size_t m_size { 0 };
+    size_t m_block_count { 0 };
+    size_t m_offset { 0 };
+    bool m_is_finalized { false };
+
+    // a bit per block, set concurrently by whoever writes into it
+    std::unique_ptr<std::atomic<uint64_t>[]> m_written_blocks;
+};
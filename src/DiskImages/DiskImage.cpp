@@ -2,19 +2,126 @@
 #include <string_view>
 #include <cstddef>
 #include <memory>
+#include <filesystem>
+#include <vector>
 
 #include "DiskImage.h"
 #include "VMDKDiskImage.h"
+#include "MemoryDiskImage.h"
+#include "RawDiskImage.h"
+#include "BlockMapDiskImage.h"
 
-std::shared_ptr<DiskImage> DiskImage::create(std::string_view type, std::string_view out_directory, std::string_view out_name, size_t out_size)
+std::shared_ptr<DiskImage> DiskImage::create(std::string_view format, std::string_view out_directory, std::string_view out_name, size_t out_size)
 {
-    if (type == "vmdk" || type == "VMDK")
-        return std::make_shared<VMDKDiskImage>(out_directory, out_name, out_size);
+    auto type = extract_main_value(format);
+    auto options = parse_options(format);
 
-    throw std::runtime_error("Unknown disk image type " + std::string(type));
+    std::shared_ptr<DiskImage> image;
+
+    auto is_enabled = [&](const std::string& option) {
+        auto value = options.find(option);
+        return value != options.end() && interpret_boolean(value->second);
+    };
+
+    auto output = VMDKDiskImage::Output::WRITE;
+    if (is_enabled("mmap"))
+        output = VMDKDiskImage::Output::MMAP;
+    else if (is_enabled("io_uring"))
+        output = VMDKDiskImage::Output::IO_URING;
+
+    auto sector_size = sector_size_of(format);
+
+    if (type == "vmdk" || type == "VMDK") {
+        image = std::make_shared<VMDKDiskImage>(out_directory, out_name, out_size, output, is_enabled("preallocate"), sector_size);
+    } else if (type == "raw" || type == "RAW") {
+        auto path = options.find("path");
+        auto image_path = path != options.end() ? path->second : (std::filesystem::path(out_directory) / (std::string(out_name) + ".img")).string();
+
+        image = std::make_shared<RawDiskImage>(image_path, out_size, is_enabled("direct"), is_enabled("preallocate"), sector_size);
+    } else {
+        throw std::runtime_error("Unknown disk image type " + std::string(type));
+    }
+
+    if (is_enabled("in_memory"))
+        image = std::make_shared<MemoryDiskImage>(image, is_enabled("huge_pages"));
+
+    // outermost, so that it sees the writes of the filesystems themselves. Next to the other
+    // outputs rather than the data file, which might just as well be a device in /dev.
+    if (is_enabled("bmap")) {
+        auto block_map_path = std::filesystem::path(out_directory) / (std::string(out_name) + ".bmap");
+        image = std::make_shared<BlockMapDiskImage>(image, block_map_path.string());
+    }
+
+    return image;
+}
+
+void DiskImage::write_file_at(HostFile& file, size_t offset)
+{
+    static constexpr size_t max_zeros_size = 1 * MB;
+
+    size_t end_of_last_piece = 0;
+
+    auto write_zeros_until = [&](size_t end) {
+        if (end <= end_of_last_piece)
+            return;
+
+        std::vector<uint8_t> zeros(std::min(end - end_of_last_piece, max_zeros_size));
+
+        for (; end_of_last_piece < end; end_of_last_piece += zeros.size()) {
+            auto chunk = std::min(zeros.size(), end - end_of_last_piece);
+            write_at(zeros.data(), chunk, offset + end_of_last_piece);
+        }
+
+        end_of_last_piece = end;
+    };
+
+    file.for_each_data_piece([&](const uint8_t* data, size_t size, size_t piece_offset) {
+        write_zeros_until(piece_offset);
+        write_at(data, size, offset + piece_offset);
+        end_of_last_piece = piece_offset + size;
+    });
+
+    write_zeros_until(file.size());
+}
+
+size_t DiskImage::sector_size_of(std::string_view format)
+{
+    auto options = parse_options(format);
+
+    auto sector_size = options.find("sector_size");
+    if (sector_size == options.end())
+        return default_sector_size;
+
+    if (sector_size->second == "512")
+        return 512;
+    if (sector_size->second == "4096")
+        return 4096;
+
+    throw std::runtime_error("unsupported sector size " + sector_size->second + ", has to be 512 or 4096");
+}
+
+size_t DiskImage::write_granularity_for(const AutoFile& file)
+{
+    constexpr size_t max_granularity = 256 * KB;
+
+    auto block_size = file.block_size();
+    bool is_power_of_two = (block_size & (block_size - 1)) == 0;
+
+    if (!is_power_of_two || block_size < zero_skip_granularity || block_size > max_granularity)
+        return zero_skip_granularity;
+
+    return block_size;
 }
 
 DiskImage::DiskImage(const DiskGeometry& geometry)
     : m_geometry(geometry)
 {
 }
+
+void DiskImage::write_at(const IOSlice* slices, size_t count, size_t offset)
+{
+    for (size_t i = 0; i < count; ++i) {
+        write_at(slices[i].data, slices[i].size, offset);
+        offset += slices[i].size;
+    }
+}
@@ -6,30 +6,73 @@
 
 #include "Utilities/Common.h"
 #include "Utilities/AutoFile.h"
+#include "Utilities/HostFile.h"
 
 class DiskImage
 {
 public:
-    // this should technically be unique to a specific
-    // disk image type, to do later
-    static constexpr size_t sector_size = 512;
-    static constexpr size_t partition_alignment = 8;
+    // images have 512 byte sectors unless they're created with sector_size=4096 (4K native)
+    static constexpr size_t default_sector_size = 512;
+
+    // in bytes
+    static constexpr size_t partition_alignment = 4 * KB;
+
+    // images that start out zeroed skip writing aligned blocks of zeros at least this big into fresh ranges
+    static constexpr size_t zero_skip_granularity = 4 * KB;
 
     DiskImage(const DiskGeometry&);
 
-    static std::shared_ptr<DiskImage> create(std::string_view type, std::string_view out_directory, std::string_view out_name, size_t out_size);
+    // format is <type>[,in_memory=<bool>][,huge_pages=<bool>][,mmap=<bool>][,io_uring=<bool>], an in-memory
+    // image is built in RAM and written out to the actual image in one go at the end, mmap writes into
+    // a shared mapping of the image file instead of calling write(), io_uring keeps writes in flight asynchronously.
+    // raw images take [,path=<file or device>][,direct=<bool>] and an 'out_size' of 0 to use the size of the target.
+    // bmap=<bool> writes a block map of everything that was written next to the data file.
+    // preallocate=<bool> allocates the whole image file up front so that it ends up contiguous on the host.
+    // sector_size=<512 or 4096> sets the logical sector size.
+    static std::shared_ptr<DiskImage> create(std::string_view format, std::string_view out_directory, std::string_view out_name, size_t out_size);
+
+    // the sector size an image created from 'format' is going to have, throws if it's not supported
+    static size_t sector_size_of(std::string_view format);
 
+    // Must be safe to call from multiple threads as long as the ranges don't overlap,
+    // sequential write/set_offset/skip are not.
     virtual void write_at(const void* data, size_t size, size_t offset) = 0;
+
+    // Same as write_at, but only for ranges that nothing has been written to before, e.g. the data of
+    // freshly allocated clusters. Images that start out zeroed may leave aligned blocks of zeros out.
+    virtual void write_fresh_at(const void* data, size_t size, size_t offset) { write_at(data, size, offset); }
+
+    // Writes the slices back to back starting at 'offset', same guarantees as above.
+    // Images backed by a file pass them on as a single vectored write.
+    virtual void write_at(const IOSlice* slices, size_t count, size_t offset);
+
+    // Writes the contents of a host file at 'offset', over whatever is there already,
+    // so unlike file data stored by filesystems its holes are written out as zeros.
+    virtual void write_file_at(HostFile& file, size_t offset);
+
+    // A range that is meant to read as zeros but isn't written, as images start out zeroed
+    // (e.g. holes of sparse files). Images keeping track of what's written count it as written.
+    virtual void mark_zeroed(size_t, size_t) { }
+
     virtual void write(const void* data, size_t size) = 0;
     virtual void set_offset(size_t) = 0;
     virtual void skip(size_t) = 0;
 
     const DiskGeometry& geometry() { return m_geometry; }
+    size_t sector_size() const { return m_geometry.sector_size; }
+
+    // the file holding the sectors of the image, empty for images that only live in memory
+    virtual std::string data_path() const { return {}; }
 
     virtual void finalize() = 0;
 
     virtual ~DiskImage() = default;
 
+protected:
+    // What writes into a file on the host are batched and aligned to, its preferred I/O size
+    // if that's a sensible power of two and zero_skip_granularity otherwise.
+    static size_t write_granularity_for(const AutoFile&);
+
 private:
     DiskGeometry m_geometry;
 };
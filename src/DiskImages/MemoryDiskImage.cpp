@@ -0,0 +1,68 @@
+#include <cstring>
+
+#include "MemoryDiskImage.h"
+
+MemoryDiskImage::MemoryDiskImage(std::shared_ptr<DiskImage> target, bool huge_pages)
+    : DiskImage(target->geometry())
+    , m_target(std::move(target))
+    , m_memory(m_target->geometry().total_sector_count * m_target->sector_size(), huge_pages)
+{
+}
+
+MemoryDiskImage::MemoryDiskImage(const DiskGeometry& geometry, bool huge_pages)
+    : DiskImage(geometry)
+    , m_memory(geometry.total_sector_count * geometry.sector_size, huge_pages)
+{
+}
+
+void MemoryDiskImage::write_at(const void* data, size_t size, size_t offset)
+{
+    if (offset + size > m_memory.size())
+        throw std::runtime_error("disk size overflow");
+
+    memcpy(m_memory.data() + offset, data, size);
+}
+
+void MemoryDiskImage::write(const void* data, size_t size)
+{
+    write_at(data, size, m_offset);
+    m_offset += size;
+}
+
+void MemoryDiskImage::set_offset(size_t offset)
+{
+    if (offset >= m_memory.size())
+        throw std::runtime_error("offset past end of image");
+
+    m_offset = offset;
+}
+
+void MemoryDiskImage::skip(size_t bytes)
+{
+    if (m_offset + bytes >= m_memory.size())
+        throw std::runtime_error("skipped past the end of image");
+
+    m_offset += bytes;
+}
+
+void MemoryDiskImage::finalize()
+{
+    if (m_is_finalized || !m_target)
+        return;
+
+    m_is_finalized = true;
+
+    // nothing has been written into the target yet
+    m_target->write_fresh_at(m_memory.data(), m_memory.size(), 0);
+    m_target->finalize();
+}
+
+MemoryDiskImage::~MemoryDiskImage()
+{
+    // normally finalized already, this is for images dropped because of an error elsewhere
+    try {
+        finalize();
+    } catch (const std::exception& ex) {
+        Logger::the().error(ex.what());
+    }
+}
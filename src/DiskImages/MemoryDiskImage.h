@@ -0,0 +1,39 @@
+#pragma once
+
+#include <memory>
+
+#include "Utilities/Common.h"
+#include "Utilities/AnonymousMemory.h"
+#include "DiskImage.h"
+
+// Keeps the entire image in memory and flushes it into 'target' with a single
+// write once finalized. Meant for small images, the whole disk has to fit in RAM.
+class MemoryDiskImage final : public DiskImage
+{
+public:
+    MemoryDiskImage(std::shared_ptr<DiskImage> target, bool huge_pages = false);
+
+    // an image that is never flushed anywhere, its contents are only accessible via data()
+    MemoryDiskImage(const DiskGeometry& geometry, bool huge_pages = false);
+
+    void write_at(const void* data, size_t size, size_t offset) override;
+    using DiskImage::write_at;
+    void write(const void* data, size_t size) override;
+    void set_offset(size_t) override;
+    void skip(size_t) override;
+
+    std::string data_path() const override { return m_target ? m_target->data_path() : std::string(); }
+
+    void finalize() override;
+
+    const uint8_t* data() const { return m_memory.data(); }
+    size_t size() const { return m_memory.size(); }
+
+    ~MemoryDiskImage();
+
+private:
+    std::shared_ptr<DiskImage> m_target;
+    AnonymousMemory m_memory;
+    size_t m_offset { 0 };
+    bool m_is_finalized { false };
+};
@@ -0,0 +1,52 @@
+#include "NullDiskImage.h"
+#include "VMDKDiskImage.h"
+
+NullDiskImage::NullDiskImage(size_t size, size_t sector_size)
+    : DiskImage(VMDKDiskImage::calculate_geometry(size, sector_size))
+    , m_size(geometry().total_sector_count * sector_size)
+{
+}
+
+void NullDiskImage::write_at(const void*, size_t size, size_t offset)
+{
+    if (offset + size > m_size)
+        throw std::runtime_error("disk size overflow");
+}
+
+void NullDiskImage::write_at(const IOSlice* slices, size_t count, size_t offset)
+{
+    for (size_t i = 0; i < count; ++i)
+        offset += slices[i].size;
+
+    if (offset > m_size)
+        throw std::runtime_error("disk size overflow");
+}
+
+void NullDiskImage::write_file_at(HostFile& file, size_t offset)
+{
+    // nothing to read the file for
+    if (offset + file.size() > m_size)
+        throw std::runtime_error("disk size overflow");
+}
+
+void NullDiskImage::write(const void* data, size_t size)
+{
+    write_at(data, size, m_offset);
+    m_offset += size;
+}
+
+void NullDiskImage::set_offset(size_t offset)
+{
+    if (offset >= m_size)
+        throw std::runtime_error("offset past end of image");
+
+    m_offset = offset;
+}
+
+void NullDiskImage::skip(size_t bytes)
+{
+    if (m_offset + bytes >= m_size)
+        throw std::runtime_error("skipped past the end of image");
+
+    m_offset += bytes;
+}
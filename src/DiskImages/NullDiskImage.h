@@ -0,0 +1,25 @@
+#pragma once
+
+#include "Utilities/Common.h"
+#include "DiskImage.h"
+
+// Has the geometry of an image of 'size' bytes but discards everything written into it.
+// Used to lay out partitions and filesystems when planning an image without creating it.
+class NullDiskImage final : public DiskImage
+{
+public:
+    NullDiskImage(size_t size, size_t sector_size = default_sector_size);
+
+    void write_at(const void*, size_t size, size_t offset) override;
+    void write_at(const IOSlice* slices, size_t count, size_t offset) override;
+    void write_file_at(HostFile& file, size_t offset) override;
+    void write(const void* data, size_t size) override;
+    void set_offset(size_t) override;
+    void skip(size_t) override;
+
+    void finalize() override { }
+
+private:
+    size_t m_size { 0 };
+    size_t m_offset { 0 };
+};
@@ -0,0 +1,328 @@
+#include <filesystem>
+#include <algorithm>
+#include <cstring>
+
+#include "RawDiskImage.h"
+#include "VMDKDiskImage.h"
+
+static size_t align_down(size_t value, size_t alignment)
+{
+    return value - (value % alignment);
+}
+
+static size_t align_up(size_t value, size_t alignment)
+{
+    return align_down(value + alignment - 1, alignment);
+}
+
+size_t RawDiskImage::size_of_target(const std::string& path, size_t requested_size, size_t sector_size)
+{
+    if (!std::filesystem::exists(path)) {
+        if (!requested_size)
+            throw std::runtime_error("size of " + path + " has to be specified");
+
+        return requested_size;
+    }
+
+    AutoFile target(path, AutoFile::READ);
+    auto available = align_down(target.size(), sector_size);
+
+    if (target.is_block_device()) {
+        if (requested_size > available)
+            throw std::runtime_error("image of " + std::to_string(requested_size) + " bytes doesn't fit on " + path +
+                                     " (" + std::to_string(available) + " bytes)");
+
+        return requested_size ? requested_size : available;
+    }
+
+    if (requested_size)
+        return requested_size;
+    if (!available)
+        throw std::runtime_error("size of " + path + " has to be specified");
+
+    return available;
+}
+
+RawDiskImage::RawDiskImage(const std::string& path, size_t size, bool direct, bool preallocate, size_t sector_size)
+    : DiskImage(VMDKDiskImage::calculate_geometry(size_of_target(path, size, sector_size), sector_size))
+    , m_path(path)
+    , m_size(geometry().total_sector_count * sector_size)
+{
+    auto mode = AutoFile::READ | AutoFile::WRITE;
+    if (direct)
+        mode = mode | AutoFile::DIRECT;
+
+    m_file.open(path, mode);
+    m_logical_block_size = m_file.logical_block_size();
+
+    if (direct && direct_alignment % m_logical_block_size)
+        throw std::runtime_error("direct I/O on " + path + " with a logical block size of " +
+                                 std::to_string(m_logical_block_size) + " bytes is not supported");
+
+    // regular files are emptied and resized to fit, block devices have a fixed size
+    // and get zeroed instead, either way the image starts out reading as zeros
+    if (m_file.is_block_device()) {
+        zero_block_device();
+    } else {
+        m_file.set_size(0);
+
+        if (preallocate && !m_file.preallocate(m_size))
+            Logger::the().warning("the host filesystem doesn't support preallocation, the image might end up fragmented");
+
+        m_file.set_size(m_size);
+    }
+
+    // a fresh file is one big hole (or preallocated and reading as zeros), so is a zeroed
+    // device, blocks of zeros can stay that way
+    m_skip_zeroes = true;
+    m_write_granularity = write_granularity_for(m_file);
+
+    if (!direct)
+        return;
+
+    m_buffers = std::make_unique<AnonymousMemory>(direct_cached_blocks * direct_block_size);
+    for (size_t i = direct_cached_blocks; i-- > 0;)
+        m_free_buffers.push_back(m_buffers->data() + i * direct_block_size);
+
+    m_flushed_blocks.resize(ceiling_divide(m_size, direct_block_size));
+}
+
+void RawDiskImage::zero_block_device()
+{
+    // filesystems only write what they use, stale data anywhere else would be taken for metadata.
+    // Both BLKZEROOUT and O_DIRECT take whole logical blocks, a partial one at the end is done last.
+    auto aligned_size = align_down(m_size, m_logical_block_size);
+
+    if (aligned_size && !m_file.zero_range(0, aligned_size)) {
+        Logger::the().info("zeroing ", m_path, " (", m_size / MB, " MiB)...");
+
+        // anonymous memory is zeroed and page aligned, which is good enough for O_DIRECT
+        AnonymousMemory zeros(std::min(zero_fill_chunk_size, aligned_size));
+
+        for (size_t offset = 0; offset < aligned_size; offset += zeros.size())
+            m_file.write_at(zeros.data(), std::min(zeros.size(), aligned_size - offset), offset);
+    }
+
+    if (aligned_size == m_size)
+        return;
+
+    // read-modify-write, whatever follows the image in that block stays as it was
+    AnonymousMemory last_block(m_logical_block_size);
+    m_file.read_at(last_block.data(), m_logical_block_size, aligned_size);
+    memset(last_block.data(), 0, m_size - aligned_size);
+    m_file.write_at(last_block.data(), m_logical_block_size, aligned_size);
+}
+
+void RawDiskImage::write_at(const void* data, size_t size, size_t offset)
+{
+    if (offset + size > m_size)
+        throw std::runtime_error("disk size overflow");
+
+    if (m_buffers) {
+        write_through_cache(reinterpret_cast<const uint8_t*>(data), size, offset);
+        return;
+    }
+
+    m_file.write_at(reinterpret_cast<const uint8_t*>(data), size, offset);
+}
+
+void RawDiskImage::write_fresh_at(const void* data, size_t size, size_t offset)
+{
+    // the cache only leaves out zeros where the whole block is known, so it's the same as write_at
+    if (m_buffers || !m_skip_zeroes) {
+        write_at(data, size, offset);
+        return;
+    }
+
+    if (offset + size > m_size)
+        throw std::runtime_error("disk size overflow");
+
+    ZeroScan::for_each_nonzero_range(data, size, offset, m_write_granularity,
+        [this](const uint8_t* range, size_t range_size, size_t range_offset) {
+            m_file.write_at(range, range_size, range_offset);
+        });
+}
+
+void RawDiskImage::write_at(const IOSlice* slices, size_t count, size_t offset)
+{
+    // the cache copies everything anyway
+    if (m_buffers) {
+        DiskImage::write_at(slices, count, offset);
+        return;
+    }
+
+    size_t size = 0;
+    for (size_t i = 0; i < count; ++i)
+        size += slices[i].size;
+
+    if (offset + size > m_size)
+        throw std::runtime_error("disk size overflow");
+
+    m_file.write_at(slices, count, offset);
+}
+
+void RawDiskImage::write(const void* data, size_t size)
+{
+    write_at(data, size, m_offset);
+    m_offset += size;
+}
+
+void RawDiskImage::set_offset(size_t offset)
+{
+    if (offset >= m_size)
+        throw std::runtime_error("offset past end of image");
+
+    m_offset = offset;
+}
+
+void RawDiskImage::skip(size_t bytes)
+{
+    if (m_offset + bytes >= m_size)
+        throw std::runtime_error("skipped past the end of image");
+
+    m_offset += bytes;
+}
+
+void RawDiskImage::write_through_cache(const uint8_t* data, size_t size, size_t offset)
+{
+    std::lock_guard lock(m_cache_lock);
+
+    while (size) {
+        auto offset_within_block = offset % direct_block_size;
+        auto chunk = std::min(size, direct_block_size - offset_within_block);
+
+        auto& block = *cached_block(offset / direct_block_size);
+        memcpy(block.buffer + offset_within_block, data, chunk);
+
+        auto last_chunk = (offset_within_block + chunk - 1) / direct_alignment;
+        for (auto i = offset_within_block / direct_alignment; i <= last_chunk; ++i)
+            block.dirty.set(i);
+
+        data += chunk;
+        size -= chunk;
+        offset += chunk;
+    }
+}
+
+RawDiskImage::cache_t::iterator RawDiskImage::cached_block(size_t index)
+{
+    auto cached = m_cached_blocks.find(index);
+
+    if (cached != m_cached_blocks.end()) {
+        m_cache.splice(m_cache.begin(), m_cache, cached->second);
+        return cached->second;
+    }
+
+    if (m_free_buffers.empty()) {
+        auto& evicted = m_cache.back();
+        flush(evicted);
+
+        m_free_buffers.push_back(evicted.buffer);
+        m_cached_blocks.erase(evicted.index);
+        m_cache.pop_back();
+    }
+
+    auto* buffer = m_free_buffers.back();
+    m_free_buffers.pop_back();
+
+    auto block_offset = index * direct_block_size;
+    auto block_length = std::min(direct_block_size, m_size - block_offset);
+
+    // the last block of the image might end within a logical block, I/O covers all of it
+    auto io_length = align_up(block_length, m_logical_block_size);
+
+    // flushes cover whole aligned chunks, so whatever is on disk already has to be kept,
+    // that includes anything past the end of the image sharing its last logical block
+    if (m_flushed_blocks[index]) {
+        m_file.read_at(buffer, io_length, block_offset);
+    } else {
+        if (io_length != block_length) {
+            auto last_block = io_length - m_logical_block_size;
+            m_file.read_at(buffer + last_block, m_logical_block_size, block_offset + last_block);
+        }
+
+        memset(buffer, 0, block_length);
+    }
+
+    m_cache.push_front({ index, buffer, {} });
+    m_cached_blocks[index] = m_cache.begin();
+
+    return m_cache.begin();
+}
+
+void RawDiskImage::flush(CachedBlock& block)
+{
+    if (block.dirty.none())
+        return;
+
+    auto block_offset = block.index * direct_block_size;
+    auto block_length = std::min(direct_block_size, m_size - block_offset);
+
+    // zeros only have to be written if they might replace something flushed earlier
+    auto skip_zeroes = m_skip_zeroes && !m_flushed_blocks[block.index];
+
+    auto has_to_write = [&](size_t chunk) {
+        if (!block.dirty[chunk])
+            return false;
+        if (!skip_zeroes)
+            return true;
+
+        auto begin = chunk * direct_alignment;
+        return !ZeroScan::is_zero(block.buffer + begin, std::min(direct_alignment, block_length - begin));
+    };
+
+    for (size_t chunk = 0; chunk < block.dirty.size();) {
+        if (!has_to_write(chunk)) {
+            ++chunk;
+            continue;
+        }
+
+        auto first = chunk;
+        while (chunk < block.dirty.size() && has_to_write(chunk))
+            ++chunk;
+
+        // the image size is only sector aligned, the very last write ends with the logical block it's in
+        auto begin = first * direct_alignment;
+        auto end = std::min(chunk * direct_alignment, align_up(block_length, m_logical_block_size));
+
+        m_file.write_at(block.buffer + begin, end - begin, block_offset + begin);
+    }
+
+    m_flushed_blocks[block.index] = true;
+    block.dirty.reset();
+}
+
+void RawDiskImage::finalize()
+{
+    if (m_is_finalized)
+        return;
+
+    m_is_finalized = true;
+
+    if (!m_buffers)
+        return;
+
+    std::lock_guard lock(m_cache_lock);
+
+    // in disk order, which is what devices like best
+    std::vector<CachedBlock*> blocks;
+    for (auto& block : m_cache)
+        blocks.push_back(&block);
+
+    std::sort(blocks.begin(), blocks.end(), [](auto* l, auto* r) { return l->index < r->index; });
+
+    for (auto* block : blocks)
+        flush(*block);
+
+    m_file.sync();
+}
+
+RawDiskImage::~RawDiskImage()
+{
+    // normally finalized already, this is for images dropped because of an error elsewhere
+    try {
+        finalize();
+    } catch (const std::exception& ex) {
+        Logger::the().error(ex.what());
+    }
+}
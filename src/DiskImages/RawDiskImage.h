@@ -0,0 +1,89 @@
+#pragma once
+
+#include <list>
+#include <bitset>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+
+#include "Utilities/Common.h"
+#include "Utilities/AnonymousMemory.h"
+#include "Utilities/ZeroScan.h"
+#include "DiskImage.h"
+
+// A plain sector by sector image, either a regular file or a block device.
+// Block devices are zeroed up front so that regions that are never written read as zeros,
+// just like they do in a fresh file.
+class RawDiskImage final : public DiskImage
+{
+public:
+    // a size of 0 uses the size of the existing target, e.g. the capacity of a block device.
+    // With 'direct' the target is opened with O_DIRECT and written through aligned buffers,
+    // 'preallocate' allocates a regular file in full up front.
+    RawDiskImage(const std::string& path, size_t size, bool direct, bool preallocate = false, size_t sector_size = default_sector_size);
+
+    void write_at(const void* data, size_t size, size_t offset) override;
+    void write_fresh_at(const void* data, size_t size, size_t offset) override;
+    void write_at(const IOSlice* slices, size_t count, size_t offset) override;
+    void write(const void* data, size_t size) override;
+    void set_offset(size_t) override;
+    void skip(size_t) override;
+
+    std::string data_path() const override { return m_path; }
+
+    void finalize() override;
+
+    ~RawDiskImage();
+
+private:
+    static size_t size_of_target(const std::string& path, size_t requested_size, size_t sector_size);
+
+    void zero_block_device();
+
+    // what the buffers are aligned to, covers the logical block size of pretty much any device
+    static constexpr size_t direct_alignment = 4 * KB;
+
+    // writes are collected in blocks of this size, evicted least recently used first
+    static constexpr size_t direct_block_size = 1 * MB;
+    static constexpr size_t direct_cached_blocks = 64;
+
+    // devices that can't zero a range by themselves get zeros written in chunks of this size
+    static constexpr size_t zero_fill_chunk_size = 8 * MB;
+
+    struct CachedBlock {
+        size_t index;
+        uint8_t* buffer;
+
+        // aligned chunks written since the last flush, runs of them are flushed
+        // separately so that holes in between stay holes in sparse files
+        std::bitset<direct_block_size / direct_alignment> dirty;
+    };
+
+    using cache_t = std::list<CachedBlock>;
+
+    void write_through_cache(const uint8_t* data, size_t size, size_t offset);
+    cache_t::iterator cached_block(size_t index);
+    void flush(CachedBlock& block);
+
+private:
+    std::string m_path;
+    size_t m_size { 0 };
+    size_t m_offset { 0 };
+    bool m_is_finalized { false };
+    bool m_skip_zeroes { false };
+    size_t m_write_granularity { zero_skip_granularity };
+
+    // what offsets and lengths of direct I/O are aligned to
+    size_t m_logical_block_size { 512 };
+    AutoFile m_file;
+
+    std::unique_ptr<AnonymousMemory> m_buffers;
+    std::vector<uint8_t*> m_free_buffers;
+    cache_t m_cache;
+    std::unordered_map<size_t, cache_t::iterator> m_cached_blocks;
+
+    // blocks that were flushed already have to be read back before being modified again
+    std::vector<bool> m_flushed_blocks;
+    std::mutex m_cache_lock;
+};
@@ -1,10 +1,13 @@
 #include <filesystem>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
 
 #include "Utilities/Common.h"
 #include "VMDKDiskImage.h"
 
-VMDKDiskImage::VMDKDiskImage(std::string_view dir_path, std::string_view image_name, size_t size)
-    : DiskImage(calculate_geometry(size))
+VMDKDiskImage::VMDKDiskImage(std::string_view dir_path, std::string_view image_name, size_t size, Output output, bool preallocate, size_t sector_size)
+    : DiskImage(calculate_geometry(size, sector_size))
     , m_final_size(size)
     , m_disk_file()
 {
@@ -16,8 +19,43 @@ VMDKDiskImage::VMDKDiskImage(std::string_view dir_path, std::string_view image_n
 
     auto image_file_path = std::filesystem::path(dir_path) / full_image_name;
     auto image_description_file_path = std::filesystem::path(dir_path) / full_image_description_name;
+    m_data_path = image_file_path.string();
 
-    m_disk_file.open(image_file_path.string(), AutoFile::WRITE | AutoFile::TRUNCATE);
+    bool is_preallocated = false;
+
+    if (output == Output::MMAP) {
+        m_mapping = std::make_unique<MappedFile>(image_file_path.string(), size, preallocate);
+        is_preallocated = m_mapping->is_preallocated();
+    } else {
+        m_disk_file.open(image_file_path.string(), AutoFile::WRITE | AutoFile::TRUNCATE);
+        m_write_granularity = write_granularity_for(m_disk_file);
+
+        if (preallocate)
+            is_preallocated = m_disk_file.preallocate(size);
+    }
+
+    // blocks of the extent are otherwise allocated in whatever order they're written
+    if (preallocate && !is_preallocated)
+        Logger::the().warning("the host filesystem doesn't support preallocation, the image might end up fragmented");
+
+    if (output == Output::IO_URING) {
+        m_ring = std::make_unique<AsyncIO>(m_disk_file);
+
+        if (!m_ring->is_asynchronous())
+            Logger::the().warning("io_uring is not available, falling back to synchronous writes");
+
+        auto buffer_count = m_ring->queue_depth();
+        m_staging = std::make_unique<AnonymousMemory>(buffer_count * staging_buffer_size);
+        m_staged_ranges.resize(buffer_count);
+
+        std::vector<std::pair<uint8_t*, size_t>> buffers;
+        for (size_t i = 0; i < buffer_count; ++i) {
+            buffers.emplace_back(m_staging->data() + i * staging_buffer_size, staging_buffer_size);
+            m_free_staging_buffers.push_back(buffer_count - i - 1);
+        }
+
+        m_ring->register_buffers(buffers);
+    }
 
     write_description(full_image_name, image_description_file_path.string());
 }
@@ -27,14 +65,57 @@ void VMDKDiskImage::write_at(const void* data, size_t size, size_t offset)
     if (offset + size > m_final_size)
         throw std::runtime_error("disk size overflow");
 
-    auto previous_offset = m_disk_file.set_offset(offset);
+    write_range(data, size, offset);
+}
 
-    m_disk_file.write(reinterpret_cast<const uint8_t*>(data), size);
-    m_disk_file.set_offset(previous_offset);
+void VMDKDiskImage::write_fresh_at(const void* data, size_t size, size_t offset)
+{
+    if (offset + size > m_final_size)
+        throw std::runtime_error("disk size overflow");
+
+    // the extent starts out as one big hole, blocks of zeros can stay that way
+    ZeroScan::for_each_nonzero_range(data, size, offset, m_write_granularity,
+        [this](const uint8_t* range, size_t range_size, size_t range_offset) {
+            write_range(range, range_size, range_offset);
+        });
+}
+
+void VMDKDiskImage::write_range(const void* data, size_t size, size_t offset)
+{
+    if (m_mapping)
+        write_into_mapping(data, size, offset);
+    else if (m_ring)
+        write_into_ring(data, size, offset);
+    else
+        m_disk_file.write_at(reinterpret_cast<const uint8_t*>(data), size, offset);
+}
+
+void VMDKDiskImage::write_at(const IOSlice* slices, size_t count, size_t offset)
+{
+    // the mapping and the ring copy everything anyway
+    if (m_mapping || m_ring) {
+        DiskImage::write_at(slices, count, offset);
+        return;
+    }
+
+    size_t size = 0;
+    for (size_t i = 0; i < count; ++i)
+        size += slices[i].size;
+
+    if (offset + size > m_final_size)
+        throw std::runtime_error("disk size overflow");
+
+    m_disk_file.write_at(slices, count, offset);
 }
 
 void VMDKDiskImage::write(const void* data, size_t size)
 {
+    if (m_mapping || m_ring) {
+        write_at(data, size, m_offset);
+        m_offset += size;
+        return;
+    }
+
     if (m_disk_file.offset() + size > m_final_size)
         throw std::runtime_error("disk size overflow");
 
@@ -46,17 +127,118 @@ void VMDKDiskImage::set_offset(size_t offset)
     if (offset >= m_final_size)
         throw std::runtime_error("offset past end of image");
 
+    if (m_mapping || m_ring) {
+        m_offset = offset;
+        return;
+    }
+
     m_disk_file.set_offset(offset);
 }
 
 void VMDKDiskImage::skip(size_t bytes)
 {
+    if (m_mapping || m_ring) {
+        if (m_offset + bytes >= m_final_size)
+            throw std::runtime_error("skipped past the end of image");
+
+        m_offset += bytes;
+        return;
+    }
+
     if (m_disk_file.skip(bytes) >= m_final_size)
         throw std::runtime_error("skipped past the end of image");
 }
 
+void VMDKDiskImage::write_into_mapping(const void* data, size_t size, size_t offset)
+{
+    memcpy(m_mapping->data() + offset, data, size);
+
+    // widen the range written since the last flush
+    auto begin = m_unflushed_begin.load();
+    while (offset < begin && !m_unflushed_begin.compare_exchange_weak(begin, offset));
+
+    auto end = m_unflushed_end.load();
+    while (offset + size > end && !m_unflushed_end.compare_exchange_weak(end, offset + size));
+
+    if (m_unflushed_bytes.fetch_add(size) + size < mapping_flush_interval)
+        return;
+
+    // whoever crosses the interval flushes, others keep writing in the meantime
+    std::unique_lock lock(m_flush_lock, std::try_to_lock);
+    if (!lock.owns_lock())
+        return;
+
+    m_unflushed_bytes = 0;
+    begin = m_unflushed_begin.exchange(SIZE_MAX);
+    end = m_unflushed_end.exchange(0);
+
+    if (begin < end)
+        m_mapping->flush(begin, end - begin, true);
+}
+
+void VMDKDiskImage::write_into_ring(const void* data, size_t size, size_t offset)
+{
+    std::lock_guard lock(m_ring_lock);
+
+    auto* bytes = reinterpret_cast<const uint8_t*>(data);
+
+    auto overlaps_staged = [&](size_t begin, size_t end) {
+        for (auto& range : m_staged_ranges) {
+            if (begin < range.second && range.first < end)
+                return true;
+        }
+
+        return false;
+    };
+
+    // completions release what they staged, even failed ones, so with nothing in flight there's nothing to wait for
+    auto wait_for_completion = [&]() {
+        if (!m_ring->in_flight())
+            throw std::runtime_error("staging buffers are still busy with no writes in flight");
+
+        m_ring->complete(1);
+    };
+
+    while (size) {
+        // chunks after the first one start on a block boundary of the host filesystem
+        auto chunk = std::min(size, staging_buffer_size - offset % m_write_granularity);
+
+        // requests complete in any order, so a rewrite has to wait for the previous write of that range
+        while (overlaps_staged(offset, offset + chunk))
+            wait_for_completion();
+
+        while (m_free_staging_buffers.empty())
+            wait_for_completion();
+
+        auto index = m_free_staging_buffers.back();
+        m_free_staging_buffers.pop_back();
+
+        auto* buffer = m_staging->data() + index * staging_buffer_size;
+        memcpy(buffer, bytes, chunk);
+        m_staged_ranges[index] = { offset, offset + chunk };
+
+        m_ring->write_at(buffer, chunk, offset, [this, index](size_t) {
+            m_staged_ranges[index] = {};
+            m_free_staging_buffers.push_back(index);
+        }, static_cast<int>(index));
+
+        bytes += chunk;
+        size -= chunk;
+        offset += chunk;
+    }
+}
+
 void VMDKDiskImage::finalize()
 {
+    // the mapped file already has its final size, dirty pages are written back by the OS
+    if (m_mapping)
+        return;
+
+    if (m_ring) {
+        std::lock_guard lock(m_ring_lock);
+        m_ring->wait_for_all();
+    }
+
     m_disk_file.set_size(m_final_size);
 }
 
@@ -73,8 +255,11 @@ void VMDKDiskImage::write_description(const std::string& image_name, const std::
         "createType=\"monolithicFlat\"\n\n"
         "# Extent description\n";
 
+    // the descriptor counts 512 byte sectors no matter what the guest sees
+    auto descriptor_geometry = calculate_geometry(m_final_size);
+
     std::string extent_description = "RW ";
-    extent_description += std::to_string(geometry().total_sector_count);
+    extent_description += std::to_string(descriptor_geometry.total_sector_count);
     extent_description += " FLAT \"";
     extent_description += image_name;
     extent_description += "\" 0\n\n";
@@ -86,9 +271,9 @@ void VMDKDiskImage::write_description(const std::string& image_name, const std::
     static std::string ddb_vhv = "ddb.virtualHWVersion=\"16\"\n";
     static std::string ddb_at = "ddb.adapterType=\"ide\"\n";
     static std::string ddb_tv = "ddb.toolsVersion=\"0\"\n";
-    std::string ddb_gc = "ddb.geometry.cylinders=\"" + std::to_string(geometry().cylinders) + "\"\n";
-    std::string ddb_gh = "ddb.geometry.heads=\"" + std::to_string(geometry().heads) + "\"\n";
-    std::string ddb_gs = "ddb.geometry.sectors=\"" + std::to_string(geometry().sectors) + "\"\n";
+    std::string ddb_gc = "ddb.geometry.cylinders=\"" + std::to_string(descriptor_geometry.cylinders) + "\"\n";
+    std::string ddb_gh = "ddb.geometry.heads=\"" + std::to_string(descriptor_geometry.heads) + "\"\n";
+    std::string ddb_gs = "ddb.geometry.sectors=\"" + std::to_string(descriptor_geometry.sectors) + "\"\n";
 
     description_file.write(VMDK_header);
     description_file.write(extent_description);
@@ -101,20 +286,20 @@ void VMDKDiskImage::write_description(const std::string& image_name, const std::
     description_file.write(ddb_tv);
 }
 
-DiskGeometry VMDKDiskImage::calculate_geometry(size_t size_in_bytes)
+DiskGeometry VMDKDiskImage::calculate_geometry(size_t size_in_bytes, size_t sector_size)
 {
     constexpr size_t vmdk_byte_limit = 8455200768;
     constexpr size_t vmdk_cylinder_count_limit = 16383;
     constexpr size_t vmdk_ide_heads = 16;
     constexpr size_t vmdk_ide_sectors = 63;
     constexpr size_t vmdk_ide_combined = vmdk_ide_heads * vmdk_ide_sectors;
-    constexpr size_t vmdk_sector_size = 512;
 
-    if (size_in_bytes % vmdk_sector_size)
+    if (size_in_bytes % sector_size)
         throw std::runtime_error("disk size must be aligned to sector size");
 
     DiskGeometry dg;
-    dg.total_sector_count = size_in_bytes / 512;
+    dg.total_sector_count = size_in_bytes / sector_size;
+    dg.sector_size = sector_size;
     dg.heads = vmdk_ide_heads;
     dg.sectors = vmdk_ide_sectors;
     dg.cylinders = dg.total_sector_count / vmdk_ide_combined;
@@ -127,5 +312,10 @@ DiskGeometry VMDKDiskImage::calculate_geometry(size_t size_in_bytes)
 
 VMDKDiskImage::~VMDKDiskImage()
 {
-    finalize();
+    // normally finalized already, this is for images dropped because of an error elsewhere
+    try {
+        finalize();
+    } catch (const std::exception& ex) {
+        Logger::the().error(ex.what());
+    }
 }
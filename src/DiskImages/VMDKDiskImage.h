@@ -1,28 +1,80 @@
 #pragma once
 
+#include <memory>
+#include <atomic>
+#include <mutex>
+
 #include "Utilities/Common.h"
+#include "Utilities/MappedFile.h"
+#include "Utilities/AsyncIO.h"
+#include "Utilities/AnonymousMemory.h"
+#include "Utilities/ZeroScan.h"
 #include "DiskImage.h"
 
 class VMDKDiskImage final : public DiskImage
 {
 public:
-    VMDKDiskImage(std::string_view dir_path, std::string_view image_name, size_t size);
+    enum class Output {
+        // plain positional writes
+        WRITE,
+        // the flat extent is mapped into memory and written with plain memcpy
+        MMAP,
+        // writes are copied into staging buffers and completed asynchronously
+        IO_URING
+    };
+
+    // 'preallocate' allocates the whole flat extent up front instead of letting it grow as it's written
+    VMDKDiskImage(std::string_view dir_path, std::string_view image_name, size_t size, Output output = Output::WRITE, bool preallocate = false,
+                  size_t sector_size = default_sector_size);
 
     void write_at(const void* data, size_t size, size_t offset) override;
+    void write_fresh_at(const void* data, size_t size, size_t offset) override;
+    void write_at(const IOSlice* slices, size_t count, size_t offset) override;
     void write(const void* data, size_t size) override;
     void set_offset(size_t) override;
     void skip(size_t) override;
 
+    std::string data_path() const override { return m_data_path; }
+
     void finalize() override;
 
-    static DiskGeometry calculate_geometry(size_t size_in_bytes);
+    static DiskGeometry calculate_geometry(size_t size_in_bytes, size_t sector_size = default_sector_size);
 
     ~VMDKDiskImage();
 
 private:
     void write_description(const std::string& image_name, const std::string& path_to_image_description);
+    void write_range(const void* data, size_t size, size_t offset);
+    void write_into_mapping(const void* data, size_t size, size_t offset);
+    void write_into_ring(const void* data, size_t size, size_t offset);
 
 private:
     size_t m_final_size { 0 };
+    std::string m_data_path;
     AutoFile m_disk_file;
+    size_t m_write_granularity { zero_skip_granularity };
+
+    // written back and dropped every time this much has been written into the mapping,
+    // so that dirty memory doesn't pile up on images much larger than RAM
+    static constexpr size_t mapping_flush_interval = 256 * MB;
+
+    // used by write/set_offset/skip unless writing straight into m_disk_file
+    size_t m_offset { 0 };
+
+    std::unique_ptr<MappedFile> m_mapping;
+    std::atomic<size_t> m_unflushed_bytes { 0 };
+    std::atomic<size_t> m_unflushed_begin { SIZE_MAX };
+    std::atomic<size_t> m_unflushed_end { 0 };
+    std::mutex m_flush_lock;
+
+    // one staging buffer per request in flight, a buffer is busy while its range is non-empty
+    static constexpr size_t staging_buffer_size = 256 * KB;
+
+    std::unique_ptr<AnonymousMemory> m_staging;
+    std::vector<size_t> m_free_staging_buffers;
+    std::vector<std::pair<size_t, size_t>> m_staged_ranges;
+    std::mutex m_ring_lock;
+
+    // destroyed first, outstanding completions still touch the staging buffers
+    std::unique_ptr<AsyncIO> m_ring;
 };
@@ -1,91 +1,897 @@
 #include "Ext2.h"
 #include "Utilities/Common.h"
+#include "FileSystems/Inventory.h"
 
-Ext2::Ext2(DiskImage& image, size_t lba_offset, size_t sector_count, const additional_options_t& options)
+#include <ctime>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <filesystem>
+
+Ext2::Ext2(DiskImage& image, size_t lba_offset, size_t sector_count, const additional_options_t& options, Variant variant)
 	: FileSystem(image, lba_offset, sector_count)
+	, m_block_size(4096)
+	, m_bytes_per_inode(4096)
 {
-	// TODO: unhardcode later
-	size_t bytes_per_block = 4096;
-	size_t bytes_per_block_group = 128 * MB;
-	size_t bytes_per_inode_ratio = 4096;
-	
-	// TODO: log2(bytes_per_block)
-	m_superblock.s_log_block_size = 2;
-	m_superblock.s_log_cluster_size = 2;
+	if (variant == Variant::EXT4) {
+		m_inode_size = 256;
+		m_bytes_per_inode = 16384;
+		m_groups_per_flex = 1 << max_log_groups_per_flex;
+		m_use_extents = true;
+		m_lazy_inode_tables = true;
+	}
+
+	auto block_size_option = options.find("block_size");
+	if (block_size_option != options.end())
+		m_block_size = std::stoul(block_size_option->second);
+
+	if (m_block_size != 1024 && m_block_size != 2048 && m_block_size != 4096)
+		throw std::runtime_error("ext2 block size has to be one of 1024, 2048 or 4096");
+
+	auto inode_ratio_option = options.find("inode_ratio");
+	if (inode_ratio_option != options.end())
+		m_bytes_per_inode = std::stoul(inode_ratio_option->second);
+
+	if (m_bytes_per_inode < 1024)
+		throw std::runtime_error("ext2 inode ratio cannot be less than 1024 bytes per inode");
+
+	compute_geometry((sector_count * sector_size()) / m_block_size);
+
+	m_creation_time = static_cast<uint32_t>(time(nullptr));
+
+	m_superblock.s_magic = superblock_magic;
+	m_superblock.s_state = 1;  // cleanly unmounted
+	m_superblock.s_errors = 1; // continue on errors
+	m_superblock.s_max_mnt_count = 0xFFFF;
+	m_superblock.s_rev_level = 1;
+	m_superblock.s_first_ino = lost_and_found_inode;
+	m_superblock.s_inode_size = static_cast<uint16_t>(m_inode_size);
+	m_superblock.s_feature_incompat = feature_incompat_filetype;
+	m_superblock.s_feature_ro_compat = feature_ro_compat_sparse_super | feature_ro_compat_large_file;
+
+	if (variant == Variant::EXT4) {
+		m_superblock.s_feature_incompat |= feature_incompat_extents | feature_incompat_flex_bg;
+		m_superblock.s_feature_ro_compat |= feature_ro_compat_gdt_csum | feature_ro_compat_extra_isize;
+		m_superblock.s_min_extra_isize = sizeof(Inode) - 128;
+		m_superblock.s_want_extra_isize = sizeof(Inode) - 128;
+	}
 
-	m_superblock.s_blocks_count_lo = (sector_count * DiskImage::sector_size) / bytes_per_block;
-	m_superblock.s_first_data_block = bytes_per_block == 1024;
+	m_superblock.s_mkfs_time = m_creation_time;
+	m_superblock.s_wtime = m_creation_time;
+	m_superblock.s_lastcheck = m_creation_time;
 
-	auto free_bytes = m_superblock.s_blocks_count_lo * bytes_per_block;
+	std::random_device random;
+	for (auto& byte : m_superblock.s_uuid)
+		byte = static_cast<uint8_t>(random());
+	for (auto& seed : m_superblock.s_hash_seed)
+		seed = random();
 
-	m_superblock.s_inodes_count = ceiling_divide(free_bytes, bytes_per_inode_ratio);
-	m_superblock.s_free_inodes_count = m_superblock.s_inodes_count;
-	m_superblock.s_blocks_per_group = bytes_per_block_group / bytes_per_block;
+	auto dedup_option = options.find("dedup");
+	if (dedup_option != options.end())
+		m_deduplicate = interpret_boolean(dedup_option->second);
 
-	auto block_groups = ceiling_divide(m_superblock.s_blocks_count_lo, m_superblock.s_blocks_per_group);
-	m_superblock.s_inodes_per_group = ceiling_divide(m_superblock.s_inodes_count, block_groups);
+	auto label_option = options.find("label");
+	if (label_option != options.end())
+		strncpy(m_superblock.s_volume_name, label_option->second.c_str(), sizeof(m_superblock.s_volume_name));
 
-	auto blocks_for_group_descriptors = ceiling_divide(block_groups * sizeof(BlockGroupDescriptor32), bytes_per_block);
-	auto blocks_for_inodes = ceiling_divide<size_t>(m_superblock.s_inodes_per_group * m_superblock.s_inode_size, bytes_per_block);
+	auto block_groups = m_block_groups.size();
+	auto inodes_per_group = m_superblock.s_inodes_per_group;
 
-	size_t blocks_left = m_superblock.s_blocks_count_lo;
-	size_t block_offset = m_superblock.s_first_data_block + 1;
-	size_t block_group_idx = 0;
+	for (size_t i = 0; i < block_groups; ++i) {
+		auto& bg = m_block_groups[i];
 
-	m_block_groups.resize(block_groups);
-	for (auto& bg : m_block_groups) {
-		auto offset_within_group = block_offset;
+		bg.block_bitmap = Bitmap(m_block_size * 8);
+		bg.inode_bitmap = Bitmap(m_block_size * 8);
 
-		bg.block_bitmap.resize(bytes_per_block);
-		bg.inode_bitmap.resize(m_superblock.s_inodes_per_group);
+		// metadata of a whole flex group is packed into its first block group,
+		// all block bitmaps first, then all inode bitmaps, then all inode tables
+		auto first_in_flex = i - i % m_groups_per_flex;
+		auto index_in_flex = static_cast<uint32_t>(i - first_in_flex);
+		auto groups_in_flex = static_cast<uint32_t>(block_groups_in_flex(first_in_flex));
 
-		offset_within_group += blocks_for_group_descriptors;
+		auto block = first_block_of(first_in_flex);
+		if (has_superblock_backup(first_in_flex))
+			block += 1 + static_cast<uint32_t>(m_group_descriptor_blocks);
 
 		auto& desc = bg.descriptor;
-		desc.bg_block_bitmap_lo = offset_within_group++;
-		desc.bg_inode_bitmap_lo = offset_within_group++;
-		desc.bg_inode_table_lo = offset_within_group;
-		offset_within_group += blocks_for_inodes;
+		desc.bg_block_bitmap_lo = block + index_in_flex;
+		desc.bg_inode_bitmap_lo = block + groups_in_flex + index_in_flex;
+		desc.bg_inode_table_lo = block + 2 * groups_in_flex + index_in_flex * static_cast<uint32_t>(m_inode_table_blocks);
 
-		desc.bg_free_inodes_count_lo = m_superblock.s_inodes_per_group;
-		desc.bg_free_blocks_count_lo = m_superblock.s_blocks_per_group - (offset_within_group - block_offset);
+		bg.block_bitmap.set_range(0, metadata_blocks_of(i));
 
-		mark_as_allocated(block_group_idx++, 0, offset_within_group, Type::BLOCK);
+		// bitmap bits past the end of the group are always set
+		bg.block_bitmap.set_range(block_count_of(i), m_block_size * 8);
+		bg.inode_bitmap.set_range(inodes_per_group, m_block_size * 8);
 	}
 
 	// reserve first 10 inodes
-	mark_as_allocated(0, 0, 11, Type::INODE);
+	m_block_groups[0].inodes.resize(lost_and_found_inode - 1);
+	m_block_groups[0].inode_bitmap.set_range(0, lost_and_found_inode - 1);
+	m_next_inode = lost_and_found_inode;
+
+	initialize_inode(inode(root_inode), mode_directory | 0755);
+	auto root = create_directory(no_index, {}, root_inode);
+
+	create_directory(root, "lost+found", allocate_inode(mode_directory | 0700));
+}
+
+void Ext2::compute_geometry(size_t block_count)
+{
+	if (block_count > 0xFFFFFFFF)
+		throw std::runtime_error("ext2 cannot address more than 2^32 blocks, use a bigger block size");
+
+	uint32_t log_block_size = 0;
+	while ((1024u << log_block_size) < m_block_size)
+		++log_block_size;
+
+	m_superblock.s_log_block_size = log_block_size;
+	m_superblock.s_log_cluster_size = log_block_size;
+	m_superblock.s_first_data_block = m_block_size == 1024;
+
+	auto blocks_per_group = m_block_size * 8;
+	m_superblock.s_blocks_per_group = static_cast<uint32_t>(blocks_per_group);
+	m_superblock.s_clusters_per_group = static_cast<uint32_t>(blocks_per_group);
+
+	auto first_data_block = m_superblock.s_first_data_block;
+
+	// inodes per group has to fill the inode table blocks and be a multiple of 8
+	auto inode_granularity = std::max<size_t>(m_block_size / m_inode_size, 8);
+
+	for (;;) {
+		if (block_count <= first_data_block)
+			throw std::runtime_error("disk is too small for ext2");
+
+		auto block_groups = ceiling_divide<size_t>(block_count - first_data_block, blocks_per_group);
+		m_group_descriptor_blocks = ceiling_divide(block_groups * sizeof(BlockGroupDescriptor32), m_block_size);
+
+		auto inodes_per_group = ceiling_divide<size_t>(block_count * m_block_size / m_bytes_per_inode, block_groups);
+		inodes_per_group = ceiling_divide(std::max<size_t>(inodes_per_group, 16), inode_granularity) * inode_granularity;
+		inodes_per_group = std::min(inodes_per_group, blocks_per_group);
+
+		m_inode_table_blocks = inodes_per_group * m_inode_size / m_block_size;
+
+		// the packed metadata of a flex group has to fit into its first block group
+		auto first_group_overhead = [&]() {
+			return 1 + m_group_descriptor_blocks + m_groups_per_flex * (2 + m_inode_table_blocks);
+		};
+
+		while (m_groups_per_flex > 1 && first_group_overhead() >= blocks_per_group)
+			m_groups_per_flex /= 2;
+
+		uint8_t log_groups_per_flex = 0;
+		while ((size_t(1) << log_groups_per_flex) < m_groups_per_flex)
+			++log_groups_per_flex;
+		m_superblock.s_log_groups_per_flex = m_groups_per_flex > 1 ? log_groups_per_flex : 0;
+
+		m_superblock.s_inodes_per_group = static_cast<uint32_t>(inodes_per_group);
+		m_superblock.s_blocks_count_lo = static_cast<uint32_t>(block_count);
+		m_block_groups.resize(block_groups);
+
+		// a last group that barely fits its own metadata is not worth having
+		auto last_group = block_groups - 1;
+		auto overhead = metadata_blocks_of(last_group);
+
+		if (block_groups > 1 && block_count_of(last_group) < overhead + 50) {
+			block_count = first_data_block + last_group * blocks_per_group;
+			continue;
+		}
+
+		if (block_count_of(last_group) <= overhead)
+			throw std::runtime_error("disk is too small for ext2");
+
+		m_superblock.s_inodes_count = static_cast<uint32_t>(inodes_per_group * block_groups);
+		return;
+	}
+}
+
+bool Ext2::has_superblock_backup(size_t block_group) const
+{
+	// sparse_super: only groups 0, 1 and powers of 3, 5 and 7 get a copy
+	if (block_group <= 1)
+		return true;
+
+	for (size_t base : { 3, 5, 7 }) {
+		auto power = base;
+
+		while (power < block_group)
+			power *= base;
+
+		if (power == block_group)
+			return true;
+	}
+
+	return false;
+}
+
+uint32_t Ext2::first_block_of(size_t block_group) const
+{
+	return m_superblock.s_first_data_block + static_cast<uint32_t>(block_group) * m_superblock.s_blocks_per_group;
+}
+
+uint32_t Ext2::block_count_of(size_t block_group) const
+{
+	return std::min(m_superblock.s_blocks_per_group, m_superblock.s_blocks_count_lo - first_block_of(block_group));
+}
+
+uint32_t Ext2::metadata_blocks_of(size_t block_group) const
+{
+	size_t blocks = 0;
+
+	if (has_superblock_backup(block_group))
+		blocks += 1 + m_group_descriptor_blocks;
+
+	// bitmaps and inode tables of the entire flex group
+	if (block_group % m_groups_per_flex == 0)
+		blocks += block_groups_in_flex(block_group) * (2 + m_inode_table_blocks);
+
+	return static_cast<uint32_t>(blocks);
+}
+
+size_t Ext2::block_groups_in_flex(size_t first_block_group) const
+{
+	return std::min(m_groups_per_flex, m_block_groups.size() - first_block_group);
+}
+
+size_t Ext2::block_to_byte_offset(uint32_t block) const
+{
+	return lba_offset() * sector_size() + static_cast<size_t>(block) * m_block_size;
+}
+
+void Ext2::initialize_inode(Inode& node, uint16_t mode) const
+{
+	node.i_mode = mode;
+	node.i_links_count = 1;
+	node.i_extra_isize = m_inode_size > 128 ? sizeof(Inode) - 128 : 0;
+	node.i_atime = m_creation_time;
+	node.i_ctime = m_creation_time;
+	node.i_mtime = m_creation_time;
+}
+
+uint32_t Ext2::allocate_inode(uint16_t mode)
+{
+	if (m_next_inode > m_superblock.s_inodes_count)
+		throw std::runtime_error("ext2 ran out of free inodes, try a smaller inode_ratio");
+
+	auto number = m_next_inode++;
+	auto block_group = (number - 1) / m_superblock.s_inodes_per_group;
+	auto index = (number - 1) % m_superblock.s_inodes_per_group;
+
+	auto& bg = m_block_groups[block_group];
+	bg.inodes.emplace_back();
+	bg.inode_bitmap.set(index);
+
+	initialize_inode(bg.inodes.back(), mode);
+
+	return number;
+}
+
+Inode& Ext2::inode(uint32_t number)
+{
+	auto& bg = m_block_groups[(number - 1) / m_superblock.s_inodes_per_group];
+	return bg.inodes[(number - 1) % m_superblock.s_inodes_per_group];
+}
+
+uint32_t Ext2::allocate_block()
+{
+	return allocate_blocks(1).front();
+}
+
+std::vector<uint32_t> Ext2::allocate_blocks(size_t count)
+{
+	std::vector<uint32_t> blocks;
+	blocks.reserve(count);
+
+	auto take = [&](size_t block_group, size_t start, size_t length) {
+		m_block_groups[block_group].block_bitmap.set_range(start, start + length);
+
+		auto first_block = first_block_of(block_group) + static_cast<uint32_t>(start);
+		for (uint32_t i = 0; i < length; ++i)
+			blocks.push_back(first_block + i);
+	};
+
+	// keep it in one piece if the current block group still has room for all of it
+	if (m_allocation_group < m_block_groups.size() && count <= m_superblock.s_blocks_per_group) {
+		auto start = m_block_groups[m_allocation_group].block_bitmap.find_clear_run(count);
+
+		if (start != Bitmap::npos) {
+			take(m_allocation_group, start, count);
+			return blocks;
+		}
+	}
+
+	while (blocks.size() < count) {
+		if (m_allocation_group >= m_block_groups.size())
+			throw std::runtime_error("ext2 ran out of free blocks");
+
+		auto& bitmap = m_block_groups[m_allocation_group].block_bitmap;
+		auto start = bitmap.find_first_clear();
+
+		if (start == Bitmap::npos) {
+			++m_allocation_group;
+			continue;
+		}
+
+		take(m_allocation_group, start, bitmap.clear_run_length(start, count - blocks.size()));
+	}
+
+	return blocks;
+}
+
+void Ext2::map_blocks(uint32_t inode_number, const std::vector<uint32_t>& blocks)
+{
+	if (m_use_extents) {
+		map_extents(inode_number, blocks);
+		return;
+	}
+
+	auto& node = inode(inode_number);
+
+	size_t index = 0;
+	size_t indirect_count = 0;
+
+	for (; index < direct_blocks && index < blocks.size(); ++index)
+		node.i_block[index] = blocks[index];
+
+	// single, double and triple indirect
+	for (size_t level = 1; level <= 3 && index < blocks.size(); ++level)
+		node.i_block[direct_blocks + level - 1] = write_indirect_block(level, blocks, index, indirect_count);
+
+	if (index < blocks.size())
+		throw std::runtime_error("file is too large for ext2");
+
+	node.i_blocks_lo = static_cast<uint32_t>((blocks.size() + indirect_count) * (m_block_size / 512));
+}
+
+uint32_t Ext2::write_indirect_block(size_t level, const std::vector<uint32_t>& blocks, size_t& index, size_t& indirect_count)
+{
+	auto block = allocate_block();
+	++indirect_count;
+
+	std::vector<uint32_t> pointers(m_block_size / sizeof(uint32_t));
+
+	for (auto& pointer : pointers) {
+		if (index >= blocks.size())
+			break;
+
+		pointer = level == 1 ? blocks[index++] : write_indirect_block(level - 1, blocks, index, indirect_count);
+	}
+
+	image().write_at(reinterpret_cast<const uint8_t*>(pointers.data()), m_block_size, block_to_byte_offset(block));
+
+	return block;
+}
+
+void Ext2::map_extents(uint32_t inode_number, const std::vector<uint32_t>& blocks)
+{
+	std::vector<Extent> extents;
+
+	for (size_t i = 0; i < blocks.size(); ++i) {
+		if (!extents.empty()) {
+			auto& last = extents.back();
+
+			if (last.ee_start_lo + last.ee_len == blocks[i] && last.ee_len < max_extent_length) {
+				++last.ee_len;
+				continue;
+			}
+		}
+
+		extents.push_back({ static_cast<uint32_t>(i), 1, 0, blocks[i] });
+	}
+
+	auto& node = inode(inode_number);
+
+	static constexpr size_t entries_in_inode = (sizeof(node.i_block) - sizeof(ExtentHeader)) / sizeof(Extent);
+	auto entries_per_block = (m_block_size - sizeof(ExtentHeader)) / sizeof(Extent);
+
+	size_t tree_blocks = 0;
+
+	// packs the entries of one level into tree blocks, returns the entries of the level above
+	auto write_level = [&](const auto& entries, uint16_t depth) {
+		std::vector<ExtentIndex> parents;
+		std::vector<uint8_t> tree_block(m_block_size);
+
+		for (size_t i = 0; i < entries.size(); i += entries_per_block) {
+			auto count = std::min(entries_per_block, entries.size() - i);
+
+			ExtentHeader header { extent_magic, static_cast<uint16_t>(count), static_cast<uint16_t>(entries_per_block), depth, 0 };
+
+			std::fill(tree_block.begin(), tree_block.end(), 0);
+			memcpy(tree_block.data(), &header, sizeof(header));
+			memcpy(tree_block.data() + sizeof(header), &entries[i], count * sizeof(entries[i]));
+
+			auto block = allocate_block();
+			++tree_blocks;
+			image().write_at(tree_block.data(), m_block_size, block_to_byte_offset(block));
+
+			uint32_t first_logical_block;
+			memcpy(&first_logical_block, &entries[i], sizeof(uint32_t));
+			parents.push_back({ first_logical_block, block, 0, 0 });
+		}
+
+		return parents;
+	};
+
+	uint16_t depth = 0;
+	std::vector<ExtentIndex> indices;
+
+	if (extents.size() > entries_in_inode) {
+		indices = write_level(extents, depth++);
+
+		while (indices.size() > entries_in_inode)
+			indices = write_level(indices, depth++);
+	}
+
+	auto entries = depth ? indices.size() : extents.size();
+	ExtentHeader root { extent_magic, static_cast<uint16_t>(entries), static_cast<uint16_t>(entries_in_inode), depth, 0 };
+
+	auto* root_bytes = reinterpret_cast<uint8_t*>(node.i_block);
+	memcpy(root_bytes, &root, sizeof(root));
+
+	if (depth)
+		memcpy(root_bytes + sizeof(root), indices.data(), entries * sizeof(ExtentIndex));
+	else
+		memcpy(root_bytes + sizeof(root), extents.data(), entries * sizeof(Extent));
+
+	node.i_flags |= inode_flag_extents;
+	node.i_blocks_lo = static_cast<uint32_t>((blocks.size() + tree_blocks) * (m_block_size / 512));
+}
+
+size_t Ext2::mapping_blocks_for(size_t count) const
+{
+	if (m_use_extents) {
+		// extents break at their maximum length and wherever block group metadata is in the way
+		auto entries = ceiling_divide<size_t>(count, max_extent_length) + ceiling_divide<size_t>(count, m_superblock.s_blocks_per_group) + 1;
+
+		static constexpr size_t entries_in_inode = (sizeof(Inode::i_block) - sizeof(ExtentHeader)) / sizeof(Extent);
+		auto entries_per_block = (m_block_size - sizeof(ExtentHeader)) / sizeof(Extent);
+
+		size_t blocks = 0;
+		while (entries > entries_in_inode) {
+			entries = ceiling_divide(entries, entries_per_block);
+			blocks += entries;
+		}
+
+		return blocks;
+	}
+
+	if (count <= direct_blocks)
+		return 0;
+
+	count -= direct_blocks;
+
+	// a tree of N levels takes a block for every pointers_per_block^1..N data blocks it maps
+	auto pointers_per_block = m_block_size / sizeof(uint32_t);
+	size_t capacity = 1;
+	size_t blocks = 0;
+
+	for (size_t level = 1; level <= 3 && count; ++level) {
+		capacity *= pointers_per_block;
+		auto mapped = std::min(count, capacity);
 
-	// Revision 0 means these are hardcoded
-	m_superblock.s_inode_size = 128;
-	m_superblock.s_first_ino = 11;
+		for (size_t span = pointers_per_block; span <= capacity; span *= pointers_per_block)
+			blocks += ceiling_divide(mapped, span);
+
+		count -= mapped;
+	}
+
+	return blocks;
+}
+
+Ext2::index_t Ext2::create_directory(index_t parent, std::string_view name, uint32_t inode_number)
+{
+	auto index = static_cast<index_t>(m_directories.size());
+
+	auto& directory = m_directories.emplace_back();
+	directory.inode = inode_number;
+
+	inode(inode_number).i_links_count = 2;
+	++m_block_groups[(inode_number - 1) / m_superblock.s_inodes_per_group].descriptor.bg_used_dirs_count_lo;
+
+	auto parent_inode = parent == no_index ? inode_number : m_directories[parent].inode;
+
+	store_entry(index, ".", inode_number, file_type_directory);
+	store_entry(index, "..", parent_inode, file_type_directory);
+
+	if (parent != no_index) {
+		store_entry(parent, name, inode_number, file_type_directory);
+		m_directories[parent].children.push_back({ m_names.add(name), index });
+		++inode(parent_inode).i_links_count;
+	}
+
+	return index;
 }
 
-void Ext2::store(const FSObject&)
+uint32_t Ext2::directory_entry_size(std::string_view name)
 {
+	static constexpr size_t header_size = 8;
 
+	return static_cast<uint32_t>(ceiling_divide<size_t>(header_size + name.size(), 4) * 4);
 }
 
-void Ext2::mark_as_allocated(size_t block_group, size_t begin, size_t end, Type type)
+void Ext2::store_entry(index_t index, std::string_view name, uint32_t inode_number, uint8_t file_type)
 {
-	auto& bg = m_block_groups.at(block_group);
+	static constexpr size_t header_size = 8;
+
+	auto& directory = m_directories[index];
+	auto entry_size = directory_entry_size(name);
+
+	if (directory.blocks.empty() || directory.offset_within_block + entry_size > m_block_size) {
+		directory.blocks.push_back(allocate_block());
+		directory.offset_within_block = 0;
+		inode(directory.inode).i_size_lo += static_cast<uint32_t>(m_block_size);
+	} else {
+		// the previous last entry now ends where this one begins
+		auto previous_length = static_cast<uint16_t>(directory.offset_within_block - directory.last_entry_offset);
+		auto previous_offset = block_to_byte_offset(directory.blocks.back()) + directory.last_entry_offset;
 
-	auto& bitmap = type == Type::INODE ? bg.inode_bitmap : bg.block_bitmap;
+		image().write_at(reinterpret_cast<const uint8_t*>(&previous_length), sizeof(uint16_t), previous_offset + offsetof(DirectoryEntry, rec_len));
+	}
+
+	DirectoryEntry entry {};
+	entry.inode = inode_number;
+	entry.rec_len = static_cast<uint16_t>(m_block_size - directory.offset_within_block);
+	entry.name_len = static_cast<uint8_t>(name.size());
+	entry.file_type = file_type;
+	memcpy(entry.name, name.data(), name.size());
+
+	auto offset = block_to_byte_offset(directory.blocks.back()) + directory.offset_within_block;
+	image().write_at(reinterpret_cast<const uint8_t*>(&entry), header_size + name.size(), offset);
+
+	directory.last_entry_offset = directory.offset_within_block;
+	directory.offset_within_block += entry_size;
+}
+
+Ext2::index_t Ext2::find_subdirectory(index_t directory, std::string_view name) const
+{
+	for (auto& child : m_directories[directory].children) {
+		if (child.name == name)
+			return child.directory;
+	}
+
+	return no_index;
+}
+
+void Ext2::validate_new_name(index_t directory, std::string_view name) const
+{
+	if (name.empty() || name.size() > 255 || name == "." || name == "..")
+		throw std::runtime_error("invalid ext2 filename " + std::string(name));
+
+	if (name.find_first_of(std::string_view("/\0", 2)) != std::string_view::npos)
+		throw std::runtime_error("invalid ext2 filename " + std::string(name));
+
+	for (auto& child : m_directories[directory].children) {
+		if (child.name == name)
+			throw std::runtime_error("file " + std::string(name) + " already exists");
+	}
+}
+
+static directory_handle_t to_handle(uint32_t index)
+{
+	return reinterpret_cast<directory_handle_t>(static_cast<uintptr_t>(index) + 1);
+}
+
+static uint32_t to_index(directory_handle_t handle)
+{
+	return static_cast<uint32_t>(reinterpret_cast<uintptr_t>(handle) - 1);
+}
+
+directory_handle_t Ext2::open_directory(std::string_view path)
+{
+	index_t directory = 0;
 
-	for (size_t i = begin; i < end; ++i) {
-		auto byte_offset = begin / 8;
-		auto bit_offset = begin % 8;
-	
-		if ((bit_offset == 0) && ((end - i) > 8)) {
-			bitmap.at(byte_offset) = 0xFF;
-			i += 7;
+	for (auto& component : std::filesystem::path(path)) {
+		if (component.empty() || component == "/" || component == "\\")
 			continue;
+
+		directory = find_subdirectory(directory, component.string());
+
+		if (directory == no_index)
+			throw std::runtime_error("no such directory " + std::string(path));
+	}
+
+	return to_handle(directory);
+}
+
+directory_handle_t Ext2::find_directory_in(directory_handle_t directory, std::string_view name)
+{
+	auto subdirectory = find_subdirectory(to_index(directory), name);
+
+	return subdirectory == no_index ? nullptr : to_handle(subdirectory);
+}
+
+void Ext2::store_in(directory_handle_t handle, std::string_view name, const std::vector<uint8_t>& data, uint8_t attributes)
+{
+	store_contents(to_index(handle), name, data, attributes);
+}
+
+void Ext2::store_file_in(directory_handle_t handle, std::string_view name, HostFile& file, uint8_t attributes)
+{
+	// deduplication hashes the whole file anyway, so only sparse files are worth streaming
+	if (m_deduplicate && !file.is_sparse()) {
+		store_in(handle, name, file.read_entire(), attributes);
+		return;
+	}
+
+	store_contents(to_index(handle), name, file, attributes);
+}
+
+void Ext2::store_contents(index_t directory, std::string_view name, const FileContents& contents, uint8_t attributes)
+{
+	validate_new_name(directory, name);
+
+	uint16_t permissions = (attributes & FSObject::READ_ONLY) ? 0444 : 0644;
+	uint16_t mode = mode_regular_file | permissions;
+
+	SHA256::digest_t digest {};
+	auto* data = contents.in_memory();
+	auto deduplicate = m_deduplicate && data && !data->empty();
+
+	if (deduplicate) {
+		digest = SHA256::of(data->data(), data->size());
+
+		auto existing = m_inodes_by_content.find(digest);
+		if (existing != m_inodes_by_content.end()) {
+			auto& node = inode(existing->second);
+
+			if (node.i_mode == mode && node.i_links_count < max_links) {
+				++node.i_links_count;
+				++m_deduplicated_files;
+
+				store_entry(directory, name, existing->second, file_type_regular);
+				m_directories[directory].children.push_back({ m_names.add(name), no_index });
+				return;
+			}
 		}
-		 
-		bitmap.at(byte_offset) |= 1 << bit_offset;
 	}
+
+	auto inode_number = allocate_inode(mode);
+
+	auto blocks = allocate_blocks(ceiling_divide(contents.size(), m_block_size));
+
+	// contiguous runs of blocks only break at block group metadata, each one is written at once
+	std::vector<std::pair<size_t, size_t>> layout;
+	for (size_t i = 0; i < blocks.size();) {
+		auto end = i + 1;
+		while (end < blocks.size() && blocks[end] == blocks[end - 1] + 1)
+			++end;
+
+		layout.emplace_back(block_to_byte_offset(blocks[i]), (end - i) * m_block_size);
+		i = end;
+	}
+
+	contents.write_into(image(), layout);
+
+	auto& node = inode(inode_number);
+	node.i_size_lo = static_cast<uint32_t>(contents.size());
+	node.i_size_high = static_cast<uint32_t>(static_cast<uint64_t>(contents.size()) >> 32);
+
+	map_blocks(inode_number, blocks);
+
+	store_entry(directory, name, inode_number, file_type_regular);
+	m_directories[directory].children.push_back({ m_names.add(name), no_index });
+
+	if (deduplicate)
+		m_inodes_by_content[digest] = inode_number;
 }
 
-Ext2::~Ext2()
+directory_handle_t Ext2::store_directory_in(directory_handle_t handle, std::string_view name)
 {
+	auto directory = to_index(handle);
+	validate_new_name(directory, name);
+
+	return to_handle(create_directory(directory, name, allocate_inode(mode_directory | 0755)));
+}
+
+FileSystem::SpaceEstimate Ext2::estimate(const Inventory& inventory)
+{
+	SpaceEstimate estimate {};
+	estimate.unit_size = m_block_size;
+	estimate.inodes_free = m_superblock.s_inodes_count - (m_next_inode - 1);
+
+	for (auto& bg : m_block_groups)
+		estimate.units_free += m_block_size * 8 - bg.block_bitmap.set_count();
+
+	struct DirectoryUsage {
+		size_t blocks;
+		size_t used_bytes;
+	};
+
+	// every new directory starts with a block holding '.' and '..', the root already has its entries
+	auto& root = m_directories.front();
+	std::vector<DirectoryUsage> directories(inventory.directory_count(), { 1, 2 * directory_entry_size("..") });
+	directories[0] = { root.blocks.size(), root.offset_within_block };
+
+	// with dedup=yes some files might end up as hard links, so this is an upper bound
+	for (auto& entry : inventory.entries()) {
+		++estimate.inodes_needed;
+
+		if (entry.directory == Inventory::no_index) {
+			auto blocks = ceiling_divide(entry.size, m_block_size);
+			estimate.units_needed += blocks + (blocks ? mapping_blocks_for(blocks) : 0);
+		}
+
+		auto size = directory_entry_size(entry.name);
+		auto& parent = directories[entry.parent];
+
+		if (parent.used_bytes + size > m_block_size) {
+			++parent.blocks;
+			parent.used_bytes = 0;
+		}
+
+		parent.used_bytes += size;
+	}
+
+	// directories are mapped once they're complete, the root's first block is allocated already
+	for (auto& directory : directories)
+		estimate.units_needed += directory.blocks + mapping_blocks_for(directory.blocks);
+
+	estimate.units_needed -= root.blocks.size();
+
+	return estimate;
+}
+
+void Ext2::finalize()
+{
+	if (m_deduplicate)
+		Logger::the().info("ext2: stored ", m_deduplicated_files, " duplicate files as hard links");
+
+	// directories only learn their final size now
+	for (auto& directory : m_directories)
+		map_blocks(directory.inode, directory.blocks);
+
+	// every flex group only touches its own bitmaps and inode tables, so they are built concurrently
+	std::atomic<size_t> next_flex_group { 0 };
+	auto flex_groups = ceiling_divide(m_block_groups.size(), m_groups_per_flex);
+
+	std::mutex error_lock;
+	std::exception_ptr first_error;
+
+	auto work = [&]() {
+		for (;;) {
+			auto index = next_flex_group++;
+			if (index >= flex_groups)
+				return;
+
+			try {
+				write_flex_group_metadata(index * m_groups_per_flex);
+			} catch (...) {
+				std::lock_guard<std::mutex> lock(error_lock);
+				if (!first_error)
+					first_error = std::current_exception();
+			}
+		}
+	};
+
+	auto thread_count = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), flex_groups);
+
+	std::vector<std::thread> workers;
+	for (size_t i = 1; i < thread_count; ++i)
+		workers.emplace_back(work);
+
+	work();
+
+	for (auto& worker : workers)
+		worker.join();
+
+	if (first_error)
+		std::rethrow_exception(first_error);
+
+	write_superblocks();
+}
+
+void Ext2::write_flex_group_metadata(size_t first_block_group)
+{
+	auto block_groups = block_groups_in_flex(first_block_group);
+	auto inodes_per_group = m_superblock.s_inodes_per_group;
+	auto table_bytes = m_inode_table_blocks * m_block_size;
+
+	// inode tables are only written up to the last one in use when they're lazily initialized
+	size_t used_table_bytes = m_lazy_inode_tables ? 0 : block_groups * table_bytes;
+
+	for (size_t i = 0; i < block_groups; ++i) {
+		auto& bg = m_block_groups[first_block_group + i];
+		auto& desc = bg.descriptor;
+
+		desc.bg_free_blocks_count_lo = static_cast<uint16_t>(bg.block_bitmap.clear_count());
+		desc.bg_free_inodes_count_lo = static_cast<uint16_t>(bg.inode_bitmap.clear_count());
+
+		if (!m_lazy_inode_tables)
+			continue;
+
+		desc.bg_itable_unused_lo = static_cast<uint16_t>(inodes_per_group - bg.inodes.size());
+
+		if (bg.inodes.empty())
+			desc.bg_flags |= block_group_inode_uninit;
+		else
+			used_table_bytes = i * table_bytes + bg.inodes.size() * m_inode_size;
+	}
+
+	// block bitmaps, inode bitmaps and the inode tables are laid out back to back
+	auto bitmap_bytes = 2 * block_groups * m_block_size;
+	std::vector<uint8_t> metadata(bitmap_bytes + ceiling_divide(used_table_bytes, m_block_size) * m_block_size);
+
+	auto bytes_to_copy = std::min(sizeof(Inode), m_inode_size);
+
+	for (size_t i = 0; i < block_groups; ++i) {
+		auto& bg = m_block_groups[first_block_group + i];
+
+		bg.block_bitmap.copy_to(metadata.data() + i * m_block_size);
+		bg.inode_bitmap.copy_to(metadata.data() + (block_groups + i) * m_block_size);
+
+		auto* inode_table = metadata.data() + bitmap_bytes + i * table_bytes;
+
+		for (size_t j = 0; j < bg.inodes.size(); ++j)
+			memcpy(inode_table + j * m_inode_size, &bg.inodes[j], bytes_to_copy);
+	}
+
+	auto& first_descriptor = m_block_groups[first_block_group].descriptor;
+	image().write_at(metadata.data(), metadata.size(), block_to_byte_offset(first_descriptor.bg_block_bitmap_lo));
+}
+
+uint16_t Ext2::descriptor_checksum(size_t block_group) const
+{
+	// CRC16 (ANSI, reflected) over the filesystem UUID, group number and the descriptor up to the checksum
+	auto crc16 = [](uint16_t crc, const void* data, size_t length) {
+		auto* bytes = reinterpret_cast<const uint8_t*>(data);
+
+		for (size_t i = 0; i < length; ++i) {
+			crc ^= bytes[i];
+
+			for (size_t bit = 0; bit < 8; ++bit)
+				crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+		}
+
+		return crc;
+	};
+
+	auto group_number = static_cast<uint32_t>(block_group);
+	auto& desc = m_block_groups[block_group].descriptor;
+
+	uint16_t crc = crc16(0xFFFF, m_superblock.s_uuid, sizeof(m_superblock.s_uuid));
+	crc = crc16(crc, &group_number, sizeof(group_number));
+	crc = crc16(crc, &desc, offsetof(BlockGroupDescriptor32, bg_checksum));
+
+	return crc;
+}
+
+void Ext2::write_superblocks()
+{
+	size_t free_blocks = 0;
+	size_t free_inodes = 0;
+
+	std::vector<uint8_t> descriptors(m_group_descriptor_blocks * m_block_size);
+
+	for (size_t i = 0; i < m_block_groups.size(); ++i) {
+		auto& desc = m_block_groups[i].descriptor;
+
+		if (m_superblock.s_feature_ro_compat & feature_ro_compat_gdt_csum)
+			desc.bg_checksum = descriptor_checksum(i);
+
+		free_blocks += desc.bg_free_blocks_count_lo;
+		free_inodes += desc.bg_free_inodes_count_lo;
+
+		memcpy(descriptors.data() + i * sizeof(BlockGroupDescriptor32), &desc, sizeof(BlockGroupDescriptor32));
+	}
+
+	m_superblock.s_free_blocks_count_lo = static_cast<uint32_t>(free_blocks);
+	m_superblock.s_free_inodes_count = static_cast<uint32_t>(free_inodes);
+
+	for (size_t i = 0; i < m_block_groups.size(); ++i) {
+		if (!has_superblock_backup(i))
+			continue;
+
+		auto superblock = m_superblock;
+		superblock.s_block_group_nr = static_cast<uint16_t>(i);
+
+		// with blocks bigger than 1K the primary superblock shares block 0 with the boot sector
+		auto first_block = first_block_of(i);
+		auto superblock_byte_offset = block_to_byte_offset(first_block) + (first_block == 0 ? superblock_offset : 0);
+
+		image().write_at(reinterpret_cast<const uint8_t*>(&superblock), sizeof(superblock), superblock_byte_offset);
+		image().write_at(descriptors.data(), descriptors.size(), block_to_byte_offset(first_block + 1));
+	}
 }
@@ -1,32 +1,161 @@
 #pragma once
 
+#include <vector>
+#include <string_view>
+#include <unordered_map>
+#include <cstring>
+
 #include "FileSystems/FileSystem.h"
 #include "FileSystems/Ext/Structures.h"
+#include "Utilities/StringPool.h"
+#include "Utilities/Bitmap.h"
+#include "Utilities/SHA256.h"
 
 class Ext2 final : public FileSystem {
 public:
-	Ext2(DiskImage& image, size_t lba_offset, size_t sector_count, const additional_options_t& options);
+	// EXT4 lays out the same structures with extents, flex_bg and lazily initialized inode tables
+	enum class Variant {
+		EXT2,
+		EXT4
+	};
 
-	void store(const FSObject&) override;
+	Ext2(DiskImage& image, size_t lba_offset, size_t sector_count, const additional_options_t& options, Variant = Variant::EXT2);
 
-	~Ext2();
+	void finalize() override;
+	directory_handle_t open_directory(std::string_view path) override;
+	directory_handle_t find_directory_in(directory_handle_t directory, std::string_view name) override;
+	void store_in(directory_handle_t directory, std::string_view name, const std::vector<uint8_t>& data, uint8_t attributes) override;
+	void store_file_in(directory_handle_t directory, std::string_view name, HostFile& file, uint8_t attributes) override;
+	directory_handle_t store_directory_in(directory_handle_t directory, std::string_view name) override;
+	SpaceEstimate estimate(const Inventory&) override;
 
 private:
-	enum class Type {
-		INODE,
-		BLOCK
-	};
-	void mark_as_allocated(size_t block_group, size_t begin, size_t end, Type);
+	using index_t = uint32_t;
+	static constexpr index_t no_index = 0xFFFFFFFF;
+
+	void compute_geometry(size_t block_count);
+	bool has_superblock_backup(size_t block_group) const;
+	uint32_t first_block_of(size_t block_group) const;
+	uint32_t block_count_of(size_t block_group) const;
+	uint32_t metadata_blocks_of(size_t block_group) const;
+	size_t block_groups_in_flex(size_t first_block_group) const;
+	size_t block_to_byte_offset(uint32_t block) const;
+
+	uint32_t allocate_inode(uint16_t mode);
+	void initialize_inode(Inode&, uint16_t mode) const;
+	Inode& inode(uint32_t number);
+	uint32_t allocate_block();
+	std::vector<uint32_t> allocate_blocks(size_t count);
+
+	// Fills in i_block of the inode, writing out indirect blocks if the direct ones are not enough
+	void map_blocks(uint32_t inode_number, const std::vector<uint32_t>& blocks);
+	uint32_t write_indirect_block(size_t level, const std::vector<uint32_t>& blocks, size_t& index, size_t& indirect_count);
+	void map_extents(uint32_t inode_number, const std::vector<uint32_t>& blocks);
+
+	// Indirect or extent tree blocks needed on top of 'count' data blocks, at most
+	size_t mapping_blocks_for(size_t count) const;
 
+	void store_contents(index_t directory, std::string_view name, const FileContents& contents, uint8_t attributes);
+	index_t create_directory(index_t parent, std::string_view name, uint32_t inode_number);
+	void store_entry(index_t directory, std::string_view name, uint32_t inode_number, uint8_t file_type);
+	static uint32_t directory_entry_size(std::string_view name);
+	index_t find_subdirectory(index_t directory, std::string_view name) const;
+	void validate_new_name(index_t directory, std::string_view name) const;
+
+	void write_flex_group_metadata(size_t first_block_group);
+	uint16_t descriptor_checksum(size_t block_group) const;
+	void write_superblocks();
 
 private:
+	static constexpr uint32_t root_inode = 2;
+	static constexpr uint32_t lost_and_found_inode = 11;
+	static constexpr uint16_t superblock_magic = 0xEF53;
+	static constexpr size_t superblock_offset = 1024;
+	static constexpr size_t direct_blocks = 12;
+	static constexpr uint16_t max_links = 65000;
+
+	static constexpr uint16_t mode_directory = 0x4000;
+	static constexpr uint16_t mode_regular_file = 0x8000;
+
+	static constexpr uint8_t file_type_regular = 1;
+	static constexpr uint8_t file_type_directory = 2;
+
+	static constexpr uint32_t feature_incompat_filetype = 0x0002;
+	static constexpr uint32_t feature_incompat_extents = 0x0040;
+	static constexpr uint32_t feature_incompat_flex_bg = 0x0200;
+	static constexpr uint32_t feature_ro_compat_sparse_super = 0x0001;
+	static constexpr uint32_t feature_ro_compat_large_file = 0x0002;
+	static constexpr uint32_t feature_ro_compat_gdt_csum = 0x0010;
+	static constexpr uint32_t feature_ro_compat_extra_isize = 0x0040;
+
+	static constexpr uint32_t inode_flag_extents = 0x80000;
+	static constexpr uint16_t extent_magic = 0xF30A;
+	static constexpr uint16_t max_extent_length = 32768;
+
+	static constexpr uint16_t block_group_inode_uninit = 0x0001;
+
+	static constexpr size_t max_log_groups_per_flex = 4;
+
 	Superblock m_superblock {};
 
+	size_t m_block_size { 0 };
+	size_t m_inode_size { 128 };
+	size_t m_bytes_per_inode { 0 };
+	size_t m_group_descriptor_blocks { 0 };
+	size_t m_inode_table_blocks { 0 };
+	size_t m_groups_per_flex { 1 };
+	bool m_use_extents { false };
+
+	// only the used part of inode tables is written, the rest is flagged as uninitialized
+	bool m_lazy_inode_tables { false };
+	uint32_t m_creation_time { 0 };
+
+	// first block group that might still have free blocks
+	size_t m_allocation_group { 0 };
+	uint32_t m_next_inode { 0 };
+
 	struct BlockGroup {
 		BlockGroupDescriptor32 descriptor {};
-		std::vector<uint8_t> inode_bitmap;
-		std::vector<uint8_t> block_bitmap;
+		Bitmap inode_bitmap;
+		Bitmap block_bitmap;
+
+		// allocated inodes of this group, they are handed out in order
+		// so this is always a prefix of the inode table
+		std::vector<Inode> inodes;
 	};
 
 	std::vector<BlockGroup> m_block_groups;
-};
\ No newline at end of file
+
+	struct Child {
+		std::string_view name;
+		index_t directory;
+	};
+
+	struct Directory {
+		uint32_t inode;
+		std::vector<uint32_t> blocks;
+		std::vector<Child> children;
+
+		// where the next entry goes and where the last one starts within the last block,
+		// the last entry of a block always spans until the end of it
+		uint32_t offset_within_block;
+		uint32_t last_entry_offset;
+	};
+
+	std::vector<Directory> m_directories;
+	StringPool m_names;
+
+	// with dedup=yes regular files with identical contents become hard links to the same inode
+	struct DigestHash {
+		size_t operator()(const SHA256::digest_t& digest) const
+		{
+			size_t hash;
+			memcpy(&hash, digest.data(), sizeof(hash));
+			return hash;
+		}
+	};
+
+	bool m_deduplicate { false };
+	size_t m_deduplicated_files { 0 };
+	std::unordered_map<SHA256::digest_t, uint32_t, DigestHash> m_inodes_by_content;
+};
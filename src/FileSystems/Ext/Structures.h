@@ -200,7 +200,34 @@ struct DirectoryEntry {
 	char name[255];
 };
 
+struct ExtentHeader {
+	uint16_t eh_magic;
+	uint16_t eh_entries;
+	uint16_t eh_max;
+	uint16_t eh_depth;
+	uint32_t eh_generation;
+};
+
+// Leaf entry, maps a run of logical blocks to physical ones
+struct Extent {
+	uint32_t ee_block;
+	uint16_t ee_len;
+	uint16_t ee_start_hi;
+	uint32_t ee_start_lo;
+};
+
+// Internal node entry, points at the next level of the tree
+struct ExtentIndex {
+	uint32_t ei_block;
+	uint32_t ei_leaf_lo;
+	uint16_t ei_leaf_hi;
+	uint16_t ei_unused;
+};
+
 static_assert(sizeof(Superblock) == 1024, "Incorrect size of ext superblock");
-static_assert(sizeof(BlockGroupDescritor32) == 32, "Incorrect size of block group descriptor (32 byte)");
+static_assert(sizeof(BlockGroupDescriptor32) == 32, "Incorrect size of block group descriptor (32 byte)");
 static_assert(sizeof(BlockGroupDescriptor64) == 64, "Incorrect size of block group descriptor (64 byte)");
 static_assert(sizeof(Inode) == 160, "Incorrect size of Inode");
+static_assert(sizeof(ExtentHeader) == 12, "Incorrect size of extent header");
+static_assert(sizeof(Extent) == 12, "Incorrect size of extent");
+static_assert(sizeof(ExtentIndex) == 12, "Incorrect size of extent index");
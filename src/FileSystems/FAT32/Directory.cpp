@@ -8,63 +8,115 @@
 
 namespace FAT {
 
-Directory::Directory(FAT32& parent)
+DirectoryTree::DirectoryTree(FAT32& parent)
     : m_parent(parent)
+    , m_allocator(&parent.allocation_table())
 {
-    m_current_cluster = parent.allocation_table().allocate(1);
-    m_first_cluster = m_current_cluster;
+    auto root = create_directory(allocate(1));
+
+    // the root directory doesn't have '.' and '..'
+    m_directories[root].offset_within_cluster = 0;
 }
 
-Directory::Directory(FAT32& parent, size_t cluster)
+DirectoryTree::DirectoryTree(FAT32& parent, ClusterAllocator& allocator, uint32_t parent_cluster)
     : m_parent(parent)
-    , m_first_cluster(cluster)
-    , m_current_cluster(cluster)
-    , m_offset_within_cluster(2) // '.' and '..' are already created by the parent directory
+    , m_allocator(&allocator)
+{
+    auto first_cluster = allocate(1);
+
+    store_dot_and_dot_dot(first_cluster, parent_cluster);
+    create_directory(first_cluster);
+}
+
+uint32_t DirectoryTree::allocate(uint32_t cluster_count, uint32_t connect_to)
+{
+    auto first_cluster = m_allocator->allocate(cluster_count, connect_to);
+
+    if (!first_cluster)
+        throw std::runtime_error("file allocation table overflow");
+
+    return first_cluster;
+}
+
+DirectoryTree::index_t DirectoryTree::create_directory(uint32_t first_cluster)
+{
+    DirectoryNode node {};
+    node.first_cluster = first_cluster;
+    node.current_cluster = first_cluster;
+    node.offset_within_cluster = 2; // '.' and '..' are already created by the parent directory
+
+    m_directories.push_back(node);
+
+    return static_cast<index_t>(m_directories.size() - 1);
+}
+
+DirectoryTree::index_t DirectoryTree::find_name(index_t directory, std::string_view name) const
+{
+    for (auto i = m_directories.at(directory).first_entry; i != no_index; i = m_entries[i].next) {
+        if (m_entries[i].name == name)
+            return i;
+    }
+
+    return no_index;
+}
+
+bool DirectoryTree::has_subdirectory(index_t directory, std::string_view name) const
 {
+    auto entry = find_name(directory, name);
+
+    return entry != no_index && m_entries[entry].directory != no_index;
 }
 
-bool Directory::has_subdirectory(std::string_view name)
+DirectoryTree::index_t DirectoryTree::find_subdirectory(index_t directory, std::string_view name) const
 {
-    auto res = std::find_if(m_entries.begin(), m_entries.end(), [&name](const StoredEntry& entry) { return entry.name == name; });
+    auto entry = find_name(directory, name);
 
-    return res != m_entries.end() && res->directory;
+    return entry == no_index ? no_index : m_entries[entry].directory;
 }
 
-Directory& Directory::subdirectory(std::string_view name)
+DirectoryTree::index_t DirectoryTree::subdirectory(index_t directory, std::string_view name) const
 {
-    auto res = std::find_if(m_entries.begin(), m_entries.end(), [&name](const StoredEntry& entry) { return entry.name == name; });
-    if (res == m_entries.end())
+    auto entry = find_name(directory, name);
+    if (entry == no_index)
         throw std::runtime_error("no such subdirectory " + std::string(name));
 
-    if (!res->directory)
+    if (m_entries[entry].directory == no_index)
         throw std::runtime_error("not a directory " + std::string(name));
 
-    return *res->directory;
+    return m_entries[entry].directory;
 }
 
-bool Directory::contains_short_name(std::string_view short_name) const
+bool DirectoryTree::contains_short_name(index_t directory, std::string_view short_name) const
 {
-    auto res = std::find_if(m_entries.begin(), m_entries.end(),
-        [&short_name](const StoredEntry& entry) {
-            return entry.stored_short_name == short_name;
-        }
-    );
+    for (auto i = m_directories.at(directory).first_entry; i != no_index; i = m_entries[i].next) {
+        if (std::string_view(m_entries[i].short_name, sizeof(StoredEntry::short_name)) == short_name)
+            return true;
+    }
 
-    return res != m_entries.end();
+    return false;
 }
 
-bool Directory::contains_name(std::string_view name) const
+void DirectoryTree::link_entry(index_t directory, std::string_view name, std::string_view short_name, index_t subdirectory)
 {
-    auto res = std::find_if(m_entries.begin(), m_entries.end(),
-        [&name](const StoredEntry& entry) {
-            return entry.name == name;
-        }
-    );
+    StoredEntry stored_entry {};
+    stored_entry.name = m_names.add(name);
+    memcpy(stored_entry.short_name, short_name.data(), sizeof(stored_entry.short_name));
+    stored_entry.directory = subdirectory;
+
+    auto index = static_cast<index_t>(m_entries.size());
+    m_entries.push_back(stored_entry);
+
+    auto& node = m_directories[directory];
 
-    return res != m_entries.end();
+    if (node.last_entry == no_index)
+        node.first_entry = index;
+    else
+        m_entries[node.last_entry].next = index;
+
+    node.last_entry = index;
 }
 
-void Directory::build_entry(Entry& entry, const EntrySpec& spec)
+void DirectoryTree::build_entry(Entry& entry, const EntrySpec& spec)
 {
     memcpy(entry.filename, spec.name.data(), max_filename_length);
     memcpy(entry.extension, spec.name.data() + max_filename_length, max_file_extension_length);
@@ -93,6 +145,12 @@ void Directory::build_entry(Entry& entry, const EntrySpec& spec)
 
     if (spec.is_directory)
         entry.attributes |= subdirectory_bit;
+    if (spec.attributes & FSObject::READ_ONLY)
+        entry.attributes |= read_only_bit;
+    if (spec.attributes & FSObject::HIDDEN)
+        entry.attributes |= hidden_bit;
+    if (spec.attributes & FSObject::SYSTEM)
+        entry.attributes |= system_bit;
 
     if (spec.is_name_lower)
         entry.case_info |= lowercase_name_bit;
@@ -100,7 +158,7 @@ void Directory::build_entry(Entry& entry, const EntrySpec& spec)
         entry.case_info |= lowercase_extension_bit;
 }
 
-void Directory::store_normal_entry(const EntrySpec& spec, uint32_t current_cluster, uint32_t offset_within_cluster)
+void DirectoryTree::store_normal_entry(const EntrySpec& spec, uint32_t current_cluster, uint32_t offset_within_cluster)
 {
     auto entry = Entry();
     build_entry(entry, spec);
@@ -108,15 +166,7 @@ void Directory::store_normal_entry(const EntrySpec& spec, uint32_t current_clust
     store_entry(&entry, current_cluster, offset_within_cluster);
 }
 
-void Directory::store_normal_entry(const EntrySpec& spec)
-{
-    auto entry = Entry();
-    build_entry(entry, spec);
-
-    store_entry(&entry);
-}
-
-void Directory::store_dot_and_dot_dot(size_t cluster, size_t parent_cluster)
+void DirectoryTree::store_dot_and_dot_dot(size_t cluster, size_t parent_cluster)
 {
     EntrySpec spec {};
     spec.size = 0;
@@ -131,19 +181,19 @@ void Directory::store_dot_and_dot_dot(size_t cluster, size_t parent_cluster)
     store_normal_entry(spec, cluster, 1);
 }
 
-void Directory::do_store(std::string_view name, const std::vector<uint8_t>& data, bool is_directory)
+std::string DirectoryTree::store_long_name(index_t directory, std::string_view name, FilenameInfo& info, EntryGroup& group)
 {
-    if (contains_name(name))
+    if (find_name(directory, name) != no_index)
         throw std::runtime_error(std::string(name) + " already exists");
     if (name.size() > 255)
         throw std::runtime_error(std::string(name) + " is too long");
 
-    auto info = analyze_filename(name);
+    info = analyze_filename(name);
     info.is_vfat &= m_parent.use_vfat();
 
     auto short_name = generate_short_name(name);
 
-    while (contains_short_name(short_name)) {
+    while (contains_short_name(directory, short_name)) {
         bool ok = false;
 
         short_name = next_short_name(short_name, ok);
@@ -222,29 +272,35 @@ void Directory::do_store(std::string_view name, const std::vector<uint8_t>& data
             while (characters_written < characters_per_entry)
                 write_long_directory_character(long_entry, 0xFFFF, characters_written++);
 
-            store_entry(&long_entry);
+            group.long_entries[group.long_entry_count++] = long_entry;
         }
     }
 
-    uint32_t first_cluster = 0;
+    return short_name;
+}
 
-    StoredEntry stored_entry{};
-    stored_entry.name = name;
-    stored_entry.stored_short_name = short_name;
+DirectoryTree::index_t DirectoryTree::do_store(index_t directory, std::string_view name, const FileContents& contents, bool is_directory, uint8_t attributes)
+{
+    FilenameInfo info {};
+    EntryGroup group {};
+    auto short_name = store_long_name(directory, name, info, group);
+
+    uint32_t first_cluster = 0;
+    index_t subdirectory = no_index;
 
     if (is_directory) {
-        first_cluster = m_parent.allocation_table().allocate(1);
-        store_dot_and_dot_dot(first_cluster, m_first_cluster);
+        first_cluster = allocate(1);
+        store_dot_and_dot_dot(first_cluster, m_directories[directory].first_cluster);
 
-        stored_entry.directory = std::unique_ptr<Directory>(new Directory(m_parent, first_cluster));
+        subdirectory = create_directory(first_cluster);
     }
 
-    m_entries.emplace_back(std::move(stored_entry));
+    link_entry(directory, name, short_name, subdirectory);
 
-    if (!data.empty()) {
-        auto clusters_needed = ceiling_divide(data.size(), m_parent.sectors_per_cluster() * DiskImage::sector_size);
-        first_cluster = m_parent.allocation_table().allocate(clusters_needed);
-        m_parent.image().write_at(data.data(), data.size(), m_parent.cluster_to_byte_offset(first_cluster));
+    if (contents.size()) {
+        auto clusters_needed = ceiling_divide(contents.size(), m_parent.cluster_size());
+        first_cluster = allocate(clusters_needed);
+        contents.write_into(m_parent.image(), { { m_parent.cluster_to_byte_offset(first_cluster), contents.size() } });
 
         if (is_directory)
             throw std::runtime_error("non-empty data for directory");
@@ -255,34 +311,111 @@ void Directory::do_store(std::string_view name, const std::vector<uint8_t>& data
     spec.is_directory = is_directory;
     spec.is_extension_lower = info.is_extension_entirely_lower;
     spec.is_name_lower = info.is_name_entirely_lower;
-    spec.size = data.size();
+    spec.size = contents.size();
+    spec.name = short_name;
+    spec.attributes = attributes;
+    build_entry(group.entry, spec);
+    store_entry_group(directory, group);
+
+    return subdirectory;
+}
+
+void DirectoryTree::adopt(index_t directory, std::string_view name, DirectoryTree&& other)
+{
+    FilenameInfo info {};
+    EntryGroup group {};
+    auto short_name = store_long_name(directory, name, info, group);
+
+    auto directory_base = static_cast<index_t>(m_directories.size());
+    auto entry_base = static_cast<index_t>(m_entries.size());
+
+    auto rebase = [](index_t index, index_t base) { return index == no_index ? no_index : index + base; };
+
+    for (auto node : other.m_directories) {
+        node.first_entry = rebase(node.first_entry, entry_base);
+        node.last_entry = rebase(node.last_entry, entry_base);
+        m_directories.push_back(node);
+    }
+
+    for (auto entry : other.m_entries) {
+        entry.next = rebase(entry.next, entry_base);
+        entry.directory = rebase(entry.directory, directory_base);
+        m_entries.push_back(entry);
+    }
+
+    m_names.absorb(std::move(other.m_names));
+
+    EntrySpec spec{};
+    spec.first_cluster = m_directories[directory_base + root()].first_cluster;
+    spec.is_directory = true;
+    spec.is_extension_lower = info.is_extension_entirely_lower;
+    spec.is_name_lower = info.is_name_entirely_lower;
     spec.name = short_name;
-    store_normal_entry(spec);
+    build_entry(group.entry, spec);
+    store_entry_group(directory, group);
+
+    link_entry(directory, name, short_name, directory_base + root());
 }
 
-void Directory::store_file(std::string_view name, const std::vector<uint8_t>& data)
+size_t DirectoryTree::entry_count_for(std::string_view name, bool use_vfat)
 {
-    do_store(name, data, false);
+    if (!use_vfat || !analyze_filename(name).is_vfat)
+        return 1;
+
+    return 1 + ceiling_divide(name.size(), characters_per_entry);
 }
 
-void Directory::store_directory(std::string_view name)
+void DirectoryTree::store_file(index_t directory, std::string_view name, const FileContents& contents, uint8_t attributes)
 {
-    do_store(name, {}, true);
+    do_store(directory, name, contents, false, attributes);
 }
 
-void Directory::store_entry(void* entry)
+DirectoryTree::index_t DirectoryTree::store_directory(index_t directory, std::string_view name)
 {
-    auto entries_per_cluster = (m_parent.sectors_per_cluster() * DiskImage::sector_size) / entry_size;
+    static const std::vector<uint8_t> no_data;
+
+    return do_store(directory, name, no_data, true, 0);
+}
+
+void DirectoryTree::store_entry_group(index_t directory, const EntryGroup& group)
+{
+    auto entries_per_cluster = (m_parent.cluster_size()) / entry_size;
+    auto& node = m_directories[directory];
+
+    IOSlice slices[max_sequence_number + 1];
+    size_t slice_count = 0;
+    uint32_t first_entry_index = 0;
+
+    // a group can only be split where the directory continues in another cluster
+    auto write_slices = [&]() {
+        if (!slice_count)
+            return;
+
+        auto offset = m_parent.cluster_to_byte_offset(node.current_cluster) + first_entry_index * sizeof(Entry);
+        m_parent.image().write_at(slices, slice_count, offset);
+        slice_count = 0;
+    };
+
+    for (size_t i = 0; i <= group.long_entry_count; ++i) {
+        if (node.offset_within_cluster == entries_per_cluster) {
+            write_slices();
+
+            node.current_cluster = allocate(1, node.current_cluster);
+            node.offset_within_cluster = 0;
+        }
+
+        if (!slice_count)
+            first_entry_index = node.offset_within_cluster;
 
-    if (m_offset_within_cluster == entries_per_cluster) {
-        m_current_cluster = m_parent.allocation_table().allocate(1, m_current_cluster);
-        m_offset_within_cluster = 0;
+        const void* entry = i < group.long_entry_count ? static_cast<const void*>(&group.long_entries[i]) : &group.entry;
+        slices[slice_count++] = { entry, entry_size };
+        node.offset_within_cluster++;
     }
 
-    store_entry(entry, m_current_cluster, m_offset_within_cluster++);
+    write_slices();
 }
 
-void Directory::store_entry(void* entry, uint32_t cluster, uint32_t entry_index)
+void DirectoryTree::store_entry(void* entry, uint32_t cluster, uint32_t entry_index)
 {
     auto offset = m_parent.cluster_to_byte_offset(cluster) + entry_index * sizeof(Entry);
     m_parent.image().write_at(entry, sizeof(Entry), offset);
@@ -7,31 +7,71 @@
 
 #include "DiskImages/DiskImage.h"
 #include "FAT32.h"
+#include "Utilities.h"
+#include "Utilities/StringPool.h"
 
 namespace FAT {
 
-class Directory
+class ClusterAllocator;
+
+// All directories of a FAT32 volume (or of a detached part of it) in flat arrays.
+// Directories and their entries refer to each other by index and all names live
+// in one string pool, so even millions of entries only take a handful of allocations.
+class DirectoryTree
 {
 public:
-    Directory(FAT32& parent);
+    using index_t = uint32_t;
+    static constexpr index_t no_index = 0xFFFFFFFF;
+    static constexpr size_t entry_size = 32;
+
+    // Creates a tree with the root directory of the volume in it
+    DirectoryTree(FAT32& parent);
+
+    // Creates a tree whose root directory isn't linked anywhere yet, it can be filled
+    // independently of the rest of the volume and then adopted by another tree.
+    DirectoryTree(FAT32& parent, ClusterAllocator& allocator, uint32_t parent_cluster);
+
+    DirectoryTree(DirectoryTree&&) = default;
 
-    void store_file(std::string_view name, const std::vector<uint8_t>& data);
-    void store_directory(std::string_view name);
+    [[nodiscard]] static index_t root() { return 0; }
+    [[nodiscard]] uint32_t first_cluster_of(index_t directory) const { return m_directories.at(directory).first_cluster; }
 
-    [[nodiscard]] bool has_subdirectory(std::string_view name);
-    [[nodiscard]] Directory& subdirectory(std::string_view name);
+    void store_file(index_t directory, std::string_view name, const FileContents& contents, uint8_t attributes = 0);
+    index_t store_directory(index_t directory, std::string_view name);
+
+    // Links the root of 'other' under 'directory' and takes over all of its
+    // directories, they are allocated from this tree's allocator from now on
+    void adopt(index_t directory, std::string_view name, DirectoryTree&& other);
+
+    [[nodiscard]] bool has_subdirectory(index_t directory, std::string_view name) const;
+    [[nodiscard]] index_t subdirectory(index_t directory, std::string_view name) const;
+
+    // Same as above but returns no_index instead of throwing
+    [[nodiscard]] index_t find_subdirectory(index_t directory, std::string_view name) const;
+
+    // Number of directory entries a name takes up, its LFN entries included
+    static size_t entry_count_for(std::string_view name, bool use_vfat);
 
 private:
-    Directory(FAT32& parent, size_t cluster);
+    // same as ClusterAllocator::allocate() but throws once the table is full
+    uint32_t allocate(uint32_t cluster_count, uint32_t connect_to = 0);
+
+    index_t create_directory(uint32_t first_cluster);
 
-    void do_store(std::string_view name, const std::vector<uint8_t>& data, bool is_directory);
+    // returns the new subdirectory or no_index for files
+    index_t do_store(index_t directory, std::string_view name, const FileContents& contents, bool is_directory, uint8_t attributes);
 
-    bool contains_name(std::string_view name) const;
-    bool contains_short_name(std::string_view short_name) const;
+    void link_entry(index_t directory, std::string_view name, std::string_view short_name, index_t subdirectory);
+
+    index_t find_name(index_t directory, std::string_view name) const;
+    bool contains_short_name(index_t directory, std::string_view short_name) const;
 
     static constexpr uint8_t lowercase_name_bit = 1 << 3;
     static constexpr uint8_t lowercase_extension_bit = 1 << 4;
 
+    static constexpr uint8_t read_only_bit = 1 << 0;
+    static constexpr uint8_t hidden_bit = 1 << 1;
+    static constexpr uint8_t system_bit = 1 << 2;
     static constexpr uint8_t subdirectory_bit = 1 << 4;
 
     struct Entry
@@ -79,18 +119,29 @@ private:
         bool is_name_lower;
         bool is_extension_lower;
         bool is_directory;
+        uint8_t attributes; // FSObject::Attribute
     };
     void build_entry(Entry&, const EntrySpec&);
 
     void store_normal_entry(const EntrySpec&, uint32_t cluster, uint32_t offset);
-    void store_normal_entry(const EntrySpec&);
     void store_dot_and_dot_dot(size_t cluster, size_t parent_cluster);
 
-    void store_entry(void*);
     void store_entry(void*, uint32_t cluster, uint32_t offset_within_cluster);
 
+    // the LFN entries of a name followed by its short entry
+    struct EntryGroup {
+        LongEntry long_entries[max_sequence_number];
+        size_t long_entry_count;
+        Entry entry;
+    };
+
+    // Validates the name, picks a unique short name and fills in the LFN entries if needed
+    std::string store_long_name(index_t directory, std::string_view name, FilenameInfo& info, EntryGroup& group);
+
+    // entries that end up next to each other are written together
+    void store_entry_group(index_t directory, const EntryGroup& group);
+
 private:
-    static constexpr size_t entry_size = 32;
     static_assert(sizeof(Entry) == entry_size, "Incorrect Entry size, you might wanna force the alignment of 1 manually");
     static_assert(sizeof(LongEntry) == entry_size, "Incorrect LongEntry size, you might wanna force the alignment of 1 manually");
 
@@ -99,22 +150,31 @@ private:
 
 
     FAT32& m_parent;
+    ClusterAllocator* m_allocator { nullptr };
 
-    size_t m_bytes_per_cluster { 0 };
-    size_t m_size { 0 };
+    struct DirectoryNode {
+        uint32_t first_cluster { 0 };
+        uint32_t current_cluster { 0 };
+        uint32_t offset_within_cluster { 0 };
 
-    size_t m_offset_within_cluster { 0 };
-    size_t m_first_cluster { 0 };
-    size_t m_current_cluster { 0 };
+        // singly linked list of entries in the order they were stored
+        index_t first_entry { no_index };
+        index_t last_entry { no_index };
+    };
+    std::vector<DirectoryNode> m_directories;
 
     struct StoredEntry {
-        std::string name;
-        std::string stored_short_name; // to prevent collisions
+        std::string_view name; // points into m_names
+        char short_name[short_name_length + short_extension_length]; // to prevent collisions
 
-        // nullptr -> not a directory
-        std::unique_ptr<Directory> directory;
+        index_t next { no_index };
+
+        // no_index -> not a directory
+        index_t directory { no_index };
     };
     std::vector<StoredEntry> m_entries;
+
+    StringPool m_names;
 };
 
 }
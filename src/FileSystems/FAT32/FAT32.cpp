@@ -1,5 +1,6 @@
 #include "FAT32.h"
 #include "Utilities/Common.h"
+#include "FileSystems/Inventory.h"
 
 #include "Utilities.h"
 #include "FileAllocationTable.h"
@@ -7,21 +8,25 @@
 
 #include <ctime>
 #include <filesystem>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
 
 namespace FAT {
 
 FAT32::FAT32(DiskImage& image, size_t lba_offset, size_t sector_count, const additional_options_t& options)
     : FileSystem(image, lba_offset, sector_count)
-    , m_sectors_per_cluster(pick_sectors_per_cluster())
+    , m_sectors_per_cluster(pick_sectors_per_cluster(options))
 {
-    auto fat_length = calculate_fat_length();
+    auto fat_length = calculate_fat_length(sector_count, m_sectors_per_cluster, sector_size());
     m_allocation_table = std::make_shared<FileAllocationTable>(*this, fat_length.first, fat_length.second);
 
-    m_byte_offset_to_data = lba_offset * DiskImage::sector_size;
-    m_byte_offset_to_data += reserved_sector_count * DiskImage::sector_size;
-    m_byte_offset_to_data += m_allocation_table->size_in_sectors() * DiskImage::sector_size * 2;
+    m_byte_offset_to_data = lba_offset * sector_size();
+    m_byte_offset_to_data += reserved_sector_count * sector_size();
+    m_byte_offset_to_data += m_allocation_table->size_in_sectors() * sector_size() * 2;
 
-    m_root_dir = std::make_shared<Directory>(*this);
+    m_directories = std::make_shared<DirectoryTree>(*this);
 
     auto vbr_option = options.find("vbr");
     if (vbr_option != options.end()) {
@@ -45,28 +50,28 @@ FileAllocationTable& FAT32::allocation_table()
 
 size_t FAT32::cluster_to_byte_offset(size_t cluster) const
 {
-    return m_byte_offset_to_data + ((cluster - 2) * (m_sectors_per_cluster * DiskImage::sector_size));
+    return m_byte_offset_to_data + ((cluster - 2) * cluster_size());
 }
 
-std::pair<uint32_t, uint32_t> FAT32::calculate_fat_length()
+std::pair<uint32_t, uint32_t> FAT32::calculate_fat_length(size_t sector_count, size_t sectors_per_cluster, size_t sector_size)
 {
-    auto total_free_sectors = static_cast<uint32_t>(sector_count()) - reserved_sector_count;
+    auto total_free_sectors = static_cast<uint32_t>(sector_count) - reserved_sector_count;
 
-    auto bytes_per_fat = (total_free_sectors / static_cast<uint32_t>(m_sectors_per_cluster)) * 4;
+    auto bytes_per_fat = (total_free_sectors / static_cast<uint32_t>(sectors_per_cluster)) * 4;
     bytes_per_fat += 4 * 2; // first two clusters are reserved
 
-    auto sectors_per_fat = 1 + ((bytes_per_fat - 1) / static_cast<uint32_t>(DiskImage::sector_size));
+    auto sectors_per_fat = 1 + ((bytes_per_fat - 1) / static_cast<uint32_t>(sector_size));
 
     // round up to 4K boundary
-    static constexpr uint32_t sectors_per_page = 4096 / DiskImage::sector_size;
+    auto sectors_per_page = std::max<uint32_t>(1, static_cast<uint32_t>(4096 / sector_size));
     auto rem = sectors_per_fat % sectors_per_page;
     if (rem)
         sectors_per_fat += sectors_per_page - rem;
 
     total_free_sectors -= sectors_per_fat * 2;
 
-    return { total_free_sectors / static_cast<uint32_t>(m_sectors_per_cluster),
-             sectors_per_fat * static_cast<uint32_t>(DiskImage::sector_size) / 4 };
+    return { total_free_sectors / static_cast<uint32_t>(sectors_per_cluster),
+             sectors_per_fat * static_cast<uint32_t>(sector_size) / 4 };
 }
 
 void FAT32::construct_ebpb()
@@ -81,7 +86,7 @@ void FAT32::construct_ebpb()
 
     memcpy(&ebpb, m_vbr + ebpb_offset, expected_ebpb_size);
 
-    ebpb.bytes_per_sector = static_cast<uint16_t>(DiskImage::sector_size);
+    ebpb.bytes_per_sector = static_cast<uint16_t>(sector_size());
     ebpb.sectors_per_cluster = static_cast<uint8_t>(m_sectors_per_cluster);
     ebpb.reserved_sectors = reserved_sector_count;
 
@@ -159,10 +164,11 @@ void FAT32::finalize()
 
     auto& image = FileSystem::image();
 
-    image.set_offset(lba_offset() * DiskImage::sector_size);
+    auto partition_offset = lba_offset() * sector_size();
 
-    // set the EBPB in the VBR
-    image.write(m_vbr, vbr_size);
+    // set the EBPB in the VBR, only positioned writes are used so that
+    // multiple partitions can be finalized concurrently
+    image.write_at(m_vbr, vbr_size, partition_offset);
 
     struct FSINFO {
         char signature_1[4];
@@ -189,35 +195,225 @@ void FAT32::finalize()
     fsinfo.free_cluster_count = m_allocation_table->free_cluster_count();
     fsinfo.last_allocated_cluster = m_allocation_table->last_allocated();
 
-    image.write(reinterpret_cast<uint8_t*>(&fsinfo), fsinfo_size);
+    // FSINFO is the second sector, whatever size sectors are
+    image.write_at(reinterpret_cast<uint8_t*>(&fsinfo), fsinfo_size, partition_offset + sector_size());
 
-    image.skip((reserved_sector_count - 2) * DiskImage::sector_size);
-    m_allocation_table->write_into(image);
+    m_allocation_table->write_into(image, partition_offset + reserved_sector_count * sector_size());
 }
 
-void FAT32::store(const FSObject& obj)
+// directory handles are just indices into the directory tree,
+// offset by one so that a valid handle is never a nullptr
+static directory_handle_t to_handle(DirectoryTree::index_t index)
 {
-    if (obj.type == FSObject::INVALID)
-        throw std::runtime_error("invalid type of fs object");
+    return reinterpret_cast<directory_handle_t>(static_cast<uintptr_t>(index) + 1);
+}
 
-    std::filesystem::path path(obj.path);
-    auto filename = path.filename().string();
+static DirectoryTree::index_t to_index(directory_handle_t handle)
+{
+    return static_cast<DirectoryTree::index_t>(reinterpret_cast<uintptr_t>(handle) - 1);
+}
 
-    auto* directory = m_root_dir.get();
+directory_handle_t FAT32::open_directory(std::string_view path)
+{
+    return to_handle(resolve(*m_directories, path));
+}
 
-    for (auto& component : path.parent_path()) {
-        if (component == "/" || component == "\\")
-            continue;
+directory_handle_t FAT32::find_directory_in(directory_handle_t directory, std::string_view name)
+{
+    auto subdirectory = m_directories->find_subdirectory(to_index(directory), name);
+
+    return subdirectory == DirectoryTree::no_index ? nullptr : to_handle(subdirectory);
+}
+
+void FAT32::store_in(directory_handle_t directory, std::string_view name, const std::vector<uint8_t>& data, uint8_t attributes)
+{
+    m_directories->store_file(to_index(directory), name, data, attributes);
+}
+
+void FAT32::store_file_in(directory_handle_t directory, std::string_view name, HostFile& file, uint8_t attributes)
+{
+    m_directories->store_file(to_index(directory), name, file, attributes);
+}
+
+directory_handle_t FAT32::store_directory_in(directory_handle_t directory, std::string_view name)
+{
+    return to_handle(m_directories->store_directory(to_index(directory), name));
+}
+
+void FAT32::store_subtrees(const std::vector<std::string>& names, const subtree_builder_t& builder, size_t jobs)
+{
+    class DetachedSubtree final : public Subtree
+    {
+    public:
+        DetachedSubtree(FAT32& fs, uint32_t parent_cluster)
+            : m_reservation(fs.allocation_table(), subtree_reservation_granularity)
+            , m_directories(fs, m_reservation, parent_cluster)
+        {
+        }
+
+        directory_handle_t open_directory(std::string_view path) override
+        {
+            return to_handle(resolve(m_directories, path));
+        }
+
+        directory_handle_t find_directory_in(directory_handle_t directory, std::string_view name) override
+        {
+            auto subdirectory = m_directories.find_subdirectory(to_index(directory), name);
+
+            return subdirectory == DirectoryTree::no_index ? nullptr : to_handle(subdirectory);
+        }
+
+        void store_in(directory_handle_t directory, std::string_view name, const std::vector<uint8_t>& data, uint8_t attributes) override
+        {
+            m_directories.store_file(to_index(directory), name, data, attributes);
+        }
+
+        void store_file_in(directory_handle_t directory, std::string_view name, HostFile& file, uint8_t attributes) override
+        {
+            m_directories.store_file(to_index(directory), name, file, attributes);
+        }
+
+        directory_handle_t store_directory_in(directory_handle_t directory, std::string_view name) override
+        {
+            return to_handle(m_directories.store_directory(to_index(directory), name));
+        }
+
+        DirectoryTree&& release_directories() { return std::move(m_directories); }
+
+    private:
+        FileAllocationTable::Reservation m_reservation;
+        DirectoryTree m_directories;
+    };
+
+    std::vector<std::unique_ptr<DetachedSubtree>> subtrees(names.size());
+    std::atomic<size_t> next_subtree { 0 };
+
+    std::mutex error_lock;
+    std::exception_ptr first_error;
 
-        auto as_string = component.string();
+    auto work = [&]() {
+        for (;;) {
+            auto index = next_subtree++;
+            if (index >= subtrees.size())
+                return;
+
+            try {
+                subtrees[index] = std::make_unique<DetachedSubtree>(*this, m_directories->first_cluster_of(DirectoryTree::root()));
+                builder(index, *subtrees[index]);
+            } catch (...) {
+                std::lock_guard lock(error_lock);
+
+                if (!first_error)
+                    first_error = std::current_exception();
+
+                // don't bother building the rest
+                next_subtree = subtrees.size();
+                return;
+            }
+        }
+    };
+
+    jobs = std::max<size_t>(1, std::min(jobs, names.size()));
+
+    // the calling thread is one of the workers
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < jobs; ++i)
+        workers.emplace_back(work);
+
+    work();
+
+    for (auto& worker : workers)
+        worker.join();
+
+    if (first_error)
+        std::rethrow_exception(first_error);
+
+    for (size_t i = 0; i < subtrees.size(); ++i)
+        m_directories->adopt(DirectoryTree::root(), names[i], subtrees[i]->release_directories());
+}
+
+FileSystem::SpaceEstimate FAT32::estimate(const Inventory& inventory)
+{
+    return estimate(inventory, cluster_size(), m_allocation_table->free_cluster_count(), m_use_vfat);
+}
+
+FileSystem::SpaceEstimate FAT32::estimate(const Inventory& inventory, size_t cluster_size, size_t free_cluster_count, bool use_vfat)
+{
+    auto entries_per_cluster = cluster_size / DirectoryTree::entry_size;
+
+    SpaceEstimate estimate {};
+    estimate.unit_size = cluster_size;
+    estimate.units_free = free_cluster_count;
+
+    // Detached subtrees take clusters off the table in ranges and never use whatever is left
+    // at the end of one, same as FileAllocationTable::Reservation. Near the end of the table
+    // reservations shrink to what's actually needed, so this is an upper bound.
+    struct Range {
+        size_t next;
+        size_t end;
+    };
+    std::vector<Range> reservations;
+
+    auto allocate = [&](uint32_t subtree, size_t count) {
+        if (!count)
+            return;
+
+        if (!subtree) {
+            estimate.units_needed += count;
+            return;
+        }
+
+        if (reservations.size() < subtree)
+            reservations.resize(subtree);
+
+        auto& range = reservations[subtree - 1];
+
+        if (range.end - range.next < count) {
+            auto to_reserve = std::max<size_t>(count, subtree_reservation_granularity);
+            estimate.units_needed += to_reserve;
+            range = { 0, to_reserve };
+        }
+
+        range.next += count;
+    };
 
-        directory = &directory->subdirectory(as_string);
+    // entries in the last cluster of every directory, all but the root start out with '.' and '..'
+    std::vector<size_t> used_entries(inventory.directory_count(), 2);
+    used_entries[0] = 0;
+
+    for (auto& entry : inventory.entries()) {
+        if (entry.directory != Inventory::no_index)
+            allocate(inventory.subtree_of(entry.directory), 1);
+        else
+            allocate(inventory.subtree_of(entry.parent), ceiling_divide(entry.size, cluster_size));
+
+        for (auto count = DirectoryTree::entry_count_for(entry.name, use_vfat); count--;) {
+            auto& used = used_entries[entry.parent];
+
+            if (used == entries_per_cluster) {
+                allocate(inventory.subtree_of(entry.parent), 1);
+                used = 0;
+            }
+
+            ++used;
+        }
     }
 
-    if (obj.type == FSObject::DIRECTORY)
-        directory->store_directory(filename);
-    else
-        directory->store_file(filename, obj.data);
+    return estimate;
+}
+
+uint32_t FAT32::resolve(const DirectoryTree& tree, std::string_view path)
+{
+    auto directory = DirectoryTree::root();
+
+    for (auto& component : std::filesystem::path(path)) {
+        if (component.empty() || component == "/" || component == "\\")
+            continue;
+
+        directory = tree.subdirectory(directory, component.string());
+    }
+
+    return directory;
 }
 
 void FAT32::validate_vbr()
@@ -226,9 +422,90 @@ void FAT32::validate_vbr()
         throw std::runtime_error("Incorrect VBR signature, has to end with 0x55AA");
 }
 
-size_t FAT32::pick_sectors_per_cluster()
+size_t FAT32::tune_cluster_size(size_t sector_count, size_t sector_size, const additional_options_t& options, const Inventory& inventory)
 {
-    size_t size_in_bytes = sector_count() * DiskImage::sector_size;
+    bool use_vfat = true;
+    auto vfat_option = options.find("vfat");
+    if (vfat_option != options.end())
+        use_vfat = interpret_boolean(vfat_option->second);
+
+    // throws if there can't be a FAT32 this size at all
+    auto fallback = default_sectors_per_cluster(sector_count, sector_size) * sector_size;
+
+    struct Candidate {
+        size_t sectors_per_cluster;
+
+        // bytes left free once everything is stored, negative if it doesn't fit. Smaller clusters
+        // waste less of the last one of every file and directory but make for larger FATs.
+        int64_t bytes_left;
+    };
+    std::vector<Candidate> candidates;
+
+    // only the geometry is worked out, so that no FAT has to be built for every candidate
+    for (size_t sectors_per_cluster = 1; sectors_per_cluster * sector_size <= max_tuned_cluster_size; sectors_per_cluster *= 2) {
+        if (sector_count / sectors_per_cluster > max_cluster_index)
+            continue;
+
+        auto cluster_count = calculate_fat_length(sector_count, sectors_per_cluster, sector_size).first;
+        if (cluster_count < min_cluster_count)
+            break;
+
+        auto cluster_size = sectors_per_cluster * sector_size;
+
+        // the root directory takes up the first cluster
+        auto estimate = FAT32::estimate(inventory, cluster_size, cluster_count - 1, use_vfat);
+
+        auto clusters_left = static_cast<int64_t>(estimate.units_free) - static_cast<int64_t>(estimate.units_needed);
+        candidates.push_back({ sectors_per_cluster, clusters_left * static_cast<int64_t>(cluster_size) });
+    }
+
+    if (candidates.empty())
+        return fallback;
+
+    auto most_left = std::max_element(candidates.begin(), candidates.end(),
+        [](const Candidate& lhs, const Candidate& rhs) { return lhs.bytes_left < rhs.bytes_left; })->bytes_left;
+
+    // Guests walk the FAT cluster by cluster when reading a file, so larger clusters mean fewer
+    // FAT lookups and larger requests. They get to waste up to 1/256 of the contents for that.
+    auto tolerance = static_cast<int64_t>(inventory.data_size() / 256);
+
+    for (auto candidate = candidates.rbegin(); candidate != candidates.rend(); ++candidate) {
+        if (candidate->bytes_left >= most_left - tolerance)
+            return candidate->sectors_per_cluster * sector_size;
+    }
+
+    return candidates.front().sectors_per_cluster * sector_size;
+}
+
+size_t FAT32::pick_sectors_per_cluster(const additional_options_t& options)
+{
+    auto cluster_size_option = options.find("cluster_size");
+    if (cluster_size_option == options.end())
+        return default_sectors_per_cluster(sector_count(), sector_size());
+
+    if (cluster_size_option->second == "auto")
+        throw std::runtime_error("cluster_size=auto needs to know the contents of the filesystem up front");
+
+    auto cluster_size = std::stoul(cluster_size_option->second);
+
+    if (cluster_size < sector_size() || cluster_size > max_cluster_size || (cluster_size & (cluster_size - 1)))
+        throw std::runtime_error("FAT32 cluster size has to be a power of two between the sector size and 64K");
+
+    auto sectors_per_cluster = cluster_size / sector_size();
+
+    if (sector_count() / sectors_per_cluster > max_cluster_index)
+        throw std::runtime_error("too many clusters for FAT32, try a larger cluster size");
+
+    if (calculate_fat_length(sector_count(), sectors_per_cluster, sector_size()).first < min_cluster_count)
+        throw std::runtime_error("too few clusters for FAT32, try a smaller cluster size");
+
+    return sectors_per_cluster;
+}
+
+size_t FAT32::default_sectors_per_cluster(size_t sector_count, size_t sector_size)
+{
+    size_t size_in_bytes = sector_count * sector_size;
+    size_t cluster_size = 0;
 
     // Got this table from microsoft's website
     // (They probably know their own filesystem better than me)
@@ -237,26 +514,24 @@ size_t FAT32::pick_sectors_per_cluster()
     if (size_in_bytes < 32 * MB)
         throw std::runtime_error("FAT32 cannot be less than 32 megabytes in size");
     else if (size_in_bytes < 64 * MB)
-        return 1;
+        cluster_size = 512;
     else if (size_in_bytes < 128 * MB)
-        return 2;
+        cluster_size = 1 * KB;
     else if (size_in_bytes < 256 * MB)
-        return 4;
+        cluster_size = 2 * KB;
     else if (size_in_bytes < 8 * GB)
-        return 8;
+        cluster_size = 4 * KB;
     else if (size_in_bytes < 16 * GB)
-        return 16;
+        cluster_size = 8 * KB;
     else if (size_in_bytes < 32 * GB)
-        return 32;
+        cluster_size = 16 * KB;
     else if (size_in_bytes < 2 * TB)
-        return 64;
+        cluster_size = 32 * KB;
     else
         throw std::runtime_error("FAT32 cannot be greater than 2 terabytes in size");
-}
 
-FAT32::~FAT32()
-{
-    finalize();
+    // 4K native disks can't have clusters smaller than a sector
+    return std::max(cluster_size, sector_size) / sector_size;
 }
 
 }
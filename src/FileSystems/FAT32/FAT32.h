@@ -12,7 +12,7 @@
 namespace FAT {
 
 class FileAllocationTable;
-class Directory;
+class DirectoryTree;
 
 class FAT32 final : public FileSystem
 {
@@ -20,21 +20,37 @@ public:
     FAT32(DiskImage& image, size_t lba_offset, size_t sector_count, const additional_options_t& options);
 
     void finalize() override;
-    void store(const FSObject&) override;
+    directory_handle_t open_directory(std::string_view path) override;
+    directory_handle_t find_directory_in(directory_handle_t directory, std::string_view name) override;
+    void store_in(directory_handle_t directory, std::string_view name, const std::vector<uint8_t>& data, uint8_t attributes) override;
+    void store_file_in(directory_handle_t directory, std::string_view name, HostFile& file, uint8_t attributes) override;
+    directory_handle_t store_directory_in(directory_handle_t directory, std::string_view name) override;
+    void store_subtrees(const std::vector<std::string>& names, const subtree_builder_t& builder, size_t jobs) override;
+    SpaceEstimate estimate(const Inventory&) override;
 
     [[nodiscard]] FileAllocationTable& allocation_table();
     [[nodiscard]] size_t sectors_per_cluster() const { return m_sectors_per_cluster; }
+    [[nodiscard]] size_t cluster_size() const { return m_sectors_per_cluster * sector_size(); }
     [[nodiscard]] size_t cluster_to_byte_offset(size_t) const;
     [[nodiscard]] bool use_vfat() const { return m_use_vfat; }
 
-    ~FAT32();
+    // Picks the cluster size (in bytes) that leaves the most room after storing the contents of 'inventory'
+    // on a filesystem of 'sector_count' sectors, slightly larger clusters win if they cost next to nothing
+    static size_t tune_cluster_size(size_t sector_count, size_t sector_size, const additional_options_t& options, const Inventory& inventory);
 
 private:
-    std::pair<uint32_t, uint32_t> calculate_fat_length();
+    // cluster count and padded FAT entry count
+    static std::pair<uint32_t, uint32_t> calculate_fat_length(size_t sector_count, size_t sectors_per_cluster, size_t sector_size);
     void validate_vbr();
     void construct_ebpb();
 
-    size_t pick_sectors_per_cluster();
+    size_t pick_sectors_per_cluster(const additional_options_t& options);
+    static size_t default_sectors_per_cluster(size_t sector_count, size_t sector_size);
+
+    // free_cluster_count is what's free right after formatting
+    static SpaceEstimate estimate(const Inventory&, size_t cluster_size, size_t free_cluster_count, bool use_vfat);
+
+    static uint32_t resolve(const DirectoryTree& tree, std::string_view path);
 
 private:
     static constexpr uint32_t max_cluster_index = 0x0FFFFFEF;
@@ -43,6 +59,19 @@ private:
     static constexpr uint32_t free_cluster = 0x00000000;
     static constexpr size_t vbr_size = 512;
 
+    // Anything with fewer clusters is FAT16 as far as everyone else is concerned
+    static constexpr uint32_t min_cluster_count = 65525;
+
+    // Sectors per cluster is a single byte, 64K is as large as Windows goes
+    static constexpr size_t max_cluster_size = 64 * KB;
+
+    // tuning stops here, the default table doesn't go past 32K either and not every system mounts 64K clusters
+    static constexpr size_t max_tuned_cluster_size = 32 * KB;
+
+    // Clusters reserved at once by every concurrent subtree builder,
+    // whatever is left over in the last range of each builder is wasted.
+    static constexpr uint32_t subtree_reservation_granularity = 256;
+
     // Has to be exactly 32, otherwise Windows will not mount it
     static constexpr uint32_t reserved_sector_count = 32;
 
@@ -53,7 +82,7 @@ private:
     bool m_use_vfat { true };
 
     std::shared_ptr<FileAllocationTable> m_allocation_table;
-    std::shared_ptr<Directory> m_root_dir;
+    std::shared_ptr<DirectoryTree> m_directories;
 };
 
 }
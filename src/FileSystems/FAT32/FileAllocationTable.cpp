@@ -1,5 +1,6 @@
 #include "FileAllocationTable.h"
 #include <set>
+#include <algorithm>
 namespace FAT {
 
 FileAllocationTable::FileAllocationTable(FAT32& parent, uint32_t capacity, uint32_t padded_capacity)
@@ -45,6 +46,67 @@ uint32_t FileAllocationTable::allocate(uint32_t cluster_count, uint32_t connect_
     return first_cluster;
 }
 
+uint32_t FileAllocationTable::reserve(uint32_t cluster_count)
+{
+    std::lock_guard lock(m_reservation_lock);
+
+    if (!cluster_count || cluster_count > m_table.size() - m_next_to_allocate)
+        return 0;
+
+    auto first_cluster = m_next_to_allocate;
+    m_next_to_allocate += cluster_count;
+
+    return first_cluster;
+}
+
+uint32_t FileAllocationTable::free_cluster_count() const
+{
+    // reservations might leave holes behind
+    return std::count(m_table.begin() + 2, m_table.end(), free_cluster);
+}
+
+FileAllocationTable::Reservation::Reservation(FileAllocationTable& table, uint32_t granularity)
+    : m_table(table)
+    , m_granularity(granularity)
+{
+}
+
+uint32_t FileAllocationTable::Reservation::allocate(uint32_t cluster_count, uint32_t connect_to)
+{
+    if (!cluster_count)
+        return 0;
+
+    if (m_end - m_next < cluster_count) {
+        auto to_reserve = std::max(cluster_count, m_granularity);
+        auto first_cluster = m_table.reserve(to_reserve);
+
+        // try to at least get the exact amount
+        if (!first_cluster && to_reserve != cluster_count) {
+            to_reserve = cluster_count;
+            first_cluster = m_table.reserve(to_reserve);
+        }
+
+        if (!first_cluster)
+            return 0;
+
+        m_next = first_cluster;
+        m_end = first_cluster + to_reserve;
+    }
+
+    auto first_cluster = m_next;
+    m_next += cluster_count;
+
+    for (auto cluster = first_cluster; cluster < m_next - 1; ++cluster)
+        m_table.put_entry(cluster, cluster + 1);
+
+    m_table.put_entry(m_next - 1, end_of_chain);
+
+    if (connect_to)
+        m_table.put_entry(connect_to, first_cluster);
+
+    return first_cluster;
+}
+
 uint32_t FileAllocationTable::next_free(uint32_t after_index) const
 {
     ensure_legal_cluster(after_index + 1);
@@ -90,15 +152,23 @@ void FileAllocationTable::ensure_legal_cluster(uint32_t index) const
         throw std::runtime_error("file allocation table overflow");
 }
 
-void FileAllocationTable::write_into(DiskImage& image, size_t count)
+void FileAllocationTable::write_into(DiskImage& image, size_t offset, size_t count)
 {
-    auto padding_bytes = (m_padded_capacity - m_table.size()) * sizeof(uint32_t);
+    auto table_bytes = m_table.size() * sizeof(uint32_t);
+
+    // the copies are back to back, so together with the padding in between
+    // they go out as a single write
+    std::vector<uint8_t> padding(m_padded_capacity * sizeof(uint32_t) - table_bytes, 0);
+    std::vector<IOSlice> slices;
 
-    while (count--) {
-        image.write(m_table.data(), m_table.size() * sizeof(uint32_t));
-        if (padding_bytes)
-            image.skip(padding_bytes);
+    for (size_t i = 0; i < count; ++i) {
+        if (i)
+            slices.push_back({ padding.data(), padding.size() });
+
+        slices.push_back({ m_table.data(), table_bytes });
     }
+
+    image.write_at(slices.data(), slices.size(), offset);
 }
 
 uint32_t FileAllocationTable::get_entry(uint32_t index) const
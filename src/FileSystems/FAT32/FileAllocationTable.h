@@ -3,28 +3,59 @@
 #include <utility>
 #include <vector>
 #include <cstdint>
+#include <mutex>
 
 #include "DiskImages/DiskImage.h"
 #include "FAT32.h"
 
 namespace FAT {
 
-class FileAllocationTable
+class ClusterAllocator
+{
+public:
+    // Allocates a contiguous chain of clusters, returns 0 if there's not enough space
+    virtual uint32_t allocate(uint32_t cluster_count, uint32_t connect_to = 0) = 0;
+
+    virtual ~ClusterAllocator() = default;
+};
+
+class FileAllocationTable final : public ClusterAllocator
 {
 public:
     FileAllocationTable(FAT32& parent, uint32_t capacity, uint32_t padded_capacity);
 
+    // Hands out clusters from ranges reserved up front, so that multiple
+    // reservations can allocate from separate threads without any locking.
+    // Clusters left over at the end of a range are simply never used.
+    class Reservation final : public ClusterAllocator
+    {
+    public:
+        Reservation(FileAllocationTable& table, uint32_t granularity);
+
+        uint32_t allocate(uint32_t cluster_count, uint32_t connect_to = 0) override;
+
+    private:
+        FileAllocationTable& m_table;
+        uint32_t m_granularity { 0 };
+
+        uint32_t m_next { 0 };
+        uint32_t m_end { 0 };
+    };
+
     size_t size_in_clusters() const { return size_in_sectors() / m_parent.sectors_per_cluster(); }
-    uint32_t size_in_sectors() const { return ceiling_divide<size_t>((m_padded_capacity * 4ull), DiskImage::sector_size); }
+    uint32_t size_in_sectors() const { return ceiling_divide<size_t>((m_padded_capacity * 4ull), m_parent.sector_size()); }
 
-    uint32_t allocate(uint32_t cluster_count, uint32_t connect_to = free_cluster);
-    void write_into(DiskImage& image, size_t count = 2);
+    uint32_t allocate(uint32_t cluster_count, uint32_t connect_to = free_cluster) override;
+    void write_into(DiskImage& image, size_t offset, size_t count = 2);
 
     [[nodiscard]] uint32_t get_entry(uint32_t index) const;
-    [[nodiscard]] uint32_t free_cluster_count() const { return m_table.size() - m_next_to_allocate; }
+    [[nodiscard]] uint32_t free_cluster_count() const;
     [[nodiscard]] uint32_t last_allocated() const { return m_next_to_allocate - 1; }
 
 private:
+    // returns the first cluster of a free range of cluster_count, or 0 if it doesn't fit
+    uint32_t reserve(uint32_t cluster_count);
+
     uint32_t next_free(uint32_t after_index = 1) const;
     bool has_atleast(uint32_t free_clusters) const;
     void put_entry(uint32_t cluster, uint32_t value);
@@ -43,6 +74,8 @@ private:
     // real cluster value is m_next_to_allocate + 2
     uint32_t m_next_to_allocate { 0 };
     uint32_t m_padded_capacity { 0 };
+
+    std::mutex m_reservation_lock;
 };
 
 }
@@ -23,9 +23,7 @@ std::string generate_short_name(std::string_view long_name)
 {
     std::string short_name;
 
-    auto* long_name_ptr = long_name.data();
-
-    auto [name_length, extension_length] = length_of_name_and_extension(long_name_ptr);
+    auto [name_length, extension_length] = length_of_name_and_extension(long_name);
 
     bool needs_numeric_tail = false;
 
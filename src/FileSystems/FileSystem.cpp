@@ -1,26 +1,237 @@
 #include <memory>
 #include <stdexcept>
 #include <string_view>
+#include <filesystem>
+#include <algorithm>
+#include <exception>
 
 #include "FileSystem.h"
+#include "Inventory.h"
+#include "DiskImages/NullDiskImage.h"
 #include "FAT32/FAT32.h"
+#include "exFAT/ExFAT.h"
+#include "Ext/Ext2.h"
 
-std::shared_ptr<FileSystem> FileSystem::create(DiskImage& image, size_t lba_offset, size_t sector_count, const ArgParser& args)
+std::shared_ptr<FileSystem> FileSystem::create(DiskImage& image, size_t lba_offset, size_t sector_count, std::string_view type, const additional_options_t& options)
 {
-    auto raw = args.get_or("filesystem", "FAT32");
-    auto type = extract_main_value(raw);
-    auto options = parse_options(raw);
-
     if (type == "FAT32" || type == "fat32") {
         return std::make_shared<FAT::FAT32>(image, lba_offset, sector_count, options);
     }
 
+    if (type == "exFAT" || type == "exfat" || type == "EXFAT") {
+        return std::make_shared<FAT::ExFAT>(image, lba_offset, sector_count, options);
+    }
+
+    if (type == "ext2" || type == "EXT2") {
+        return std::make_shared<Ext2>(image, lba_offset, sector_count, options);
+    }
+
+    if (type == "ext4" || type == "EXT4") {
+        return std::make_shared<Ext2>(image, lba_offset, sector_count, options, Ext2::Variant::EXT4);
+    }
+
     throw std::runtime_error("unknown filesystem type " + std::string(type));
 }
 
+bool FileSystem::SpaceEstimate::fits(size_t headroom) const
+{
+    auto with_headroom = [&](size_t needed) { return needed + ceiling_divide<size_t>(needed * headroom, 100); };
+
+    return with_headroom(units_needed) <= units_free && with_headroom(inodes_needed) <= inodes_free;
+}
+
+additional_options_t FileSystem::tune(std::string_view type, additional_options_t options, size_t sector_count, size_t sector_size, const Inventory& inventory)
+{
+    auto cluster_size = options.find("cluster_size");
+    if (cluster_size == options.end() || cluster_size->second != "auto")
+        return options;
+
+    if (type != "FAT32" && type != "fat32")
+        throw std::runtime_error("cluster_size=auto is only supported by FAT32");
+
+    cluster_size->second = std::to_string(FAT::FAT32::tune_cluster_size(sector_count, sector_size, options, inventory));
+    return options;
+}
+
+FileSystem::SpaceEstimate FileSystem::plan(std::string_view type, const additional_options_t& options, size_t sector_count, size_t sector_size, const Inventory& inventory)
+{
+    NullDiskImage image(sector_count * sector_size, sector_size);
+
+    return create(image, 0, sector_count, type, tune(type, options, sector_count, sector_size, inventory))->estimate(inventory);
+}
+
+size_t FileSystem::minimal_sector_count(std::string_view type, const additional_options_t& options, size_t sector_size, const Inventory& inventory, size_t headroom)
+{
+    auto sectors_per_mb = MB / sector_size;
+    static constexpr size_t max_size_in_mb = 16 * TB / MB;
+
+    std::exception_ptr last_error;
+
+    auto fits = [&](size_t size_in_mb) {
+        try {
+            return plan(type, options, size_in_mb * sectors_per_mb, sector_size, inventory).fits(headroom);
+        } catch (const std::runtime_error&) {
+            // most likely too small (or too big) for the filesystem to exist at all
+            last_error = std::current_exception();
+            return false;
+        }
+    };
+
+    size_t too_small = 0;
+    size_t large_enough = 1;
+
+    while (!fits(large_enough)) {
+        too_small = large_enough;
+        large_enough *= 2;
+
+        if (large_enough > max_size_in_mb) {
+            if (last_error)
+                std::rethrow_exception(last_error);
+
+            throw std::runtime_error("contents don't fit on any " + std::string(type) + " filesystem");
+        }
+    }
+
+    // Cluster sizes grow along with volumes, so a smaller volume might fit where a larger one
+    // didn't, but whatever this ends up with is one that fits. Big volumes are only narrowed
+    // down to about 0.1% as every step formats one.
+    while (large_enough - too_small > std::max<size_t>(1, large_enough / 1024)) {
+        auto middle = too_small + (large_enough - too_small) / 2;
+
+        if (fits(middle))
+            large_enough = middle;
+        else
+            too_small = middle;
+    }
+
+    return large_enough * sectors_per_mb;
+}
+
 FileSystem::FileSystem(DiskImage& image, size_t lba_offset, size_t sector_count)
     : m_image(image)
     , m_lba_offset(lba_offset)
     , m_sector_count(sector_count)
 {
 }
+
+void FSObjectSink::store(const FSObject& obj)
+{
+    if (obj.type == FSObject::INVALID)
+        throw std::runtime_error("invalid type of fs object");
+
+    std::filesystem::path path(obj.path);
+    auto directory = open_directory(path.parent_path().string());
+    auto name = path.filename().string();
+
+    if (obj.type == FSObject::DIRECTORY)
+        store_directory_in(directory, name);
+    else
+        store_in(directory, name, obj.data, obj.attributes);
+}
+
+void FSObjectSink::store_file_in(directory_handle_t directory, std::string_view name, HostFile& file, uint8_t attributes)
+{
+    store_in(directory, name, file.read_entire(), attributes);
+}
+
+void FileContents::write_into(DiskImage& image, const std::vector<std::pair<size_t, size_t>>& layout) const
+{
+    size_t run = 0;
+    size_t run_begin = 0;
+
+    // pieces come in file order, so the run we're in only ever moves forward
+    auto for_each_chunk = [&](size_t size, size_t offset, auto&& consume) {
+        while (size) {
+            while (run < layout.size() && offset >= run_begin + layout[run].second)
+                run_begin += layout[run++].second;
+
+            if (run == layout.size())
+                throw std::runtime_error("file contents don't fit into their clusters");
+
+            auto offset_within_run = offset - run_begin;
+            auto chunk = std::min(size, layout[run].second - offset_within_run);
+            consume(chunk, layout[run].first + offset_within_run);
+
+            size -= chunk;
+            offset += chunk;
+        }
+    };
+
+    // holes aren't written, but they're still part of the file
+    size_t end_of_last_piece = 0;
+    auto skip_hole_until = [&](size_t offset) {
+        for_each_chunk(offset - end_of_last_piece, end_of_last_piece, [&](size_t chunk, size_t image_offset) {
+            image.mark_zeroed(chunk, image_offset);
+        });
+    };
+
+    auto write_piece = [&](const uint8_t* data, size_t size, size_t offset) {
+        skip_hole_until(offset);
+
+        for_each_chunk(size, offset, [&](size_t chunk, size_t image_offset) {
+            // the clusters of a file are only ever written once
+            image.write_fresh_at(data, chunk, image_offset);
+            data += chunk;
+        });
+
+        end_of_last_piece = offset + size;
+    };
+
+    if (m_data)
+        write_piece(m_data->data(), m_data->size(), 0);
+    else
+        m_file->for_each_data_piece(write_piece);
+
+    skip_hole_until(size());
+}
+
+void FileSystem::store_subtrees(const std::vector<std::string>& names, const subtree_builder_t& builder, size_t)
+{
+    class PrefixedSubtree final : public Subtree
+    {
+    public:
+        PrefixedSubtree(FileSystem& fs, std::string prefix)
+            : m_fs(fs)
+            , m_prefix(std::move(prefix))
+        {
+        }
+
+        directory_handle_t open_directory(std::string_view path) override
+        {
+            return m_fs.open_directory(m_prefix + std::string(path));
+        }
+
+        directory_handle_t find_directory_in(directory_handle_t directory, std::string_view name) override
+        {
+            return m_fs.find_directory_in(directory, name);
+        }
+
+        void store_in(directory_handle_t directory, std::string_view name, const std::vector<uint8_t>& data, uint8_t attributes) override
+        {
+            m_fs.store_in(directory, name, data, attributes);
+        }
+
+        void store_file_in(directory_handle_t directory, std::string_view name, HostFile& file, uint8_t attributes) override
+        {
+            m_fs.store_file_in(directory, name, file, attributes);
+        }
+
+        directory_handle_t store_directory_in(directory_handle_t directory, std::string_view name) override
+        {
+            return m_fs.store_directory_in(directory, name);
+        }
+
+    private:
+        FileSystem& m_fs;
+        std::string m_prefix;
+    };
+
+    auto root = open_directory("/");
+
+    for (size_t i = 0; i < names.size(); ++i) {
+        store_directory_in(root, names[i]);
+
+        PrefixedSubtree subtree(*this, "/" + names[i]);
+        builder(i, subtree);
+    }
+}
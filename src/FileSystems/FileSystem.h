@@ -2,8 +2,10 @@
 
 #include <memory>
 #include <string_view>
+#include <functional>
 
 #include "Utilities/Common.h"
+#include "Utilities/HostFile.h"
 #include "DiskImages/DiskImage.h"
 
 struct FSObject {
@@ -13,6 +15,14 @@ struct FSObject {
         DIRECTORY
     } type { INVALID };
 
+    // FAT style attribute hints, ignored by filesystems that don't have an equivalent
+    enum Attribute : uint8_t {
+        READ_ONLY = 1 << 0,
+        HIDDEN    = 1 << 1,
+        SYSTEM    = 1 << 2
+    };
+    uint8_t attributes { 0 };
+
     // path where to store the file on the filesystem
     std::string path;
 
@@ -21,19 +31,122 @@ struct FSObject {
     std::vector<uint8_t> data;
 };
 
-class FileSystem
+// Contents of a regular file to store, either in memory already or read from a host file
+// while they're written. Filesystems lay out the file as usual, but holes of sparse host
+// files are neither read nor written, the image is zeroed there already.
+class FileContents
 {
 public:
-    static std::shared_ptr<FileSystem> create(DiskImage&, size_t lba_offset, size_t sector_count, const ArgParser& args);
+    FileContents(const std::vector<uint8_t>& data)
+        : m_data(&data)
+    {
+    }
+
+    FileContents(HostFile& file)
+        : m_file(&file)
+    {
+    }
+
+    size_t size() const { return m_data ? m_data->size() : m_file->size(); }
+
+    // the data itself if it's in memory, nullptr otherwise
+    const std::vector<uint8_t>* in_memory() const { return m_data; }
+
+    // 'layout' lists the (image byte offset, length) of each piece of the file in order,
+    // e.g. one for every contiguous run of clusters
+    void write_into(DiskImage& image, const std::vector<std::pair<size_t, size_t>>& layout) const;
+
+private:
+    const std::vector<uint8_t>* m_data { nullptr };
+    HostFile* m_file { nullptr };
+};
+
+class Inventory;
+
+// Opaque reference to a directory, stays valid for as long as its filesystem is alive
+using directory_handle_t = void*;
+
+// Anything FSObjects can be stored into, either a filesystem or a detached subtree of one
+class FSObjectSink
+{
+public:
+    // Resolves the parent directory of obj.path and stores it there
+    virtual void store(const FSObject&);
+
+    // Looks up an existing directory once, so that its children
+    // can then be stored without walking the path again every time
+    virtual directory_handle_t open_directory(std::string_view path) = 0;
+
+    // Returns nullptr if there's no such subdirectory
+    virtual directory_handle_t find_directory_in(directory_handle_t directory, std::string_view name) = 0;
+
+    virtual void store_in(directory_handle_t directory, std::string_view name, const std::vector<uint8_t>& data, uint8_t attributes = 0) = 0;
+
+    // Stores a file from the host without reading it in full up front, sinks that don't
+    // support that read it in one go, holes included
+    virtual void store_file_in(directory_handle_t directory, std::string_view name, HostFile& file, uint8_t attributes = 0);
+
+    virtual directory_handle_t store_directory_in(directory_handle_t directory, std::string_view name) = 0;
+
+    virtual ~FSObjectSink() = default;
+};
+
+class FileSystem : public FSObjectSink
+{
+public:
+    static std::shared_ptr<FileSystem> create(DiskImage&, size_t lba_offset, size_t sector_count, std::string_view type, const additional_options_t& options);
+
+    // How much of a filesystem the contents of an Inventory would take up, in its allocation units (clusters or blocks)
+    struct SpaceEstimate {
+        size_t unit_size { 0 };
+
+        // free right after formatting
+        size_t units_free { 0 };
+        size_t units_needed { 0 };
+
+        // only filesystems with a fixed number of inodes set these
+        size_t inodes_free { 0 };
+        size_t inodes_needed { 0 };
+
+        // with 'headroom' percent of what's needed left free on top
+        [[nodiscard]] bool fits(size_t headroom) const;
+    };
+
+    // Resolves the options that depend on what's going to be stored, i.e. cluster_size=auto (FAT32 only),
+    // into concrete values for a filesystem of 'sector_count' sectors. Other options are passed through.
+    static additional_options_t tune(std::string_view type, additional_options_t options, size_t sector_count, size_t sector_size, const Inventory&);
+
+    // Formats a filesystem into an image that discards everything and estimates the inventory on it,
+    // nothing is written anywhere. Throws if there can't be such a filesystem, e.g. it's too small.
+    static SpaceEstimate plan(std::string_view type, const additional_options_t& options, size_t sector_count, size_t sector_size, const Inventory&);
+
+    // Sector count of the smallest filesystem (in whole megabytes) that fits the inventory with 'headroom' percent to spare
+    static size_t minimal_sector_count(std::string_view type, const additional_options_t& options, size_t sector_size, const Inventory&, size_t headroom);
 
     FileSystem(DiskImage&, size_t lba_offset, size_t sector_count);
 
-    virtual void store(const FSObject&) = 0;
+    // Writes out everything that's only known once all objects are stored, has to be called
+    // explicitly as it can fail. Filesystems that are never finalized are simply thrown away.
     virtual void finalize() = 0;
 
+    // A detached top-level directory, paths are relative to its root
+    class Subtree : public FSObjectSink
+    {
+    };
+    using subtree_builder_t = std::function<void(size_t index, Subtree&)>;
+
+    // Creates a top-level directory for each of the names and invokes the builder for it.
+    // Filesystems that support it run builders on up to 'jobs' threads at once,
+    // the default implementation runs them one by one on the calling thread.
+    virtual void store_subtrees(const std::vector<std::string>& names, const subtree_builder_t& builder, size_t jobs);
+
+    // Works out how much space storing the contents of 'inventory' would take, the filesystem has to be empty still
+    virtual SpaceEstimate estimate(const Inventory& inventory) = 0;
+
     [[nodiscard]] size_t lba_offset() const { return m_lba_offset; }
     [[nodiscard]] size_t sector_count() const { return m_sector_count; }
     [[nodiscard]] DiskImage& image() const { return m_image; }
+    [[nodiscard]] size_t sector_size() const { return m_image.sector_size(); }
 
     virtual ~FileSystem() = default;
 
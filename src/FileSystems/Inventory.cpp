@@ -0,0 +1,156 @@
+#include <filesystem>
+#include <stdexcept>
+
+#include "Inventory.h"
+
+static directory_handle_t to_handle(Inventory::index_t index)
+{
+    return reinterpret_cast<directory_handle_t>(static_cast<uintptr_t>(index) + 1);
+}
+
+static Inventory::index_t to_index(directory_handle_t handle)
+{
+    return static_cast<Inventory::index_t>(reinterpret_cast<uintptr_t>(handle) - 1);
+}
+
+Inventory::Inventory()
+{
+    m_directories.push_back({ 0, {} });
+}
+
+Inventory::index_t Inventory::add(index_t parent, std::string_view name, size_t size, bool is_directory)
+{
+    auto& children = m_directories.at(parent).children;
+
+    // names are compared as is, filesystems that ignore case might still find a conflict later
+    if (children.find(name) != children.end())
+        throw std::runtime_error(std::string(name) + " already exists");
+
+    auto index = static_cast<index_t>(m_entries.size());
+
+    Entry entry {};
+    entry.name = m_names.add(name);
+    entry.parent = parent;
+    entry.directory = no_index;
+    entry.size = size;
+
+    if (is_directory) {
+        entry.directory = static_cast<index_t>(m_directories.size());
+        m_directories.push_back({ m_directories[parent].subtree, {} });
+    }
+
+    m_entries.push_back(entry);
+    m_directories[parent].children.emplace(entry.name, index);
+    m_data_size += size;
+
+    return index;
+}
+
+Inventory::index_t Inventory::find_subdirectory(index_t directory, std::string_view name) const
+{
+    auto& children = m_directories.at(directory).children;
+    auto child = children.find(name);
+
+    return child == children.end() ? no_index : m_entries[child->second].directory;
+}
+
+directory_handle_t Inventory::open_directory(std::string_view path)
+{
+    index_t directory = 0;
+
+    for (auto& component : std::filesystem::path(path)) {
+        if (component.empty() || component == "/" || component == "\\")
+            continue;
+
+        directory = find_subdirectory(directory, component.string());
+
+        if (directory == no_index)
+            throw std::runtime_error("no such directory " + std::string(path));
+    }
+
+    return to_handle(directory);
+}
+
+directory_handle_t Inventory::find_directory_in(directory_handle_t directory, std::string_view name)
+{
+    auto subdirectory = find_subdirectory(to_index(directory), name);
+
+    return subdirectory == no_index ? nullptr : to_handle(subdirectory);
+}
+
+void Inventory::store_in(directory_handle_t directory, std::string_view name, const std::vector<uint8_t>& data, uint8_t)
+{
+    add(to_index(directory), name, data.size(), false);
+}
+
+void Inventory::store_file_in(directory_handle_t directory, std::string_view name, HostFile& file, uint8_t)
+{
+    add(to_index(directory), name, file.size(), false);
+}
+
+directory_handle_t Inventory::store_directory_in(directory_handle_t directory, std::string_view name)
+{
+    return to_handle(m_entries[add(to_index(directory), name, 0, true)].directory);
+}
+
+void Inventory::store_subtrees(const std::vector<std::string>& names, const FileSystem::subtree_builder_t& builder, size_t)
+{
+    class Subtree final : public FileSystem::Subtree
+    {
+    public:
+        Subtree(Inventory& inventory, index_t root)
+            : m_inventory(inventory)
+            , m_root(root)
+        {
+        }
+
+        directory_handle_t open_directory(std::string_view path) override
+        {
+            auto directory = m_root;
+
+            for (auto& component : std::filesystem::path(path)) {
+                if (component.empty() || component == "/" || component == "\\")
+                    continue;
+
+                directory = m_inventory.find_subdirectory(directory, component.string());
+
+                if (directory == no_index)
+                    throw std::runtime_error("no such directory " + std::string(path));
+            }
+
+            return to_handle(directory);
+        }
+
+        directory_handle_t find_directory_in(directory_handle_t directory, std::string_view name) override
+        {
+            return m_inventory.find_directory_in(directory, name);
+        }
+
+        void store_in(directory_handle_t directory, std::string_view name, const std::vector<uint8_t>& data, uint8_t attributes) override
+        {
+            m_inventory.store_in(directory, name, data, attributes);
+        }
+
+        void store_file_in(directory_handle_t directory, std::string_view name, HostFile& file, uint8_t attributes) override
+        {
+            m_inventory.store_file_in(directory, name, file, attributes);
+        }
+
+        directory_handle_t store_directory_in(directory_handle_t directory, std::string_view name) override
+        {
+            return m_inventory.store_directory_in(directory, name);
+        }
+
+    private:
+        Inventory& m_inventory;
+        index_t m_root;
+    };
+
+    for (size_t i = 0; i < names.size(); ++i) {
+        auto root = m_entries[add(0, names[i], 0, true)].directory;
+        m_directories[root].subtree = ++m_subtree_count;
+
+        Subtree subtree(*this, root);
+        builder(i, subtree);
+    }
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <cstdint>
+
+#include "Utilities/StringPool.h"
+#include "FileSystem.h"
+
+// Takes stock of everything stored into it without storing any data, only names and sizes
+// are kept (host files aren't even read). Filesystems work out from that how much space
+// the same stores would take up on them, see FileSystem::estimate().
+class Inventory final : public FSObjectSink
+{
+public:
+    using index_t = uint32_t;
+    static constexpr index_t no_index = 0xFFFFFFFF;
+
+    struct Entry {
+        std::string_view name;
+
+        // directory the entry was stored in
+        index_t parent;
+
+        // no_index for files
+        index_t directory;
+
+        size_t size;
+    };
+
+    Inventory();
+
+    directory_handle_t open_directory(std::string_view path) override;
+    directory_handle_t find_directory_in(directory_handle_t directory, std::string_view name) override;
+    void store_in(directory_handle_t directory, std::string_view name, const std::vector<uint8_t>& data, uint8_t attributes = 0) override;
+    void store_file_in(directory_handle_t directory, std::string_view name, HostFile& file, uint8_t attributes = 0) override;
+    directory_handle_t store_directory_in(directory_handle_t directory, std::string_view name) override;
+
+    // Same as FileSystem::store_subtrees, the builders run one after another. Directories stored
+    // this way remember which subtree they belong to, as filesystems might allocate them separately.
+    void store_subtrees(const std::vector<std::string>& names, const FileSystem::subtree_builder_t& builder, size_t jobs);
+
+    // in the order they were stored in
+    [[nodiscard]] const std::vector<Entry>& entries() const { return m_entries; }
+
+    // directory 0 is the root, every other one has an entry
+    [[nodiscard]] size_t directory_count() const { return m_directories.size(); }
+
+    // 1-based index of the detached subtree the directory was stored in, 0 if it wasn't
+    [[nodiscard]] uint32_t subtree_of(index_t directory) const { return m_directories[directory].subtree; }
+
+    [[nodiscard]] size_t file_count() const { return m_entries.size() - (m_directories.size() - 1); }
+    [[nodiscard]] size_t data_size() const { return m_data_size; }
+
+private:
+    index_t add(index_t parent, std::string_view name, size_t size, bool is_directory);
+    index_t find_subdirectory(index_t directory, std::string_view name) const;
+
+    struct Directory {
+        uint32_t subtree;
+        std::unordered_map<std::string_view, index_t> children;
+    };
+
+    std::vector<Directory> m_directories;
+    std::vector<Entry> m_entries;
+    size_t m_data_size { 0 };
+    uint32_t m_subtree_count { 0 };
+    StringPool m_names;
+};
@@ -0,0 +1,679 @@
+#include "ExFAT.h"
+#include "Structures.h"
+#include "FileSystems/Inventory.h"
+
+#include <ctime>
+#include <cstring>
+#include <random>
+#include <filesystem>
+#include <algorithm>
+
+namespace FAT {
+
+static std::u16string to_utf16(std::string_view name)
+{
+    std::u16string result;
+
+    for (size_t i = 0; i < name.size();) {
+        auto byte = static_cast<uint8_t>(name[i]);
+
+        uint32_t code_point;
+        size_t length;
+
+        if (byte < 0x80) {
+            code_point = byte;
+            length = 1;
+        } else if ((byte & 0xE0) == 0xC0) {
+            code_point = byte & 0x1F;
+            length = 2;
+        } else if ((byte & 0xF0) == 0xE0) {
+            code_point = byte & 0x0F;
+            length = 3;
+        } else if ((byte & 0xF8) == 0xF0) {
+            code_point = byte & 0x07;
+            length = 4;
+        } else {
+            throw std::runtime_error("invalid UTF-8 in file name " + std::string(name));
+        }
+
+        if (i + length > name.size())
+            throw std::runtime_error("invalid UTF-8 in file name " + std::string(name));
+
+        for (size_t j = 1; j < length; ++j) {
+            auto next = static_cast<uint8_t>(name[i + j]);
+
+            if ((next & 0xC0) != 0x80)
+                throw std::runtime_error("invalid UTF-8 in file name " + std::string(name));
+
+            code_point = (code_point << 6) | (next & 0x3F);
+        }
+
+        if (code_point >= 0x10000) {
+            code_point -= 0x10000;
+            result.push_back(static_cast<char16_t>(0xD800 + (code_point >> 10)));
+            result.push_back(static_cast<char16_t>(0xDC00 + (code_point & 0x3FF)));
+        } else {
+            result.push_back(static_cast<char16_t>(code_point));
+        }
+
+        i += length;
+    }
+
+    return result;
+}
+
+// Our up-case table only covers ASCII and Latin-1, everything else maps to itself
+static char16_t upcase(char16_t c)
+{
+    if (c >= 'a' && c <= 'z')
+        return c - ('a' - 'A');
+
+    if (c >= 0xE0 && c <= 0xFE && c != 0xF7)
+        return c - 0x20;
+
+    if (c == 0xFF)
+        return 0x178;
+
+    return c;
+}
+
+static std::u16string upcased(const std::u16string& name)
+{
+    std::u16string result(name);
+
+    for (auto& c : result)
+        c = upcase(c);
+
+    return result;
+}
+
+static std::string_view as_bytes(const std::u16string& string)
+{
+    return { reinterpret_cast<const char*>(string.data()), string.size() * sizeof(char16_t) };
+}
+
+static uint16_t entry_set_checksum(const uint8_t* entries, size_t size)
+{
+    uint16_t checksum = 0;
+
+    for (size_t i = 0; i < size; ++i) {
+        // skip the checksum field itself
+        if (i == 2 || i == 3)
+            continue;
+
+        checksum = ((checksum & 1) ? 0x8000 : 0) + (checksum >> 1) + entries[i];
+    }
+
+    return checksum;
+}
+
+static uint16_t name_hash(const std::u16string& upcased_name)
+{
+    uint16_t hash = 0;
+
+    for (auto c : upcased_name) {
+        hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (c & 0xFF);
+        hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (c >> 8);
+    }
+
+    return hash;
+}
+
+static directory_handle_t to_handle(uint32_t index)
+{
+    return reinterpret_cast<directory_handle_t>(static_cast<uintptr_t>(index) + 1);
+}
+
+static uint32_t to_index(directory_handle_t handle)
+{
+    return static_cast<uint32_t>(reinterpret_cast<uintptr_t>(handle) - 1);
+}
+
+ExFAT::ExFAT(DiskImage& image, size_t lba_offset, size_t sector_count, const additional_options_t& options)
+    : FileSystem(image, lba_offset, sector_count)
+{
+    // Microsoft's defaults for the volume size
+    auto size_in_bytes = sector_count * sector_size();
+    size_t cluster_size = 128 * KB;
+
+    if (size_in_bytes <= 256 * MB)
+        cluster_size = 4 * KB;
+    else if (size_in_bytes <= 32ull * GB)
+        cluster_size = 32 * KB;
+
+    auto cluster_size_option = options.find("cluster_size");
+    if (cluster_size_option != options.end())
+        cluster_size = std::stoul(cluster_size_option->second);
+
+    if (cluster_size < sector_size() || cluster_size > 32 * MB || (cluster_size & (cluster_size - 1)))
+        throw std::runtime_error("exFAT cluster size has to be a power of two between the sector size and 32MB");
+
+    compute_geometry(cluster_size);
+
+    auto now = std::time(nullptr);
+    auto time = *std::gmtime(&now);
+
+    m_timestamp = (static_cast<uint32_t>(time.tm_year - 80) << 25) | (static_cast<uint32_t>(time.tm_mon + 1) << 21) |
+                  (static_cast<uint32_t>(time.tm_mday) << 16) | (static_cast<uint32_t>(time.tm_hour) << 11) |
+                  (static_cast<uint32_t>(time.tm_min) << 5) | static_cast<uint32_t>(time.tm_sec / 2);
+
+    m_serial_number = std::random_device()();
+
+    auto label_option = options.find("label");
+    if (label_option != options.end()) {
+        m_volume_label = to_utf16(label_option->second);
+
+        if (m_volume_label.size() > 11)
+            throw std::runtime_error("exFAT volume label cannot be longer than 11 characters");
+    }
+
+    set_fat_entry(0, media_descriptor_entry);
+    set_fat_entry(1, end_of_chain);
+
+    m_allocation_bitmap = Bitmap(m_cluster_count);
+
+    auto bitmap_bytes = ceiling_divide<size_t>(m_cluster_count, 8);
+    auto bitmap_runs = allocate(static_cast<uint32_t>(ceiling_divide(bitmap_bytes, m_cluster_size)));
+    link_chain(bitmap_runs);
+    m_bitmap_clusters = bitmap_runs.front();
+
+    write_upcase_table();
+
+    auto root_cluster = allocate(1).front().first;
+    set_fat_entry(root_cluster, end_of_chain);
+
+    auto& root = m_directories.emplace_back();
+    root.first_cluster = root_cluster;
+    root.last_cluster = root_cluster;
+    root.cluster_count = 1;
+    root.offset_within_cluster = 0;
+
+    ExFATVolumeLabelEntry label {};
+    label.entry_type = entry_type_volume_label;
+    label.character_count = static_cast<uint8_t>(m_volume_label.size());
+    memcpy(label.volume_label, m_volume_label.data(), m_volume_label.size() * sizeof(char16_t));
+    append_entry(0, reinterpret_cast<const uint8_t*>(&label));
+
+    ExFATAllocationBitmapEntry bitmap {};
+    bitmap.entry_type = entry_type_allocation_bitmap;
+    bitmap.first_cluster = m_bitmap_clusters.first;
+    bitmap.data_length = bitmap_bytes;
+    append_entry(0, reinterpret_cast<const uint8_t*>(&bitmap));
+
+    ExFATUpcaseTableEntry upcase_table {};
+    upcase_table.entry_type = entry_type_upcase_table;
+    upcase_table.table_checksum = m_upcase_checksum;
+    upcase_table.first_cluster = m_upcase_clusters.first;
+    upcase_table.data_length = m_upcase_length;
+    append_entry(0, reinterpret_cast<const uint8_t*>(&upcase_table));
+}
+
+void ExFAT::compute_geometry(size_t cluster_size)
+{
+    m_cluster_size = cluster_size;
+
+    auto sectors_per_cluster = cluster_size / sector_size();
+    while ((size_t(1) << m_sectors_per_cluster_shift) < sectors_per_cluster)
+        ++m_sectors_per_cluster_shift;
+
+    auto volume_sectors = sector_count();
+    if (volume_sectors <= fat_offset_in_sectors)
+        throw std::runtime_error("disk is too small for exFAT");
+
+    auto max_clusters = std::min<size_t>((volume_sectors - fat_offset_in_sectors) / sectors_per_cluster, max_cluster_count);
+
+    // round up to 4K so that the FAT always ends on a page boundary
+    auto sectors_per_page = std::max<size_t>(1, 4096 / sector_size());
+    auto fat_length = ceiling_divide((max_clusters + 2) * sizeof(uint32_t), sector_size());
+    fat_length = ceiling_divide(fat_length, sectors_per_page) * sectors_per_page;
+
+    auto cluster_heap_offset = ceiling_divide(fat_offset_in_sectors + fat_length, sectors_per_cluster) * sectors_per_cluster;
+    if (cluster_heap_offset >= volume_sectors)
+        throw std::runtime_error("disk is too small for exFAT");
+
+    auto cluster_count = std::min<size_t>((volume_sectors - cluster_heap_offset) / sectors_per_cluster, max_cluster_count);
+
+    // bitmap, up-case table and root directory have to fit at the very least
+    if (cluster_count < 16)
+        throw std::runtime_error("disk is too small for exFAT, try a smaller cluster size");
+
+    m_fat_length_in_sectors = static_cast<uint32_t>(fat_length);
+    m_cluster_heap_offset = static_cast<uint32_t>(cluster_heap_offset);
+    m_cluster_count = static_cast<uint32_t>(cluster_count);
+}
+
+size_t ExFAT::cluster_to_byte_offset(uint32_t cluster) const
+{
+    return (lba_offset() + m_cluster_heap_offset) * sector_size() + (cluster - 2) * m_cluster_size;
+}
+
+std::vector<ExFAT::cluster_run_t> ExFAT::allocate(uint32_t count)
+{
+    std::vector<cluster_run_t> runs;
+
+    if (count == 0)
+        return runs;
+
+    // a single run is what lets files skip the FAT entirely
+    auto start = m_allocation_bitmap.find_clear_run(count);
+    if (start != Bitmap::npos) {
+        m_allocation_bitmap.set_range(start, start + count);
+        runs.emplace_back(static_cast<uint32_t>(start + 2), count);
+        return runs;
+    }
+
+    while (count) {
+        auto first = m_allocation_bitmap.find_first_clear();
+        if (first == Bitmap::npos)
+            throw std::runtime_error("exFAT ran out of free clusters");
+
+        auto length = static_cast<uint32_t>(m_allocation_bitmap.clear_run_length(first, count));
+        m_allocation_bitmap.set_range(first, first + length);
+        runs.emplace_back(static_cast<uint32_t>(first + 2), length);
+
+        count -= length;
+    }
+
+    return runs;
+}
+
+void ExFAT::link_chain(const std::vector<cluster_run_t>& runs)
+{
+    for (size_t i = 0; i < runs.size(); ++i) {
+        auto [first, length] = runs[i];
+
+        for (uint32_t cluster = first; cluster < first + length - 1; ++cluster)
+            set_fat_entry(cluster, cluster + 1);
+
+        set_fat_entry(first + length - 1, i + 1 < runs.size() ? runs[i + 1].first : end_of_chain);
+    }
+}
+
+void ExFAT::set_fat_entry(uint32_t cluster, uint32_t value)
+{
+    if (m_fat.size() <= cluster)
+        m_fat.resize(cluster + 1);
+
+    m_fat[cluster] = value;
+}
+
+void ExFAT::write_data(const std::vector<cluster_run_t>& runs, const FileContents& contents)
+{
+    std::vector<std::pair<size_t, size_t>> layout;
+
+    for (auto [first, length] : runs)
+        layout.emplace_back(cluster_to_byte_offset(first), length * m_cluster_size);
+
+    contents.write_into(image(), layout);
+}
+
+void ExFAT::write_upcase_table()
+{
+    std::vector<uint16_t> table;
+
+    for (uint32_t c = 0; c < 0x100; ++c)
+        table.push_back(upcase(static_cast<char16_t>(c)));
+
+    // the rest maps to itself, compressed as 0xFFFF followed by the length of that range
+    table.push_back(0xFFFF);
+    table.push_back(0xFF00);
+
+    std::vector<uint8_t> bytes(table.size() * sizeof(uint16_t));
+    for (size_t i = 0; i < table.size(); ++i) {
+        bytes[i * 2 + 0] = static_cast<uint8_t>(table[i]);
+        bytes[i * 2 + 1] = static_cast<uint8_t>(table[i] >> 8);
+    }
+
+    for (auto byte : bytes)
+        m_upcase_checksum = ((m_upcase_checksum & 1) ? 0x80000000 : 0) + (m_upcase_checksum >> 1) + byte;
+
+    auto runs = allocate(static_cast<uint32_t>(ceiling_divide(bytes.size(), m_cluster_size)));
+    link_chain(runs);
+    write_data(runs, bytes);
+
+    m_upcase_clusters = runs.front();
+    m_upcase_length = bytes.size();
+}
+
+std::vector<uint8_t> ExFAT::make_entry_set(const std::u16string& name, uint16_t attributes, uint8_t flags, uint32_t first_cluster, uint64_t length) const
+{
+    auto name_entries = ceiling_divide(name.size(), name_characters_per_entry);
+    std::vector<uint8_t> set((2 + name_entries) * entry_size);
+
+    ExFATFileEntry file {};
+    file.entry_type = entry_type_file;
+    file.secondary_count = static_cast<uint8_t>(1 + name_entries);
+    file.file_attributes = attributes;
+    file.create_timestamp = m_timestamp;
+    file.last_modified_timestamp = m_timestamp;
+    file.last_accessed_timestamp = m_timestamp;
+
+    // timestamps are in UTC
+    static constexpr uint8_t utc_offset_valid = 0x80;
+    file.create_utc_offset = utc_offset_valid;
+    file.last_modified_utc_offset = utc_offset_valid;
+    file.last_accessed_utc_offset = utc_offset_valid;
+
+    ExFATStreamExtensionEntry stream {};
+    stream.entry_type = entry_type_stream_extension;
+    stream.general_secondary_flags = flags;
+    stream.name_length = static_cast<uint8_t>(name.size());
+    stream.name_hash = name_hash(upcased(name));
+    stream.valid_data_length = length;
+    stream.first_cluster = first_cluster;
+    stream.data_length = length;
+
+    memcpy(set.data(), &file, entry_size);
+    memcpy(set.data() + entry_size, &stream, entry_size);
+
+    for (size_t i = 0; i < name_entries; ++i) {
+        ExFATFileNameEntry file_name {};
+        file_name.entry_type = entry_type_file_name;
+
+        auto characters = std::min(name_characters_per_entry, name.size() - i * name_characters_per_entry);
+        memcpy(file_name.file_name, name.data() + i * name_characters_per_entry, characters * sizeof(char16_t));
+
+        memcpy(set.data() + (2 + i) * entry_size, &file_name, entry_size);
+    }
+
+    auto checksum = entry_set_checksum(set.data(), set.size());
+    memcpy(set.data() + offsetof(ExFATFileEntry, set_checksum), &checksum, sizeof(checksum));
+
+    return set;
+}
+
+size_t ExFAT::append_entry(index_t index, const uint8_t* entry)
+{
+    auto& directory = m_directories[index];
+
+    if (directory.offset_within_cluster == m_cluster_size) {
+        auto cluster = allocate(1).front().first;
+
+        set_fat_entry(directory.last_cluster, cluster);
+        set_fat_entry(cluster, end_of_chain);
+
+        directory.last_cluster = cluster;
+        directory.offset_within_cluster = 0;
+        ++directory.cluster_count;
+    }
+
+    auto offset = cluster_to_byte_offset(directory.last_cluster) + directory.offset_within_cluster;
+    image().write_at(entry, entry_size, offset);
+
+    directory.offset_within_cluster += entry_size;
+
+    return offset;
+}
+
+std::u16string ExFAT::validate_new_name(index_t directory, std::string_view name) const
+{
+    auto utf16 = to_utf16(name);
+
+    if (utf16.empty() || utf16.size() > max_name_length || name == "." || name == "..")
+        throw std::runtime_error("invalid exFAT filename " + std::string(name));
+
+    static constexpr std::u16string_view banned_characters = u"\"*/:<>?\\|";
+
+    for (auto c : utf16) {
+        if (c < 0x20 || banned_characters.find(c) != std::u16string_view::npos)
+            throw std::runtime_error("invalid exFAT filename " + std::string(name));
+    }
+
+    auto upcased_name = upcased(utf16);
+
+    for (auto& child : m_directories[directory].children) {
+        if (child.upcased_name == as_bytes(upcased_name))
+            throw std::runtime_error(std::string(name) + " already exists");
+    }
+
+    return utf16;
+}
+
+ExFAT::index_t ExFAT::find_subdirectory(index_t directory, std::string_view name) const
+{
+    auto upcased_name = upcased(to_utf16(name));
+
+    for (auto& child : m_directories[directory].children) {
+        if (child.upcased_name == as_bytes(upcased_name))
+            return child.directory;
+    }
+
+    return no_index;
+}
+
+void ExFAT::add_child(index_t directory, const std::u16string& name, index_t subdirectory)
+{
+    m_directories[directory].children.push_back({ m_names.add(as_bytes(upcased(name))), subdirectory });
+}
+
+directory_handle_t ExFAT::open_directory(std::string_view path)
+{
+    index_t directory = 0;
+
+    for (auto& component : std::filesystem::path(path)) {
+        if (component.empty() || component == "/" || component == "\\")
+            continue;
+
+        directory = find_subdirectory(directory, component.string());
+
+        if (directory == no_index)
+            throw std::runtime_error("no such directory " + std::string(path));
+    }
+
+    return to_handle(directory);
+}
+
+directory_handle_t ExFAT::find_directory_in(directory_handle_t directory, std::string_view name)
+{
+    auto subdirectory = find_subdirectory(to_index(directory), name);
+
+    return subdirectory == no_index ? nullptr : to_handle(subdirectory);
+}
+
+void ExFAT::store_in(directory_handle_t handle, std::string_view name, const std::vector<uint8_t>& data, uint8_t attributes)
+{
+    store_contents(to_index(handle), name, data, attributes);
+}
+
+void ExFAT::store_file_in(directory_handle_t handle, std::string_view name, HostFile& file, uint8_t attributes)
+{
+    store_contents(to_index(handle), name, file, attributes);
+}
+
+void ExFAT::store_contents(index_t directory, std::string_view name, const FileContents& contents, uint8_t attributes)
+{
+    auto utf16 = validate_new_name(directory, name);
+
+    auto clusters = ceiling_divide(contents.size(), m_cluster_size);
+    if (clusters > m_cluster_count)
+        throw std::runtime_error("exFAT ran out of free clusters");
+
+    auto runs = allocate(static_cast<uint32_t>(clusters));
+    write_data(runs, contents);
+
+    // contiguous files are marked as such and never touch the FAT
+    uint8_t flags = flag_allocation_possible;
+    if (runs.size() == 1)
+        flags |= flag_no_fat_chain;
+    else if (runs.size() > 1)
+        link_chain(runs);
+
+    uint16_t file_attributes = attribute_archive | (attributes & (FSObject::READ_ONLY | FSObject::HIDDEN | FSObject::SYSTEM));
+    auto first_cluster = runs.empty() ? 0 : runs.front().first;
+
+    auto set = make_entry_set(utf16, file_attributes, flags, first_cluster, contents.size());
+    for (size_t offset = 0; offset < set.size(); offset += entry_size)
+        append_entry(directory, set.data() + offset);
+
+    add_child(directory, utf16, no_index);
+}
+
+directory_handle_t ExFAT::store_directory_in(directory_handle_t handle, std::string_view name)
+{
+    auto parent = to_index(handle);
+    auto utf16 = validate_new_name(parent, name);
+
+    auto cluster = allocate(1).front().first;
+    set_fat_entry(cluster, end_of_chain);
+
+    // directories grow one cluster at a time so they always use the FAT
+    auto set = make_entry_set(utf16, attribute_directory, flag_allocation_possible, cluster, m_cluster_size);
+
+    auto file_entry_offset = append_entry(parent, set.data());
+    auto stream_entry_offset = append_entry(parent, set.data() + entry_size);
+
+    for (size_t offset = 2 * entry_size; offset < set.size(); offset += entry_size)
+        append_entry(parent, set.data() + offset);
+
+    auto index = static_cast<index_t>(m_directories.size());
+
+    auto& directory = m_directories.emplace_back();
+    directory.first_cluster = cluster;
+    directory.last_cluster = cluster;
+    directory.cluster_count = 1;
+    directory.offset_within_cluster = 0;
+    directory.entry_set = std::move(set);
+    directory.file_entry_offset = file_entry_offset;
+    directory.stream_entry_offset = stream_entry_offset;
+
+    add_child(parent, utf16, index);
+
+    return to_handle(index);
+}
+
+FileSystem::SpaceEstimate ExFAT::estimate(const Inventory& inventory)
+{
+    SpaceEstimate estimate {};
+    estimate.unit_size = m_cluster_size;
+    estimate.units_free = m_cluster_count - m_allocation_bitmap.set_count();
+
+    // bytes in the last cluster of every directory, only the root has any entries so far
+    std::vector<size_t> used_bytes(inventory.directory_count(), 0);
+    used_bytes[0] = m_directories.front().offset_within_cluster;
+
+    for (auto& entry : inventory.entries()) {
+        // directories start out with a cluster of their own
+        if (entry.directory != Inventory::no_index)
+            estimate.units_needed += 1;
+        else
+            estimate.units_needed += ceiling_divide(entry.size, m_cluster_size);
+
+        auto set_entries = 2 + ceiling_divide(to_utf16(entry.name).size(), name_characters_per_entry);
+
+        for (size_t i = 0; i < set_entries; ++i) {
+            auto& used = used_bytes[entry.parent];
+
+            if (used == m_cluster_size) {
+                ++estimate.units_needed;
+                used = 0;
+            }
+
+            used += entry_size;
+        }
+    }
+
+    return estimate;
+}
+
+void ExFAT::finalize()
+{
+    // directories that grew past their first cluster have to report their new size
+    for (size_t i = 1; i < m_directories.size(); ++i) {
+        auto& directory = m_directories[i];
+
+        if (directory.cluster_count == 1)
+            continue;
+
+        auto& set = directory.entry_set;
+        uint64_t length = static_cast<uint64_t>(directory.cluster_count) * m_cluster_size;
+
+        auto* stream = set.data() + entry_size;
+        memcpy(stream + offsetof(ExFATStreamExtensionEntry, valid_data_length), &length, sizeof(length));
+        memcpy(stream + offsetof(ExFATStreamExtensionEntry, data_length), &length, sizeof(length));
+
+        auto checksum = entry_set_checksum(set.data(), set.size());
+        memcpy(set.data() + offsetof(ExFATFileEntry, set_checksum), &checksum, sizeof(checksum));
+
+        image().write_at(set.data(), entry_size, directory.file_entry_offset);
+        image().write_at(stream, entry_size, directory.stream_entry_offset);
+    }
+
+    // only the parts of the FAT that have any chains in them are written,
+    // the fresh image is zero filled already
+    static constexpr size_t entries_per_page = 4096 / sizeof(uint32_t);
+    auto fat_byte_offset = (lba_offset() + fat_offset_in_sectors) * sector_size();
+
+    for (size_t page = 0; page * entries_per_page < m_fat.size(); ++page) {
+        auto first = page * entries_per_page;
+        auto count = std::min(entries_per_page, m_fat.size() - first);
+
+        auto begin = m_fat.begin() + first;
+        if (std::all_of(begin, begin + count, [](uint32_t entry) { return entry == 0; }))
+            continue;
+
+        image().write_at(&m_fat[first], count * sizeof(uint32_t), fat_byte_offset + first * sizeof(uint32_t));
+    }
+
+    std::vector<uint8_t> bitmap(ceiling_divide<size_t>(m_cluster_count, 8));
+    m_allocation_bitmap.copy_to(bitmap.data());
+    image().write_at(bitmap.data(), bitmap.size(), cluster_to_byte_offset(m_bitmap_clusters.first));
+
+    write_boot_region(0);
+    write_boot_region(boot_region_sectors);
+}
+
+void ExFAT::write_boot_region(size_t first_sector)
+{
+    auto sector_size = FileSystem::sector_size();
+    std::vector<uint8_t> region(boot_region_sectors * sector_size);
+
+    ExFATBootSector boot {};
+    boot.jump_boot[0] = 0xEB;
+    boot.jump_boot[1] = 0x76;
+    boot.jump_boot[2] = 0x90;
+    memcpy(boot.filesystem_name, "EXFAT   ", sizeof(boot.filesystem_name));
+    boot.partition_offset = lba_offset();
+    boot.volume_length = sector_count();
+    boot.fat_offset = fat_offset_in_sectors;
+    boot.fat_length = m_fat_length_in_sectors;
+    boot.cluster_heap_offset = m_cluster_heap_offset;
+    boot.cluster_count = m_cluster_count;
+    boot.first_cluster_of_root_directory = m_directories.front().first_cluster;
+    boot.volume_serial_number = m_serial_number;
+    boot.filesystem_revision = 0x0100;
+    boot.bytes_per_sector_shift = sector_size == 4096 ? 12 : 9;
+    boot.sectors_per_cluster_shift = m_sectors_per_cluster_shift;
+    boot.number_of_fats = 1;
+    boot.drive_select = 0x80;
+    boot.percent_in_use = static_cast<uint8_t>(m_allocation_bitmap.set_count() * 100 / m_cluster_count);
+    boot.boot_signature = 0xAA55;
+
+    memcpy(region.data(), &boot, sizeof(boot));
+
+    // 8 extended boot sectors, each only carrying the signature
+    for (size_t sector = 1; sector <= 8; ++sector) {
+        region[sector * sector_size + sector_size - 2] = 0x55;
+        region[sector * sector_size + sector_size - 1] = 0xAA;
+    }
+
+    // sectors 9 and 10 are OEM parameters and reserved, left empty,
+    // sector 11 is the checksum of everything before it repeated over the whole sector
+    auto checksummed_bytes = 11 * sector_size;
+    uint32_t checksum = 0;
+
+    for (size_t i = 0; i < checksummed_bytes; ++i) {
+        // VolumeFlags and PercentInUse are allowed to change without updating the checksum
+        if (i == offsetof(ExFATBootSector, volume_flags) || i == offsetof(ExFATBootSector, volume_flags) + 1 ||
+            i == offsetof(ExFATBootSector, percent_in_use))
+            continue;
+
+        checksum = ((checksum & 1) ? 0x80000000 : 0) + (checksum >> 1) + region[i];
+    }
+
+    for (size_t i = checksummed_bytes; i < region.size(); i += sizeof(checksum))
+        memcpy(region.data() + i, &checksum, sizeof(checksum));
+
+    image().write_at(region.data(), region.size(), (lba_offset() + first_sector) * sector_size);
+}
+
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstddef>
+
+#include "Utilities/Common.h"
+#include "Utilities/Bitmap.h"
+#include "Utilities/StringPool.h"
+#include "FileSystems/FileSystem.h"
+
+namespace FAT {
+
+class ExFAT final : public FileSystem
+{
+public:
+    ExFAT(DiskImage& image, size_t lba_offset, size_t sector_count, const additional_options_t& options);
+
+    void finalize() override;
+    directory_handle_t open_directory(std::string_view path) override;
+    directory_handle_t find_directory_in(directory_handle_t directory, std::string_view name) override;
+    void store_in(directory_handle_t directory, std::string_view name, const std::vector<uint8_t>& data, uint8_t attributes) override;
+    void store_file_in(directory_handle_t directory, std::string_view name, HostFile& file, uint8_t attributes) override;
+    directory_handle_t store_directory_in(directory_handle_t directory, std::string_view name) override;
+    SpaceEstimate estimate(const Inventory&) override;
+
+private:
+    using index_t = uint32_t;
+    static constexpr index_t no_index = 0xFFFFFFFF;
+
+    // first cluster and length of a contiguous range of clusters
+    using cluster_run_t = std::pair<uint32_t, uint32_t>;
+
+    void compute_geometry(size_t cluster_size);
+    size_t cluster_to_byte_offset(uint32_t cluster) const;
+
+    std::vector<cluster_run_t> allocate(uint32_t count);
+    void link_chain(const std::vector<cluster_run_t>& runs);
+    void set_fat_entry(uint32_t cluster, uint32_t value);
+
+    void store_contents(index_t directory, std::string_view name, const FileContents& contents, uint8_t attributes);
+    void write_data(const std::vector<cluster_run_t>& runs, const FileContents& contents);
+    void write_upcase_table();
+
+    std::vector<uint8_t> make_entry_set(const std::u16string& name, uint16_t attributes, uint8_t flags, uint32_t first_cluster, uint64_t length) const;
+    size_t append_entry(index_t directory, const uint8_t* entry);
+    std::u16string validate_new_name(index_t directory, std::string_view name) const;
+    index_t find_subdirectory(index_t directory, std::string_view name) const;
+    void add_child(index_t directory, const std::u16string& name, index_t subdirectory);
+
+    void write_boot_region(size_t first_sector);
+
+private:
+    static constexpr uint32_t end_of_chain = 0xFFFFFFFF;
+    static constexpr uint32_t media_descriptor_entry = 0xFFFFFFF8;
+    static constexpr uint32_t max_cluster_count = 0xFFFFFFF5;
+
+    // the FAT starts at a 64K boundary, the cluster heap at a cluster boundary
+    static constexpr size_t fat_offset_in_sectors = 128;
+    static constexpr size_t boot_region_sectors = 12;
+
+    static constexpr uint8_t entry_type_allocation_bitmap = 0x81;
+    static constexpr uint8_t entry_type_upcase_table = 0x82;
+    static constexpr uint8_t entry_type_volume_label = 0x83;
+    static constexpr uint8_t entry_type_file = 0x85;
+    static constexpr uint8_t entry_type_stream_extension = 0xC0;
+    static constexpr uint8_t entry_type_file_name = 0xC1;
+
+    static constexpr uint8_t flag_allocation_possible = 1 << 0;
+    static constexpr uint8_t flag_no_fat_chain = 1 << 1;
+
+    static constexpr uint16_t attribute_directory = 0x10;
+    static constexpr uint16_t attribute_archive = 0x20;
+
+    static constexpr size_t entry_size = 32;
+    static constexpr size_t name_characters_per_entry = 15;
+    static constexpr size_t max_name_length = 255;
+
+    size_t m_cluster_size { 0 };
+    uint8_t m_sectors_per_cluster_shift { 0 };
+    uint32_t m_fat_length_in_sectors { 0 };
+    uint32_t m_cluster_heap_offset { 0 };
+    uint32_t m_cluster_count { 0 };
+
+    uint32_t m_timestamp { 0 };
+    uint32_t m_serial_number { 0 };
+    std::u16string m_volume_label;
+
+    // bit N is cluster N + 2
+    Bitmap m_allocation_bitmap;
+    cluster_run_t m_bitmap_clusters {};
+    cluster_run_t m_upcase_clusters {};
+    uint32_t m_upcase_checksum { 0 };
+    size_t m_upcase_length { 0 };
+
+    // only clusters of FAT chains are ever written here, contiguous files don't need any
+    std::vector<uint32_t> m_fat;
+
+    struct Child {
+        std::string_view upcased_name;
+        index_t directory;
+    };
+
+    struct Directory {
+        uint32_t first_cluster;
+        uint32_t last_cluster;
+        uint32_t cluster_count;
+        uint32_t offset_within_cluster;
+
+        // the entry set describing this directory in its parent, rewritten once the final size is known
+        std::vector<uint8_t> entry_set;
+        size_t file_entry_offset;
+        size_t stream_entry_offset;
+
+        std::vector<Child> children;
+    };
+
+    std::vector<Directory> m_directories;
+    StringPool m_names;
+};
+
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstdint>
+
+#include "Utilities/Common.h"
+
+namespace FAT {
+
+PACKED(struct ExFATBootSector
+{
+    uint8_t  jump_boot[3];
+    char     filesystem_name[8];
+    uint8_t  must_be_zero[53];
+    uint64_t partition_offset;
+    uint64_t volume_length;
+    uint32_t fat_offset;
+    uint32_t fat_length;
+    uint32_t cluster_heap_offset;
+    uint32_t cluster_count;
+    uint32_t first_cluster_of_root_directory;
+    uint32_t volume_serial_number;
+    uint16_t filesystem_revision;
+    uint16_t volume_flags;
+    uint8_t  bytes_per_sector_shift;
+    uint8_t  sectors_per_cluster_shift;
+    uint8_t  number_of_fats;
+    uint8_t  drive_select;
+    uint8_t  percent_in_use;
+    uint8_t  reserved[7];
+    uint8_t  boot_code[390];
+    uint16_t boot_signature;
+});
+
+// All directory entries are 32 bytes, the first byte is always the entry type
+PACKED(struct ExFATFileEntry
+{
+    uint8_t  entry_type;
+    uint8_t  secondary_count;
+    uint16_t set_checksum;
+    uint16_t file_attributes;
+    uint16_t reserved_1;
+    uint32_t create_timestamp;
+    uint32_t last_modified_timestamp;
+    uint32_t last_accessed_timestamp;
+    uint8_t  create_10ms_increment;
+    uint8_t  last_modified_10ms_increment;
+    uint8_t  create_utc_offset;
+    uint8_t  last_modified_utc_offset;
+    uint8_t  last_accessed_utc_offset;
+    uint8_t  reserved_2[7];
+});
+
+PACKED(struct ExFATStreamExtensionEntry
+{
+    uint8_t  entry_type;
+    uint8_t  general_secondary_flags;
+    uint8_t  reserved_1;
+    uint8_t  name_length;
+    uint16_t name_hash;
+    uint16_t reserved_2;
+    uint64_t valid_data_length;
+    uint32_t reserved_3;
+    uint32_t first_cluster;
+    uint64_t data_length;
+});
+
+PACKED(struct ExFATFileNameEntry
+{
+    uint8_t  entry_type;
+    uint8_t  general_secondary_flags;
+    uint16_t file_name[15];
+});
+
+PACKED(struct ExFATAllocationBitmapEntry
+{
+    uint8_t  entry_type;
+    uint8_t  bitmap_flags;
+    uint8_t  reserved[18];
+    uint32_t first_cluster;
+    uint64_t data_length;
+});
+
+PACKED(struct ExFATUpcaseTableEntry
+{
+    uint8_t  entry_type;
+    uint8_t  reserved_1[3];
+    uint32_t table_checksum;
+    uint8_t  reserved_2[12];
+    uint32_t first_cluster;
+    uint64_t data_length;
+});
+
+PACKED(struct ExFATVolumeLabelEntry
+{
+    uint8_t  entry_type;
+    uint8_t  character_count;
+    uint16_t volume_label[11];
+    uint8_t  reserved[8];
+});
+
+static_assert(sizeof(ExFATBootSector) == 512, "Incorrect size of exFAT boot sector");
+static_assert(sizeof(ExFATFileEntry) == 32, "Incorrect size of exFAT file entry");
+static_assert(sizeof(ExFATStreamExtensionEntry) == 32, "Incorrect size of exFAT stream extension entry");
+static_assert(sizeof(ExFATFileNameEntry) == 32, "Incorrect size of exFAT file name entry");
+static_assert(sizeof(ExFATAllocationBitmapEntry) == 32, "Incorrect size of exFAT allocation bitmap entry");
+static_assert(sizeof(ExFATUpcaseTableEntry) == 32, "Incorrect size of exFAT up-case table entry");
+static_assert(sizeof(ExFATVolumeLabelEntry) == 32, "Incorrect size of exFAT volume label entry");
+
+}
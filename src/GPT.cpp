@@ -0,0 +1,250 @@
+#include <array>
+#include <random>
+#include <cstring>
+
+#include "GPT.h"
+
+namespace {
+
+uint32_t crc32(const void* data, size_t size)
+{
+    static const auto table = []() {
+        std::array<uint32_t, 256> table {};
+
+        for (uint32_t i = 0; i < 256; ++i) {
+            auto crc = i;
+            for (size_t bit = 0; bit < 8; ++bit)
+                crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+            table[i] = crc;
+        }
+
+        return table;
+    }();
+
+    auto* bytes = reinterpret_cast<const uint8_t*>(data);
+    uint32_t crc = 0xFFFFFFFF;
+
+    for (size_t i = 0; i < size; ++i)
+        crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+uint64_t align_up(uint64_t value, uint64_t alignment)
+{
+    return ceiling_divide(value, alignment) * alignment;
+}
+
+}
+
+GPT::Guid GPT::Guid::from_string(std::string_view string)
+{
+    // XXXXXXXX-XXXX-XXXX-XXXX-XXXXXXXXXXXX, the first three groups are stored little endian
+    static constexpr size_t byte_order[16] = { 3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15 };
+
+    if (string.size() != 36)
+        throw std::runtime_error("malformed GUID " + std::string(string));
+
+    auto nibble = [&](char c) -> uint8_t {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+            return c - 'A' + 10;
+
+        throw std::runtime_error("malformed GUID " + std::string(string));
+    };
+
+    Guid guid {};
+    size_t position = 0;
+
+    for (size_t i = 0; i < 16; ++i) {
+        if (string[position] == '-')
+            ++position;
+
+        guid.bytes[byte_order[i]] = (nibble(string[position]) << 4) | nibble(string[position + 1]);
+        position += 2;
+    }
+
+    return guid;
+}
+
+GPT::Guid GPT::Guid::random()
+{
+    std::random_device random;
+
+    Guid guid;
+    for (auto& byte : guid.bytes)
+        byte = static_cast<uint8_t>(random());
+
+    // version 4, variant 1
+    guid.bytes[7] = (guid.bytes[7] & 0x0F) | 0x40;
+    guid.bytes[8] = (guid.bytes[8] & 0x3F) | 0x80;
+
+    return guid;
+}
+
+GPT::Partition::Partition(size_t sector_count, Type t, std::string_view name, bool bootable)
+    : m_type(t)
+    , m_sector_count(sector_count)
+    , m_name(name)
+    , m_bootable(bootable)
+{
+    if (m_name.size() > 36)
+        throw std::runtime_error("GPT partition name cannot exceed 36 characters");
+}
+
+uint64_t GPT::Partition::sector_count() const noexcept
+{
+    return m_sector_count;
+}
+
+void GPT::Partition::serialize(uint8_t* into, uint64_t first_lba) const
+{
+    static const Guid basic_data = Guid::from_string("EBD0A0A2-B9E5-4433-87C0-68B6B72699C7");
+    static const Guid linux_filesystem = Guid::from_string("0FC63DAF-8483-4772-8E79-3D69D8477DE4");
+    static const Guid efi_system = Guid::from_string("C12A7328-F81F-11D2-BA4B-00A0C93EC93B");
+
+    const Guid* type = &basic_data;
+    if (m_type == Type::LINUX_FILESYSTEM)
+        type = &linux_filesystem;
+    else if (m_type == Type::EFI_SYSTEM)
+        type = &efi_system;
+
+    auto unique = Guid::random();
+    uint64_t last_lba = first_lba + m_sector_count - 1;
+
+    // bit 2 is "legacy BIOS bootable"
+    uint64_t attributes = m_bootable ? (1ull << 2) : 0;
+
+    memcpy(&into[0], type, sizeof(Guid));
+    memcpy(&into[16], &unique, sizeof(Guid));
+    memcpy(&into[32], &first_lba, sizeof(uint64_t));
+    memcpy(&into[40], &last_lba, sizeof(uint64_t));
+    memcpy(&into[48], &attributes, sizeof(uint64_t));
+
+    // UTF-16LE, names are expected to be ASCII
+    for (size_t i = 0; i < m_name.size(); ++i)
+        into[56 + i * 2] = static_cast<uint8_t>(m_name[i]);
+}
+
+GPT::GPT(const DiskGeometry& geometry, size_t alignment, const std::string& boot_code_path)
+    : m_sector_size(geometry.sector_size)
+    , m_entry_array_sectors(entry_array_size / geometry.sector_size)
+    , m_total_sector_count(geometry.total_sector_count)
+    , m_first_usable_lba(2 + m_entry_array_sectors)
+    , m_last_usable_lba(geometry.total_sector_count - 2 - m_entry_array_sectors)
+    , m_alignment(alignment ? alignment : 1)
+    , m_disk_guid(Guid::random())
+    , m_entries(partition_count * partition_entry_size)
+{
+    m_next_lba = align_up(m_first_usable_lba, m_alignment);
+
+    if (geometry.total_sector_count < m_first_usable_lba * 2 || m_next_lba > m_last_usable_lba)
+        throw std::runtime_error("disk is too small for a GPT");
+
+    if (!boot_code_path.empty()) {
+        AutoFile mbr_file(boot_code_path, AutoFile::READ);
+
+        // only the boot code is taken, the partition table is generated
+        m_boot_code.resize(440);
+        mbr_file.read(m_boot_code.data(), m_boot_code.size());
+    }
+}
+
+size_t GPT::free_sector_count() const noexcept
+{
+    if (m_next_lba > m_last_usable_lba)
+        return 0;
+
+    return m_last_usable_lba - m_next_lba + 1;
+}
+
+size_t GPT::add_partition(const Partition& partition)
+{
+    if (m_active_partition == partition_count)
+        throw std::runtime_error("GPT cannot hold more than " + std::to_string(partition_count) + " partitions");
+
+    if (partition.sector_count() == 0 || partition.sector_count() > free_sector_count())
+        throw std::runtime_error("partition of " + std::to_string(partition.sector_count()) + " sectors doesn't fit on the disk");
+
+    auto partition_lba_offset = m_next_lba;
+
+    partition.serialize(&m_entries[m_active_partition * partition_entry_size], partition_lba_offset);
+
+    m_next_lba = align_up(partition_lba_offset + partition.sector_count(), m_alignment);
+    m_active_partition += 1;
+
+    return partition_lba_offset;
+}
+
+void GPT::write_protective_mbr(uint8_t* into) const
+{
+    if (!m_boot_code.empty())
+        memcpy(into, m_boot_code.data(), m_boot_code.size());
+
+    // a single partition of type 0xEE covering the whole disk (or as much of it as fits)
+    auto* entry = &into[446];
+    uint32_t first_lba = 1;
+    uint32_t sector_count = static_cast<uint32_t>(std::min<uint64_t>(m_total_sector_count - 1, 0xFFFFFFFF));
+
+    entry[0] = 0x00;
+    entry[1] = 0x00;
+    entry[2] = 0x02;
+    entry[3] = 0x00;
+    entry[4] = 0xEE;
+    entry[5] = 0xFF;
+    entry[6] = 0xFF;
+    entry[7] = 0xFF;
+    memcpy(&entry[8], &first_lba, sizeof(uint32_t));
+    memcpy(&entry[12], &sector_count, sizeof(uint32_t));
+
+    into[510] = 0x55;
+    into[511] = 0xAA;
+}
+
+GPT::Header GPT::make_header(bool primary, uint32_t entries_crc32) const
+{
+    Header header {};
+
+    memcpy(header.signature, "EFI PART", sizeof(header.signature));
+    header.revision = 0x00010000;
+    header.header_size = sizeof(Header);
+    header.my_lba = primary ? 1 : m_total_sector_count - 1;
+    header.alternate_lba = primary ? m_total_sector_count - 1 : 1;
+    header.first_usable_lba = m_first_usable_lba;
+    header.last_usable_lba = m_last_usable_lba;
+    header.disk_guid = m_disk_guid;
+    header.partition_entry_lba = primary ? 2 : m_last_usable_lba + 1;
+    header.number_of_partition_entries = partition_count;
+    header.size_of_partition_entry = partition_entry_size;
+    header.partition_entry_array_crc32 = entries_crc32;
+    header.header_crc32 = crc32(&header, sizeof(header));
+
+    return header;
+}
+
+void GPT::write_into(DiskImage& image)
+{
+    auto entries_crc32 = crc32(m_entries.data(), m_entries.size());
+
+    // protective MBR, primary header and the entry array are written as one
+    std::vector<uint8_t> primary((2 + m_entry_array_sectors) * m_sector_size);
+    write_protective_mbr(primary.data());
+
+    auto primary_header = make_header(true, entries_crc32);
+    memcpy(&primary[m_sector_size], &primary_header, sizeof(primary_header));
+    memcpy(&primary[2 * m_sector_size], m_entries.data(), m_entries.size());
+
+    image.write_at(primary.data(), primary.size(), 0);
+
+    // the backup entry array immediately precedes the backup header in the last sector
+    std::vector<uint8_t> backup((m_entry_array_sectors + 1) * m_sector_size);
+    memcpy(backup.data(), m_entries.data(), m_entries.size());
+
+    auto backup_header = make_header(false, entries_crc32);
+    memcpy(&backup[m_entry_array_sectors * m_sector_size], &backup_header, sizeof(backup_header));
+
+    image.write_at(backup.data(), backup.size(), (m_last_usable_lba + 1) * m_sector_size);
+}
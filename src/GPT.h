@@ -0,0 +1,100 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+#include "Utilities/Common.h"
+#include "DiskImages/DiskImage.h"
+
+class GPT
+{
+public:
+    // in bytes, matches the physical extents of most storage arrays and SSD erase blocks
+    static constexpr size_t default_alignment = 1 * MB;
+
+    // the backup header and partition entries at the very end of the disk
+    static size_t backup_sector_count(size_t sector_size) { return 1 + entry_array_size / sector_size; }
+
+    // 'alignment' is in sectors, boot_code_path is an optional MBR whose boot code is put into the protective MBR
+    GPT(const DiskGeometry& geometry, size_t alignment, const std::string& boot_code_path = {});
+
+    void write_into(DiskImage& image);
+
+    class Partition
+    {
+    public:
+        enum class Type
+        {
+            BASIC_DATA,
+            LINUX_FILESYSTEM,
+            EFI_SYSTEM
+        };
+
+        Partition(size_t sector_count, Type t = Type::BASIC_DATA, std::string_view name = {}, bool bootable = false);
+        uint64_t sector_count() const noexcept;
+
+        void serialize(uint8_t* into, uint64_t first_lba) const;
+
+    private:
+        Type m_type;
+        uint64_t m_sector_count;
+        std::string m_name;
+        bool m_bootable;
+    };
+
+    // returns the LBA of the new partition
+    size_t add_partition(const Partition& partition);
+
+    // sectors left for the next partition once it's aligned
+    size_t free_sector_count() const noexcept;
+
+    PACKED(struct Guid
+    {
+        uint8_t bytes[16];
+
+        static Guid from_string(std::string_view string);
+        static Guid random();
+    });
+
+private:
+    PACKED(struct Header
+    {
+        char     signature[8];
+        uint32_t revision;
+        uint32_t header_size;
+        uint32_t header_crc32;
+        uint32_t reserved;
+        uint64_t my_lba;
+        uint64_t alternate_lba;
+        uint64_t first_usable_lba;
+        uint64_t last_usable_lba;
+        Guid     disk_guid;
+        uint64_t partition_entry_lba;
+        uint32_t number_of_partition_entries;
+        uint32_t size_of_partition_entry;
+        uint32_t partition_entry_array_crc32;
+    });
+
+    static_assert(sizeof(Header) == 92, "Incorrect size of GPT header");
+
+    static constexpr size_t partition_entry_size = 128;
+    static constexpr size_t partition_count = 128;
+    static constexpr size_t entry_array_size = partition_count * partition_entry_size;
+
+    void write_protective_mbr(uint8_t* into) const;
+    Header make_header(bool primary, uint32_t entries_crc32) const;
+
+    size_t m_sector_size;
+    size_t m_entry_array_sectors;
+    uint64_t m_total_sector_count;
+    uint64_t m_first_usable_lba;
+    uint64_t m_last_usable_lba;
+    uint64_t m_next_lba;
+    size_t m_alignment;
+
+    Guid m_disk_guid;
+    std::vector<uint8_t> m_boot_code;
+    std::vector<uint8_t> m_entries;
+    size_t m_active_partition { 0 };
+};
@@ -5,6 +5,8 @@ MBR::Partition::Partition(size_t sector_count, MBR::Partition::Status s, MBR::Pa
     , m_type(t)
     , m_sector_count(static_cast<uint32_t>(sector_count))
 {
+    if (sector_count > 0xFFFFFFFF)
+        throw std::runtime_error("partition is too large for an MBR, use a GPT instead");
 }
 
 void MBR::Partition::serialize(uint8_t* into, const DiskGeometry& geometry, size_t lba_offset) const
@@ -39,7 +41,7 @@ void MBR::Partition::serialize(uint8_t* into, const DiskGeometry& geometry, size
         into[6] = sector_cylinder_end;
         into[7] = cylinder_end;
     }
-    else if (m_type == Partition::Type::FAT32_LBA)
+    else
     {
         into[1] = 0xFF;
         into[2] = 0xFF;
@@ -80,15 +82,36 @@ void MBR::write_into(DiskImage& image)
     image.write_at(m_mbr, mbr_size, 0);
 }
 
+size_t MBR::free_sector_count() const noexcept
+{
+    if (m_active_lba_offset >= m_DiskGeometry.total_sector_count)
+        return 0;
+
+    return m_DiskGeometry.total_sector_count - m_active_lba_offset;
+}
+
 size_t MBR::add_partition(const Partition& partition)
 {
+    if (m_active_partition == partition_count)
+        throw std::runtime_error("MBR cannot hold more than " + std::to_string(partition_count) + " partitions");
+
     size_t partition_offset = partition_base + (m_active_partition * partition_entry_size);
 
     size_t partition_lba_offset = m_active_lba_offset;
 
+    // both the start and the size are 32-bit LBAs
+    if (partition_lba_offset > 0xFFFFFFFF)
+        throw std::runtime_error("partition starts past 2 TiB, use a GPT instead");
+
+    if (partition.sector_count() == 0 || partition.sector_count() > free_sector_count())
+        throw std::runtime_error("partition of " + std::to_string(partition.sector_count()) + " sectors doesn't fit on the disk");
+
     partition.serialize(&m_mbr[partition_offset], m_DiskGeometry, partition_lba_offset);
 
+    // following partitions keep the alignment of the first one
     m_active_lba_offset += partition.sector_count();
+    if (m_initial_lba_offset)
+        m_active_lba_offset = ceiling_divide(m_active_lba_offset, m_initial_lba_offset) * m_initial_lba_offset;
     m_active_partition  += 1;
 
     return partition_lba_offset;
@@ -20,8 +20,10 @@ public:
         enum class Type : uint8_t
         {
             FREE      = 0,
+            EXFAT     = 0x07,
             FAT32_CHS = 0x0B,
-            FAT32_LBA = 0x0C
+            FAT32_LBA = 0x0C,
+            LINUX     = 0x83
         };
 
         enum class Status : uint8_t
@@ -44,6 +46,9 @@ public:
 
     size_t add_partition(const Partition& partition);
 
+    // sectors left for the next partition
+    size_t free_sector_count() const noexcept;
+
 private:
     static constexpr size_t mbr_size = 512;
     static constexpr size_t partition_entry_size = 16;
@@ -0,0 +1,51 @@
+#include <stdexcept>
+#include <string>
+
+#include <sys/mman.h>
+
+#include "Utilities/AnonymousMemory.h"
+
+AnonymousMemory::AnonymousMemory(size_t size, bool huge_pages)
+    : m_size(size)
+    , m_mapped_size(size)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    void* memory = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (huge_pages) {
+        // explicit huge pages have to be reserved by the administrator, so this often fails.
+        // Not using MAP_NORESERVE here, otherwise a missing reservation only shows up as SIGBUS on first touch
+        static constexpr size_t huge_page_size = 2 * 1024 * 1024;
+        auto huge_size = (size + huge_page_size - 1) / huge_page_size * huge_page_size;
+
+        memory = mmap(nullptr, huge_size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+        if (memory != MAP_FAILED)
+            m_mapped_size = huge_size;
+    }
+#endif
+
+    if (memory == MAP_FAILED) {
+#ifdef MAP_NORESERVE
+        flags |= MAP_NORESERVE;
+#endif
+        memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+
+        if (memory == MAP_FAILED)
+            throw std::runtime_error("failed to allocate " + std::to_string(size) + " bytes of memory");
+
+#ifdef MADV_HUGEPAGE
+        // transparent huge pages on the other hand are usually available
+        if (huge_pages)
+            madvise(memory, size, MADV_HUGEPAGE);
+#endif
+    }
+
+    m_data = static_cast<uint8_t*>(memory);
+}
+
+AnonymousMemory::~AnonymousMemory()
+{
+    if (m_data)
+        munmap(m_data, m_mapped_size);
+}
@@ -0,0 +1,405 @@
+#include <stdexcept>
+#include <string>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define VHC_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
+#endif
+
+#include "Utilities/AsyncIO.h"
+#include "Utilities/Logger.h"
+
+static int to_fd(void* handle)
+{
+    auto h = reinterpret_cast<long>(handle);
+    return static_cast<int>(h);
+}
+
+#ifdef VHC_HAVE_IO_URING
+
+// A bare io_uring without liburing, only what's needed for plain reads and writes
+struct AsyncIO::Ring
+{
+    int fd { -1 };
+
+    unsigned* sq_head { nullptr };
+    unsigned* sq_tail { nullptr };
+    unsigned sq_mask { 0 };
+    unsigned* sq_array { nullptr };
+    io_uring_sqe* sqes { nullptr };
+
+    unsigned* cq_head { nullptr };
+    unsigned* cq_tail { nullptr };
+    unsigned cq_mask { 0 };
+    io_uring_cqe* cqes { nullptr };
+
+    void* sq_ring { MAP_FAILED };
+    size_t sq_ring_size { 0 };
+    void* cq_ring { MAP_FAILED };
+    size_t cq_ring_size { 0 };
+    size_t sqes_size { 0 };
+
+    bool has_fixed_file { false };
+    bool has_fixed_buffers { false };
+
+    static std::unique_ptr<Ring> create(int file, unsigned entries)
+    {
+        io_uring_params params {};
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 2;
+
+        auto ring = std::make_unique<Ring>();
+        ring->fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+
+        // ENOSYS on old kernels, EPERM when disabled via sysctl or seccomp
+        if (ring->fd < 0)
+            return nullptr;
+
+        // IORING_OP_READ/WRITE appeared in 5.6, FAST_POLL in 5.7 is the closest feature flag
+        if (!(params.features & IORING_FEAT_FAST_POLL))
+            return nullptr;
+
+        ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+        auto single_mapping = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mapping)
+            ring->sq_ring_size = ring->cq_ring_size = std::max(ring->sq_ring_size, ring->cq_ring_size);
+
+        ring->sq_ring = mmap(nullptr, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+        if (ring->sq_ring == MAP_FAILED)
+            return nullptr;
+
+        if (single_mapping) {
+            ring->cq_ring = ring->sq_ring;
+        } else {
+            ring->cq_ring = mmap(nullptr, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+            if (ring->cq_ring == MAP_FAILED)
+                return nullptr;
+        }
+
+        ring->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        auto* sqes = mmap(nullptr, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+            return nullptr;
+        ring->sqes = static_cast<io_uring_sqe*>(sqes);
+
+        auto* sq = static_cast<uint8_t*>(ring->sq_ring);
+        ring->sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        ring->sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        ring->sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        ring->sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+        auto* cq = static_cast<uint8_t*>(ring->cq_ring);
+        ring->cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        ring->cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        ring->cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        ring->cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        // a registered file saves a file table lookup (and refcount) per request
+        ring->has_fixed_file = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, &file, 1) == 0;
+
+        return ring;
+    }
+
+    // the entry is only visible to the kernel after publish_sqe()
+    io_uring_sqe& next_sqe()
+    {
+        auto index = *sq_tail & sq_mask;
+
+        sq_array[index] = index;
+        auto& sqe = sqes[index];
+        memset(&sqe, 0, sizeof(sqe));
+
+        return sqe;
+    }
+
+    void publish_sqe()
+    {
+        __atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+    }
+
+    int enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+    {
+        return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+    }
+
+    ~Ring()
+    {
+        if (sqes)
+            munmap(sqes, sqes_size);
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+            munmap(cq_ring, cq_ring_size);
+        if (sq_ring != MAP_FAILED)
+            munmap(sq_ring, sq_ring_size);
+        if (fd >= 0)
+            close(fd);
+    }
+};
+
+#else
+
+struct AsyncIO::Ring
+{
+};
+
+#endif
+
+AsyncIO::AsyncIO(AutoFile& file, size_t queue_depth)
+    : m_file(file)
+    , m_queue_depth(queue_depth ? queue_depth : 1)
+    , m_requests(m_queue_depth)
+{
+    for (size_t slot = m_queue_depth; slot-- > 0;)
+        m_free_slots.push_back(slot);
+
+#ifdef VHC_HAVE_IO_URING
+    m_ring = Ring::create(to_fd(m_file.m_platform_handle), static_cast<unsigned>(m_queue_depth));
+#endif
+}
+
+bool AsyncIO::register_buffers(const std::vector<std::pair<uint8_t*, size_t>>& buffers)
+{
+#ifdef VHC_HAVE_IO_URING
+    if (!m_ring)
+        return false;
+
+    std::vector<iovec> vectors;
+    for (auto& buffer : buffers)
+        vectors.push_back({ buffer.first, buffer.second });
+
+    // pinning counts against RLIMIT_MEMLOCK, plain requests work just as well
+    m_ring->has_fixed_buffers = syscall(__NR_io_uring_register, m_ring->fd, IORING_REGISTER_BUFFERS, vectors.data(), vectors.size()) == 0;
+
+    return m_ring->has_fixed_buffers;
+#else
+    (void)buffers;
+    return false;
+#endif
+}
+
+void AsyncIO::write_at(const uint8_t* data, size_t size, size_t offset, completion_t on_complete, int buffer_index)
+{
+    enqueue({ true, const_cast<uint8_t*>(data), size, offset, buffer_index, std::move(on_complete), 0 });
+}
+
+void AsyncIO::read_at(uint8_t* into, size_t size, size_t offset, completion_t on_complete, int buffer_index)
+{
+    enqueue({ false, into, size, offset, buffer_index, std::move(on_complete), 0 });
+}
+
+void AsyncIO::enqueue(Request&& request)
+{
+    if (!m_ring) {
+        try {
+            if (request.is_write)
+                m_file.write_at(request.data, request.size, request.offset);
+            else
+                m_file.read_at(request.data, request.size, request.offset);
+        } catch (...) {
+            request.on_complete(0);
+            throw;
+        }
+
+        request.on_complete(request.size);
+        return;
+    }
+
+    while (m_free_slots.empty())
+        complete(1);
+
+    auto slot = m_free_slots.back();
+    m_free_slots.pop_back();
+
+    m_requests[slot] = std::move(request);
+    m_in_flight += 1;
+
+    queue_to_ring(slot);
+
+    // batched, a syscall per request would defeat the point
+    if (m_queued >= std::max<size_t>(1, m_queue_depth / 4))
+        submit();
+}
+
+void AsyncIO::queue_to_ring(size_t slot)
+{
+#ifdef VHC_HAVE_IO_URING
+    auto& request = m_requests[slot];
+    auto& sqe = m_ring->next_sqe();
+
+    auto fixed_buffer = request.buffer_index >= 0 && m_ring->has_fixed_buffers;
+
+    if (request.is_write)
+        sqe.opcode = fixed_buffer ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    else
+        sqe.opcode = fixed_buffer ? IORING_OP_READ_FIXED : IORING_OP_READ;
+
+    if (m_ring->has_fixed_file) {
+        sqe.flags = IOSQE_FIXED_FILE;
+        sqe.fd = 0;
+    } else {
+        sqe.fd = to_fd(m_file.m_platform_handle);
+    }
+
+    sqe.off = request.offset;
+    sqe.addr = reinterpret_cast<uint64_t>(request.data);
+
+    // the length is 32 bits wide, anything longer completes partially and is requeued
+    sqe.len = static_cast<uint32_t>(std::min<size_t>(request.size, 1u << 30));
+
+    if (fixed_buffer)
+        sqe.buf_index = static_cast<uint16_t>(request.buffer_index);
+
+    sqe.user_data = slot;
+
+    m_ring->publish_sqe();
+    m_queued += 1;
+#else
+    (void)slot;
+#endif
+}
+
+void AsyncIO::submit()
+{
+#ifdef VHC_HAVE_IO_URING
+    while (m_ring && m_queued) {
+        auto submitted = m_ring->enter(static_cast<unsigned>(m_queued), 0, 0);
+
+        if (submitted < 0) {
+            if (errno == EINTR)
+                continue;
+
+            // the completion queue is full, make room first
+            if (errno == EBUSY || errno == EAGAIN) {
+                m_ring->enter(0, 1, IORING_ENTER_GETEVENTS);
+                complete(0);
+                continue;
+            }
+
+            throw std::runtime_error("failed to submit I/O: " + std::string(strerror(errno)));
+        }
+
+        m_queued -= submitted;
+    }
+#endif
+}
+
+size_t AsyncIO::complete(size_t minimum)
+{
+#ifdef VHC_HAVE_IO_URING
+    if (!m_ring)
+        return 0;
+
+    submit();
+
+    size_t completed = 0;
+    std::string error;
+
+    for (;;) {
+        auto head = *m_ring->cq_head;
+        auto tail = __atomic_load_n(m_ring->cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; ++head) {
+            auto& cqe = m_ring->cqes[head & m_ring->cq_mask];
+            auto slot = static_cast<size_t>(cqe.user_data);
+            auto result = cqe.res;
+
+            // release the entry before the completion runs, it might queue more requests
+            __atomic_store_n(m_ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+            try {
+                on_completion(slot, result);
+            } catch (const std::exception& ex) {
+                if (error.empty())
+                    error = ex.what();
+            }
+
+            completed += 1;
+            tail = __atomic_load_n(m_ring->cq_tail, __ATOMIC_ACQUIRE);
+        }
+
+        if (!error.empty())
+            throw std::runtime_error(error);
+
+        if (completed >= minimum || !m_in_flight)
+            return completed;
+
+        submit();
+
+        auto res = m_ring->enter(0, 1, IORING_ENTER_GETEVENTS);
+        if (res < 0 && errno != EINTR)
+            throw std::runtime_error("failed to wait for I/O: " + std::string(strerror(errno)));
+    }
+#else
+    (void)minimum;
+    return 0;
+#endif
+}
+
+void AsyncIO::on_completion(size_t slot, int64_t result)
+{
+    auto& request = m_requests[slot];
+
+    // failed requests are completed as well, so that their owners can let go of their buffers
+    auto finish = [&]() {
+        auto on_complete = std::move(request.on_complete);
+        auto transferred = request.transferred;
+
+        m_free_slots.push_back(slot);
+        m_in_flight -= 1;
+
+        on_complete(transferred);
+    };
+
+    if (result < 0) {
+        auto error = std::string("failed to ") + (request.is_write ? "write" : "read") + " file: " + strerror(static_cast<int>(-result));
+
+        finish();
+        throw std::runtime_error(error);
+    }
+
+    request.transferred += static_cast<size_t>(result);
+
+    // short reads at the end of a file are fine, a write that makes no progress isn't
+    if (!result && request.is_write) {
+        finish();
+        throw std::runtime_error("failed to write all bytes to file");
+    }
+
+    if (!result || static_cast<size_t>(result) == request.size) {
+        finish();
+        return;
+    }
+
+    request.data += result;
+    request.size -= static_cast<size_t>(result);
+    request.offset += static_cast<size_t>(result);
+
+    queue_to_ring(slot);
+}
+
+void AsyncIO::wait_for_all()
+{
+    while (m_in_flight)
+        complete(m_in_flight);
+}
+
+AsyncIO::~AsyncIO()
+{
+    // the kernel might still be writing from (or reading into) buffers that are about to be freed
+    try {
+        wait_for_all();
+    } catch (const std::exception& ex) {
+        Logger::the().error(ex.what());
+    }
+}
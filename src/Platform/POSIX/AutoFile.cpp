@@ -1,10 +1,21 @@
 #include <stdexcept>
+#include <algorithm>
 #include <string>
+#include <vector>
+#include <cstdint>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 #include "Utilities/AutoFile.h"
 
@@ -14,6 +25,19 @@ static int to_fd(void* handle)
     return static_cast<int>(h);
 }
 
+AutoFile AutoFile::standard_input()
+{
+    AutoFile file;
+
+    // dup'ed so that closing it doesn't close the actual stdin
+    file.m_platform_handle = reinterpret_cast<void*>(static_cast<long>(dup(STDIN_FILENO)));
+
+    if (to_fd(file.m_platform_handle) < 0)
+        throw std::runtime_error("failed to open standard input");
+
+    return file;
+}
+
 void AutoFile::open(const char* path, Mode mode)
 {
     int flags = 0;
@@ -27,10 +51,20 @@ void AutoFile::open(const char* path, Mode mode)
     else if (mode & Mode::WRITE)
         flags |= O_WRONLY;
 
+#ifdef O_DIRECT
+    flags |= (mode & Mode::DIRECT) ? O_DIRECT : 0;
+#endif
+
     m_platform_handle = reinterpret_cast<void*>(::open(path, flags, S_IRWXU));
 
     if (to_fd(m_platform_handle) < 0)
         throw std::runtime_error("failed to open " + std::string(path));
+
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+    // macOS has no O_DIRECT, this is the closest equivalent
+    if (mode & Mode::DIRECT)
+        fcntl(to_fd(m_platform_handle), F_NOCACHE, 1);
+#endif
 }
 
 size_t AutoFile::size() const
@@ -39,9 +73,67 @@ size_t AutoFile::size() const
     if (fstat(to_fd(m_platform_handle), &st) < 0)
         throw std::runtime_error("failed to get file size");
 
+#ifdef BLKGETSIZE64
+    if (S_ISBLK(st.st_mode)) {
+        uint64_t device_size = 0;
+        if (ioctl(to_fd(m_platform_handle), BLKGETSIZE64, &device_size) < 0)
+            throw std::runtime_error("failed to get block device size");
+
+        return device_size;
+    }
+#endif
+
     return st.st_size;
 }
 
+bool AutoFile::is_block_device() const
+{
+    struct stat st;
+    if (fstat(to_fd(m_platform_handle), &st) < 0)
+        throw std::runtime_error("failed to stat file");
+
+    return S_ISBLK(st.st_mode);
+}
+
+std::vector<std::pair<size_t, size_t>> AutoFile::data_extents() const
+{
+    auto file_size = size();
+    if (!file_size)
+        return {};
+
+#ifdef SEEK_DATA
+    auto fd = to_fd(m_platform_handle);
+    auto previous_offset = lseek(fd, 0, SEEK_CUR);
+
+    std::vector<std::pair<size_t, size_t>> extents;
+
+    for (off_t offset = 0; static_cast<size_t>(offset) < file_size;) {
+        auto data = lseek(fd, offset, SEEK_DATA);
+
+        if (data < 0) {
+            // ENXIO means there's only a hole left, anything else that holes aren't supported
+            if (errno != ENXIO)
+                extents = { { 0, file_size } };
+
+            break;
+        }
+
+        auto hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0)
+            hole = file_size;
+
+        extents.emplace_back(data, hole - data);
+        offset = hole;
+    }
+
+    lseek(fd, previous_offset, SEEK_SET);
+
+    return extents;
+#else
+    return { { 0, file_size } };
+#endif
+}
+
 size_t AutoFile::offset() const
 {
     return lseek(to_fd(m_platform_handle), 0, SEEK_CUR);
@@ -55,6 +147,70 @@ void AutoFile::write(const uint8_t* data, size_t size)
         throw std::runtime_error("failed to write all bytes to file");
 }
 
+void AutoFile::write_at(const uint8_t* data, size_t size, size_t offset)
+{
+    while (size) {
+        auto res = ::pwrite(to_fd(m_platform_handle), data, size, offset);
+
+        if (res <= 0)
+            throw std::runtime_error("failed to write all bytes to file");
+
+        data += res;
+        size -= res;
+        offset += res;
+    }
+}
+
+void AutoFile::write_at(const IOSlice* slices, size_t count, size_t offset)
+{
+    std::vector<iovec> vectors;
+    vectors.reserve(count);
+
+    for (size_t i = 0; i < count; ++i) {
+        if (slices[i].size)
+            vectors.push_back({ const_cast<void*>(slices[i].data), slices[i].size });
+    }
+
+    auto* current = vectors.data();
+    auto* end = vectors.data() + vectors.size();
+
+    while (current != end) {
+        auto vector_count = std::min<size_t>(end - current, IOV_MAX);
+        auto res = ::pwritev(to_fd(m_platform_handle), current, static_cast<int>(vector_count), offset);
+
+        if (res <= 0)
+            throw std::runtime_error("failed to write all bytes to file");
+
+        offset += res;
+
+        // short writes leave us somewhere in the middle of a slice
+        auto written = static_cast<size_t>(res);
+        while (written && written >= current->iov_len) {
+            written -= current->iov_len;
+            ++current;
+        }
+
+        if (written) {
+            current->iov_base = reinterpret_cast<uint8_t*>(current->iov_base) + written;
+            current->iov_len -= written;
+        }
+    }
+}
+
+void AutoFile::read_at(uint8_t* into, size_t size, size_t offset)
+{
+    while (size) {
+        auto res = ::pread(to_fd(m_platform_handle), into, size, offset);
+
+        if (res <= 0)
+            throw std::runtime_error("failed to read all bytes from file");
+
+        into += res;
+        size -= res;
+        offset += res;
+    }
+}
+
 void AutoFile::read(uint8_t* into, size_t size)
 {
     auto res = ::read(to_fd(m_platform_handle), into, size);
@@ -63,6 +219,16 @@ void AutoFile::read(uint8_t* into, size_t size)
         throw std::runtime_error("failed to read all bytes from file");
 }
 
+size_t AutoFile::read_some(uint8_t* into, size_t size)
+{
+    auto res = ::read(to_fd(m_platform_handle), into, size);
+
+    if (res < 0)
+        throw std::runtime_error("failed to read from file");
+
+    return res;
+}
+
 size_t AutoFile::set_offset(size_t offset)
 {
     auto current_offset = this->offset();
@@ -89,6 +255,71 @@ void AutoFile::set_size(size_t new_size)
         throw std::runtime_error("failed to set file size");
 }
 
+void AutoFile::sync()
+{
+    if (fsync(to_fd(m_platform_handle)) < 0)
+        throw std::runtime_error("failed to sync file");
+}
+
+size_t AutoFile::block_size() const
+{
+    struct stat st;
+    if (fstat(to_fd(m_platform_handle), &st) < 0 || st.st_blksize <= 0)
+        return 4096;
+
+    return st.st_blksize;
+}
+
+size_t AutoFile::logical_block_size() const
+{
+#ifdef BLKSSZGET
+    int size = 0;
+    if (is_block_device() && ioctl(to_fd(m_platform_handle), BLKSSZGET, &size) == 0 && size > 0)
+        return size;
+#endif
+
+    return 512;
+}
+
+bool AutoFile::preallocate(size_t size)
+{
+    auto fd = to_fd(m_platform_handle);
+
+#if defined(__linux__)
+    return fallocate(fd, 0, 0, static_cast<off_t>(size)) == 0;
+#elif defined(F_PREALLOCATE)
+    // contiguous if possible, anywhere otherwise
+    fstore_t store { F_ALLOCATECONTIG | F_ALLOCATEALL, F_PEOFPOSMODE, 0, static_cast<off_t>(size), 0 };
+
+    if (fcntl(fd, F_PREALLOCATE, &store) < 0) {
+        store.fst_flags = F_ALLOCATEALL;
+
+        if (fcntl(fd, F_PREALLOCATE, &store) < 0)
+            return false;
+    }
+
+    return ftruncate(fd, static_cast<off_t>(size)) == 0;
+#else
+    // posix_fallocate() would fall back to writing zeros, which is exactly what we don't want
+    (void)fd;
+    (void)size;
+    return false;
+#endif
+}
+
+bool AutoFile::zero_range(size_t offset, size_t size)
+{
+#ifdef BLKZEROOUT
+    // unlike BLKDISCARD this guarantees zeros, the kernel writes them itself if the device can't
+    uint64_t range[2] = { offset, size };
+    return ioctl(to_fd(m_platform_handle), BLKZEROOUT, &range) == 0;
+#else
+    (void)offset;
+    (void)size;
+    return false;
+#endif
+}
+
 AutoFile::~AutoFile()
 {
     if (to_fd(m_platform_handle))
@@ -0,0 +1,80 @@
+#include <stdexcept>
+#include <string>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "Utilities/MappedFile.h"
+
+MappedFile::MappedFile(const std::string& path, size_t size, bool preallocate)
+    : m_size(size)
+{
+    // a shared writable mapping needs read access as well
+    auto fd = ::open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR, S_IRWXU);
+    if (fd < 0)
+        throw std::runtime_error("failed to open " + path);
+
+    if (ftruncate(fd, static_cast<off_t>(size))) {
+        close(fd);
+        throw std::runtime_error("failed to set size of " + path);
+    }
+
+    m_platform_handle = reinterpret_cast<void*>(static_cast<long>(fd));
+
+#ifdef __linux__
+    if (preallocate && size)
+        m_is_preallocated = fallocate(fd, 0, 0, static_cast<off_t>(size)) == 0;
+#else
+    (void)preallocate;
+#endif
+
+    if (!size)
+        return;
+
+    auto* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("failed to map " + path);
+    }
+
+    m_data = static_cast<uint8_t*>(memory);
+
+#ifdef MADV_RANDOM
+    // without read-around a write fault only brings in (and dirties) a single page,
+    // otherwise holes next to written data get allocated in the file as well
+    madvise(m_data, size, MADV_RANDOM);
+#endif
+}
+
+void MappedFile::flush(size_t offset, size_t size, bool release)
+{
+    static const auto page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+
+    // msync & madvise want a page aligned address
+    auto end = offset + size;
+    offset -= offset % page_size;
+
+    if (end > m_size)
+        end = m_size;
+    if (offset >= end)
+        return;
+
+    if (msync(m_data + offset, end - offset, MS_SYNC))
+        throw std::runtime_error("failed to write back mapped file");
+
+    // the pages are clean by now and stay in the page cache, so dropping them
+    // only unmaps them, data written concurrently just faults them back in
+    if (release)
+        madvise(m_data + offset, end - offset, MADV_DONTNEED);
+}
+
+MappedFile::~MappedFile()
+{
+    if (m_data)
+        munmap(m_data, m_size);
+
+    close(static_cast<int>(reinterpret_cast<long>(m_platform_handle)));
+}
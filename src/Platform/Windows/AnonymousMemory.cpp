@@ -0,0 +1,38 @@
+#include <stdexcept>
+#include <string>
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+#include "Utilities/AnonymousMemory.h"
+
+AnonymousMemory::AnonymousMemory(size_t size, bool huge_pages)
+    : m_size(size)
+    , m_mapped_size(size)
+{
+    void* memory = nullptr;
+
+    // large pages require SeLockMemoryPrivilege, so this often fails
+    auto large_page_size = GetLargePageMinimum();
+    if (huge_pages && large_page_size) {
+        auto large_size = (size + large_page_size - 1) / large_page_size * large_page_size;
+
+        memory = VirtualAlloc(NULL, large_size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (memory)
+            m_mapped_size = large_size;
+    }
+
+    if (!memory)
+        memory = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+
+    if (!memory)
+        throw std::runtime_error("failed to allocate " + std::to_string(size) + " bytes of memory");
+
+    m_data = static_cast<uint8_t*>(memory);
+}
+
+AnonymousMemory::~AnonymousMemory()
+{
+    if (m_data)
+        VirtualFree(m_data, 0, MEM_RELEASE);
+}
@@ -0,0 +1,61 @@
+#include <stdexcept>
+#include <string>
+
+#include "Utilities/AsyncIO.h"
+
+// No overlapped I/O here yet, every request is carried out synchronously
+struct AsyncIO::Ring
+{
+};
+
+AsyncIO::AsyncIO(AutoFile& file, size_t queue_depth)
+    : m_file(file)
+    , m_queue_depth(queue_depth ? queue_depth : 1)
+{
+}
+
+bool AsyncIO::register_buffers(const std::vector<std::pair<uint8_t*, size_t>>&)
+{
+    return false;
+}
+
+void AsyncIO::write_at(const uint8_t* data, size_t size, size_t offset, completion_t on_complete, int)
+{
+    try {
+        m_file.write_at(data, size, offset);
+    } catch (...) {
+        on_complete(0);
+        throw;
+    }
+
+    on_complete(size);
+}
+
+void AsyncIO::read_at(uint8_t* into, size_t size, size_t offset, completion_t on_complete, int)
+{
+    try {
+        m_file.read_at(into, size, offset);
+    } catch (...) {
+        on_complete(0);
+        throw;
+    }
+
+    on_complete(size);
+}
+
+void AsyncIO::submit()
+{
+}
+
+size_t AsyncIO::complete(size_t)
+{
+    return 0;
+}
+
+void AsyncIO::wait_for_all()
+{
+}
+
+AsyncIO::~AsyncIO()
+{
+}
@@ -2,9 +2,22 @@
 
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
+#include <winioctl.h>
 
 #include "Utilities/AutoFile.h"
 
+AutoFile AutoFile::standard_input()
+{
+    AutoFile file;
+
+    // duplicated so that closing it doesn't close the actual stdin
+    auto process = GetCurrentProcess();
+    if (!DuplicateHandle(process, GetStdHandle(STD_INPUT_HANDLE), process, &file.m_platform_handle, 0, FALSE, DUPLICATE_SAME_ACCESS))
+        throw std::runtime_error("failed to open standard input");
+
+    return file;
+}
+
 void AutoFile::open(const char* path, Mode mode)
 {
     if (m_platform_handle)
@@ -14,15 +27,19 @@ void AutoFile::open(const char* path, Mode mode)
     access |= (mode & Mode::READ) ? GENERIC_READ : 0;
     access |= (mode & Mode::WRITE) ? GENERIC_WRITE : 0;
 
+    DWORD attributes = FILE_ATTRIBUTE_NORMAL;
+    if (mode & Mode::DIRECT)
+        attributes |= FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH;
+
     if (mode & Mode::TRUNCATE) {
-        m_platform_handle = CreateFileA(path, access, 0, NULL, TRUNCATE_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        m_platform_handle = CreateFileA(path, access, 0, NULL, TRUNCATE_EXISTING, attributes, NULL);
         if (m_platform_handle != INVALID_HANDLE_VALUE)
             return;
     }
 
     DWORD creation_despositon = (mode & Mode::WRITE) ? OPEN_ALWAYS : OPEN_EXISTING;
 
-    m_platform_handle = CreateFileA(path, access, 0, NULL, creation_despositon, FILE_ATTRIBUTE_NORMAL, NULL);
+    m_platform_handle = CreateFileA(path, access, 0, NULL, creation_despositon, attributes, NULL);
 
     if (m_platform_handle == INVALID_HANDLE_VALUE)
         throw std::runtime_error("failed to open " + std::string(path));
@@ -30,6 +47,13 @@ void AutoFile::open(const char* path, Mode mode)
 
 size_t AutoFile::size() const
 {
+    GET_LENGTH_INFORMATION device_length {};
+    DWORD returned = 0;
+
+    // \\.\PhysicalDriveN and friends
+    if (DeviceIoControl(m_platform_handle, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0, &device_length, sizeof(device_length), &returned, NULL))
+        return static_cast<size_t>(device_length.Length.QuadPart);
+
     DWORD upper = 0;
     DWORD lower = GetFileSize(m_platform_handle, &upper);
 
@@ -58,6 +82,47 @@ void AutoFile::write(const uint8_t* data, size_t size)
         throw std::runtime_error("failed to write all bytes to file");
 }
 
+void AutoFile::write_at(const uint8_t* data, size_t size, size_t offset)
+{
+    // NOTE: unlike pwrite this does move the file pointer for synchronous handles
+    OVERLAPPED overlapped {};
+    overlapped.Offset = static_cast<DWORD>(offset);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+    DWORD bytes_written = 0;
+
+    if (!WriteFile(m_platform_handle, data, size, &bytes_written, &overlapped))
+        throw std::runtime_error("failed to write file");
+
+    if (bytes_written != size)
+        throw std::runtime_error("failed to write all bytes to file");
+}
+
+void AutoFile::write_at(const IOSlice* slices, size_t count, size_t offset)
+{
+    // WriteFileGather only works with unbuffered handles and page sized pieces
+    for (size_t i = 0; i < count; ++i) {
+        write_at(reinterpret_cast<const uint8_t*>(slices[i].data), slices[i].size, offset);
+        offset += slices[i].size;
+    }
+}
+
+void AutoFile::read_at(uint8_t* into, size_t size, size_t offset)
+{
+    // NOTE: unlike pread this does move the file pointer for synchronous handles
+    OVERLAPPED overlapped {};
+    overlapped.Offset = static_cast<DWORD>(offset);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+    DWORD bytes_read = 0;
+
+    if (!ReadFile(m_platform_handle, into, size, &bytes_read, &overlapped))
+        throw std::runtime_error("failed to read file");
+
+    if (bytes_read != size)
+        throw std::runtime_error("failed to read all bytes from file");
+}
+
 void AutoFile::read(uint8_t* data, size_t size)
 {
     DWORD bytes_read = 0;
@@ -69,6 +134,21 @@ void AutoFile::read(uint8_t* data, size_t size)
         throw std::runtime_error("failed to read all bytes from file");
 }
 
+size_t AutoFile::read_some(uint8_t* data, size_t size)
+{
+    DWORD bytes_read = 0;
+
+    if (!ReadFile(m_platform_handle, data, size, &bytes_read, NULL)) {
+        // the other end of a pipe was closed, that's just the end of file for us
+        if (GetLastError() == ERROR_BROKEN_PIPE)
+            return 0;
+
+        throw std::runtime_error("failed to read file");
+    }
+
+    return bytes_read;
+}
+
 size_t AutoFile::set_offset(size_t offset)
 {
     size_t current_offset = this->offset();
@@ -101,6 +181,92 @@ void AutoFile::set_size(size_t new_size)
     set_offset(old_size);
 }
 
+bool AutoFile::is_block_device() const
+{
+    GET_LENGTH_INFORMATION device_length {};
+    DWORD returned = 0;
+
+    return DeviceIoControl(m_platform_handle, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0, &device_length, sizeof(device_length), &returned, NULL);
+}
+
+std::vector<std::pair<size_t, size_t>> AutoFile::data_extents() const
+{
+    auto file_size = size();
+    if (!file_size)
+        return {};
+
+    std::vector<std::pair<size_t, size_t>> extents;
+
+    FILE_ALLOCATED_RANGE_BUFFER query {};
+    query.FileOffset.QuadPart = 0;
+    query.Length.QuadPart = file_size;
+
+    for (;;) {
+        FILE_ALLOCATED_RANGE_BUFFER ranges[64];
+        DWORD returned = 0;
+
+        auto done = DeviceIoControl(m_platform_handle, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query), ranges, sizeof(ranges), &returned, NULL);
+
+        // not supported by the filesystem, treat the whole file as data
+        if (!done && GetLastError() != ERROR_MORE_DATA)
+            return { { 0, file_size } };
+
+        auto range_count = returned / sizeof(FILE_ALLOCATED_RANGE_BUFFER);
+        for (size_t i = 0; i < range_count; ++i)
+            extents.emplace_back(static_cast<size_t>(ranges[i].FileOffset.QuadPart), static_cast<size_t>(ranges[i].Length.QuadPart));
+
+        if (done || !range_count)
+            break;
+
+        auto next_offset = ranges[range_count - 1].FileOffset.QuadPart + ranges[range_count - 1].Length.QuadPart;
+        query.FileOffset.QuadPart = next_offset;
+        query.Length.QuadPart = file_size - next_offset;
+    }
+
+    return extents;
+}
+
+size_t AutoFile::block_size() const
+{
+    FILE_STORAGE_INFO info {};
+
+    if (!GetFileInformationByHandleEx(m_platform_handle, FileStorageInfo, &info, sizeof(info)))
+        return 4096;
+
+    return info.PhysicalBytesPerSectorForPerformance;
+}
+
+size_t AutoFile::logical_block_size() const
+{
+    FILE_STORAGE_INFO info {};
+
+    if (!GetFileInformationByHandleEx(m_platform_handle, FileStorageInfo, &info, sizeof(info)) || !info.LogicalBytesPerSector)
+        return 512;
+
+    return info.LogicalBytesPerSector;
+}
+
+bool AutoFile::preallocate(size_t size)
+{
+    // reserves the clusters without moving the end of file
+    FILE_ALLOCATION_INFO info {};
+    info.AllocationSize.QuadPart = size;
+
+    return SetFileInformationByHandle(m_platform_handle, FileAllocationInfo, &info, sizeof(info));
+}
+
+bool AutoFile::zero_range(size_t, size_t)
+{
+    // disks don't have an equivalent of BLKZEROOUT, zeros have to be written
+    return false;
+}
+
+void AutoFile::sync()
+{
+    if (!FlushFileBuffers(m_platform_handle))
+        throw std::runtime_error("failed to sync file");
+}
+
 AutoFile::~AutoFile()
 {
     if (m_platform_handle)
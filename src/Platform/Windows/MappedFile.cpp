@@ -0,0 +1,56 @@
+#include <stdexcept>
+#include <string>
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+#include "Utilities/MappedFile.h"
+
+MappedFile::MappedFile(const std::string& path, size_t size, bool)
+    : m_size(size)
+{
+    m_platform_handle = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_platform_handle == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("failed to open " + path);
+
+    if (!size)
+        return;
+
+    // the mapping extends the file to its size, which allocates it in full as well
+    m_is_preallocated = true;
+
+    m_platform_mapping = CreateFileMappingA(m_platform_handle, NULL, PAGE_READWRITE,
+                                            static_cast<DWORD>(static_cast<uint64_t>(size) >> 32),
+                                            static_cast<DWORD>(size), NULL);
+    if (!m_platform_mapping)
+        throw std::runtime_error("failed to map " + path);
+
+    m_data = static_cast<uint8_t*>(MapViewOfFile(m_platform_mapping, FILE_MAP_WRITE, 0, 0, size));
+    if (!m_data)
+        throw std::runtime_error("failed to map " + path);
+}
+
+void MappedFile::flush(size_t offset, size_t size, bool release)
+{
+    if (offset >= m_size)
+        return;
+    if (offset + size > m_size)
+        size = m_size - offset;
+
+    if (!FlushViewOfFile(m_data + offset, size) || !FlushFileBuffers(m_platform_handle))
+        throw std::runtime_error("failed to write back mapped file");
+
+    // unlocking pages that aren't locked removes them from the working set
+    if (release)
+        VirtualUnlock(m_data + offset, size);
+}
+
+MappedFile::~MappedFile()
+{
+    if (m_data)
+        UnmapViewOfFile(m_data);
+    if (m_platform_mapping)
+        CloseHandle(m_platform_mapping);
+    if (m_platform_handle && m_platform_handle != INVALID_HANDLE_VALUE)
+        CloseHandle(m_platform_handle);
+}
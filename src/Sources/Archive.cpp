@@ -0,0 +1,657 @@
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <tuple>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cstddef>
+
+#ifdef VHC_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "Utilities/Common.h"
+#include "Archive.h"
+
+// Something we can read bytes from until it runs out
+class ByteSource
+{
+public:
+    // returns 0 at the end of stream
+    virtual size_t read_some(uint8_t* into, size_t size) = 0;
+
+    virtual ~ByteSource() = default;
+};
+
+class FileSource final : public ByteSource
+{
+public:
+    FileSource(const std::string& path)
+        : m_file(path == "-" ? AutoFile::standard_input() : AutoFile(path, AutoFile::READ))
+    {
+    }
+
+    size_t read_some(uint8_t* into, size_t size) override
+    {
+        return m_file.read_some(into, size);
+    }
+
+private:
+    AutoFile m_file;
+};
+
+// Reads from a source in large chunks and hands them out in whatever pieces the parser needs
+class BufferedStream
+{
+public:
+    BufferedStream(ByteSource& source)
+        : m_source(source)
+        , m_buffer(buffer_size)
+    {
+    }
+
+    // Makes sure at least 'size' bytes are buffered, returns fewer only at the end of stream
+    std::string_view peek(size_t size)
+    {
+        while (m_end - m_begin < size) {
+            if (m_begin) {
+                std::copy(m_buffer.begin() + m_begin, m_buffer.begin() + m_end, m_buffer.begin());
+                m_end -= m_begin;
+                m_begin = 0;
+            }
+
+            auto bytes_read = m_source.read_some(m_buffer.data() + m_end, m_buffer.size() - m_end);
+            if (!bytes_read)
+                break;
+
+            m_end += bytes_read;
+        }
+
+        return { reinterpret_cast<const char*>(m_buffer.data() + m_begin), std::min(size, m_end - m_begin) };
+    }
+
+    // Returns false if the stream ended before anything could be read
+    bool read_or_eof(uint8_t* into, size_t size)
+    {
+        size_t bytes_read = 0;
+
+        while (bytes_read < size) {
+            if (m_begin == m_end && !refill())
+                break;
+
+            auto bytes_to_copy = std::min(size - bytes_read, m_end - m_begin);
+            std::copy_n(m_buffer.begin() + m_begin, bytes_to_copy, into + bytes_read);
+
+            m_begin += bytes_to_copy;
+            bytes_read += bytes_to_copy;
+        }
+
+        m_offset += bytes_read;
+
+        if (bytes_read && bytes_read != size)
+            throw std::runtime_error("unexpected end of archive");
+
+        return bytes_read;
+    }
+
+    void read(uint8_t* into, size_t size)
+    {
+        if (size && !read_or_eof(into, size))
+            throw std::runtime_error("unexpected end of archive");
+    }
+
+    void skip(size_t bytes)
+    {
+        while (bytes) {
+            if (m_begin == m_end && !refill())
+                throw std::runtime_error("unexpected end of archive");
+
+            auto bytes_to_skip = std::min(bytes, m_end - m_begin);
+            m_begin += bytes_to_skip;
+            m_offset += bytes_to_skip;
+            bytes -= bytes_to_skip;
+        }
+    }
+
+    // number of bytes consumed so far
+    [[nodiscard]] size_t offset() const { return m_offset; }
+
+private:
+    bool refill()
+    {
+        m_begin = 0;
+        m_end = m_source.read_some(m_buffer.data(), m_buffer.size());
+
+        return m_end != 0;
+    }
+
+private:
+    static constexpr size_t buffer_size = 1 * MB;
+
+    ByteSource& m_source;
+    std::vector<uint8_t> m_buffer;
+    size_t m_begin { 0 };
+    size_t m_end { 0 };
+    size_t m_offset { 0 };
+};
+
+#ifdef VHC_HAVE_ZLIB
+class GzipSource final : public ByteSource
+{
+public:
+    GzipSource(BufferedStream& compressed)
+        : m_compressed(compressed)
+        , m_input(input_size)
+    {
+        // 32 -> detect the gzip header automatically
+        if (inflateInit2(&m_stream, MAX_WBITS + 32) != Z_OK)
+            throw std::runtime_error("failed to initialize zlib");
+    }
+
+    size_t read_some(uint8_t* into, size_t size) override
+    {
+        auto requested = static_cast<uInt>(std::min<size_t>(size, UINT32_MAX));
+
+        m_stream.next_out = into;
+        m_stream.avail_out = requested;
+
+        while (m_stream.avail_out == requested) {
+            if (m_finished)
+                return 0;
+
+            if (!m_stream.avail_in) {
+                auto input = m_compressed.peek(m_input.size());
+                if (input.empty())
+                    throw std::runtime_error("unexpected end of compressed archive");
+
+                std::copy(input.begin(), input.end(), m_input.begin());
+                m_compressed.skip(input.size());
+
+                m_stream.next_in = m_input.data();
+                m_stream.avail_in = static_cast<uInt>(input.size());
+            }
+
+            auto res = inflate(&m_stream, Z_NO_FLUSH);
+
+            if (res == Z_STREAM_END) {
+                // concatenated gzip members are valid gzip as well
+                if (m_stream.avail_in || !m_compressed.peek(1).empty())
+                    inflateReset(&m_stream);
+                else
+                    m_finished = true;
+            } else if (res != Z_OK && res != Z_BUF_ERROR) {
+                throw std::runtime_error("corrupted compressed archive");
+            }
+        }
+
+        return requested - m_stream.avail_out;
+    }
+
+    ~GzipSource()
+    {
+        inflateEnd(&m_stream);
+    }
+
+private:
+    static constexpr size_t input_size = 256 * KB;
+
+    BufferedStream& m_compressed;
+    std::vector<uint8_t> m_input;
+    z_stream m_stream {};
+    bool m_finished { false };
+};
+#endif
+
+Archive::Archive(const std::string& path)
+    : m_path(path)
+{
+}
+
+void Archive::store_into(FSObjectSink& sink)
+{
+    DirectoryCache directories(sink);
+
+    with_stream([&](BufferedStream& stream) {
+        auto magic = stream.peek(6);
+
+        if (magic == "070701" || magic == "070702" || magic == "070707")
+            store_cpio(stream, directories, sink);
+        else
+            store_tar(stream, directories, sink);
+    });
+}
+
+void Archive::with_stream(const std::function<void(BufferedStream&)>& callback)
+{
+    FileSource file(m_path);
+    BufferedStream raw(file);
+
+    static constexpr std::string_view gzip_magic = "\x1f\x8b";
+
+    if (raw.peek(gzip_magic.size()) != gzip_magic) {
+        callback(raw);
+        return;
+    }
+
+#ifdef VHC_HAVE_ZLIB
+    GzipSource gzip(raw);
+    BufferedStream decompressed(gzip);
+    callback(decompressed);
+#else
+    throw std::runtime_error(m_path + " is gzip compressed, but vhc was built without zlib");
+#endif
+}
+
+static std::string_view normalized_name(std::string_view name)
+{
+    while (name.substr(0, 2) == "./")
+        name.remove_prefix(2);
+    while (!name.empty() && name.front() == '/')
+        name.remove_prefix(1);
+
+    return name;
+}
+
+void Archive::store_entry(std::string_view name, EntryType type, BufferedStream& stream, size_t size,
+                          DirectoryCache& directories, FSObjectSink& sink, const std::vector<std::string>& links)
+{
+    name = normalized_name(name);
+
+    if (name.empty() || name == ".") {
+        stream.skip(size);
+        return;
+    }
+
+    if (type == EntryType::DIRECTORY) {
+        stream.skip(size);
+        directories.directory_at(name);
+        return;
+    }
+
+    if (type != EntryType::FILE) {
+        Logger::the().warning("Not going to store unknown file type at ", name);
+        stream.skip(size);
+        return;
+    }
+
+    Logger::the().info("storing file ", name);
+
+    std::vector<uint8_t> data(size);
+    stream.read(data.data(), data.size());
+
+    auto [parent, file_name] = directories.parent_of(name);
+    sink.store_in(parent, file_name, data);
+
+    for (auto& link : links) {
+        auto link_name = normalized_name(link);
+        if (link_name.empty() || link_name == ".")
+            continue;
+
+        Logger::the().info("storing file ", link_name, " (hard link to ", name, ")");
+
+        auto [link_parent, link_file_name] = directories.parent_of(link_name);
+        sink.store_in(link_parent, link_file_name, data);
+    }
+}
+
+void Archive::store_tar(BufferedStream& stream, DirectoryCache& directories, FSObjectSink& sink)
+{
+    // hard links only name an earlier entry that carries their data, which is gone by the time
+    // the link shows up. They are collected by the index of that entry and stored in a second pass.
+    std::unordered_map<std::string, size_t> file_entries;
+    std::map<size_t, std::vector<std::string>> links;
+    size_t index = 0;
+
+    for_each_tar_entry(stream, [&](const TarEntry& entry) {
+        auto entry_index = index++;
+        auto name = std::string(normalized_name(entry.name));
+
+        if (entry.type == '1') {
+            auto target = file_entries.find(std::string(normalized_name(entry.link_name)));
+
+            if (target == file_entries.end()) {
+                Logger::the().warning("Not going to store hard link ", entry.name, " to ", entry.link_name, ", which isn't a file stored before it");
+                return;
+            }
+
+            links[target->second].push_back(entry.name);
+            file_entries[name] = target->second;
+            return;
+        }
+
+        auto type = EntryType::OTHER;
+
+        if (entry.type == '0' || entry.type == '\0' || entry.type == '7')
+            type = EntryType::FILE;
+        else if (entry.type == '5')
+            type = EntryType::DIRECTORY;
+
+        if (type == EntryType::FILE)
+            file_entries[name] = entry_index;
+
+        store_entry(entry.name, type, stream, entry.size, directories, sink);
+    });
+
+    if (links.empty())
+        return;
+
+    if (m_path == "-") {
+        for (auto& [target, names] : links) {
+            for (auto& name : names)
+                Logger::the().warning("Not going to store hard link ", name, ", standard input can't be read a second time");
+        }
+
+        return;
+    }
+
+    index = 0;
+
+    with_stream([&](BufferedStream& again) {
+        for_each_tar_entry(again, [&](const TarEntry& entry) {
+            auto names = links.find(index++);
+
+            if (names == links.end()) {
+                again.skip(entry.size);
+                return;
+            }
+
+            store_entry(names->second.front(), EntryType::FILE, again, entry.size, directories, sink,
+                        { names->second.begin() + 1, names->second.end() });
+        });
+    });
+}
+
+void Archive::for_each_tar_entry(BufferedStream& stream, const std::function<void(const TarEntry&)>& callback)
+{
+    static constexpr size_t block_size = 512;
+
+    struct Header {
+        char name[100];
+        char mode[8];
+        char uid[8];
+        char gid[8];
+        char size[12];
+        char mtime[12];
+        char checksum[8];
+        char type;
+        char link_name[100];
+        char magic[6];
+        char version[2];
+        char user_name[32];
+        char group_name[32];
+        char device_major[8];
+        char device_minor[8];
+        char prefix[155];
+        char padding[12];
+    };
+    static_assert(sizeof(Header) == block_size, "Incorrect tar header size");
+
+    auto field = [](const char* data, size_t max_size) -> std::string_view {
+        return { data, strnlen(data, max_size) };
+    };
+
+    auto parse_number = [](const char* data, size_t size) -> uint64_t {
+        // GNU base-256 extension for values that don't fit in octal
+        if (static_cast<uint8_t>(data[0]) & 0x80) {
+            uint64_t value = static_cast<uint8_t>(data[0]) & 0x7F;
+
+            for (size_t i = 1; i < size; ++i)
+                value = (value << 8) | static_cast<uint8_t>(data[i]);
+
+            return value;
+        }
+
+        uint64_t value = 0;
+
+        for (size_t i = 0; i < size; ++i) {
+            if (data[i] == ' ' && !value)
+                continue;
+            if (data[i] < '0' || data[i] > '7')
+                break;
+
+            value = (value << 3) | (data[i] - '0');
+        }
+
+        return value;
+    };
+
+    auto read_data = [&stream](size_t size) {
+        std::string data(size, '\0');
+        stream.read(reinterpret_cast<uint8_t*>(data.data()), size);
+        return data;
+    };
+
+    auto padding_of = [](size_t size) {
+        return (block_size - (size % block_size)) % block_size;
+    };
+
+    // set by the GNU and pax extension headers for the entry that follows them
+    std::string long_name;
+    std::string long_link_name;
+    uint64_t long_size = 0;
+    bool has_long_size = false;
+
+    size_t zero_blocks = 0;
+
+    for (;;) {
+        Header header;
+
+        // some archivers don't bother with the end-of-archive marker
+        if (!stream.read_or_eof(reinterpret_cast<uint8_t*>(&header), block_size))
+            break;
+
+        auto* bytes = reinterpret_cast<const uint8_t*>(&header);
+
+        if (std::all_of(bytes, bytes + block_size, [](uint8_t b) { return b == 0; })) {
+            if (++zero_blocks == 2)
+                break;
+
+            continue;
+        }
+
+        zero_blocks = 0;
+
+        uint64_t checksum = 0;
+        for (size_t i = 0; i < block_size; ++i) {
+            bool is_checksum = i >= offsetof(Header, checksum) && i < offsetof(Header, checksum) + sizeof(header.checksum);
+            checksum += is_checksum ? ' ' : bytes[i];
+        }
+
+        if (checksum != parse_number(header.checksum, sizeof(header.checksum)))
+            throw std::runtime_error(m_path + " is not a valid tar archive (checksum mismatch)");
+
+        auto size = parse_number(header.size, sizeof(header.size));
+
+        switch (header.type) {
+        case 'L': // GNU long name
+            long_name = read_data(size).c_str();
+            stream.skip(padding_of(size));
+            continue;
+        case 'K': // GNU long link name
+            long_link_name = read_data(size).c_str();
+            stream.skip(padding_of(size));
+            continue;
+        case 'g': // pax global header
+            stream.skip(size + padding_of(size));
+            continue;
+        case 'x': { // pax extended header, "<length> <key>=<value>\n" records
+            auto records = read_data(size);
+            stream.skip(padding_of(size));
+
+            std::string_view view = records;
+
+            while (!view.empty()) {
+                auto space = view.find(' ');
+                if (space == std::string_view::npos)
+                    break;
+
+                auto record_length = std::stoull(std::string(view.substr(0, space)));
+                if (record_length <= space + 1 || record_length > view.size())
+                    throw std::runtime_error(m_path + " contains a malformed pax header");
+
+                auto record = view.substr(space + 1, record_length - space - 2);
+                view.remove_prefix(record_length);
+
+                auto equals = record.find('=');
+                auto key = record.substr(0, equals);
+                auto value = equals == std::string_view::npos ? std::string_view() : record.substr(equals + 1);
+
+                if (key == "path") {
+                    long_name = value;
+                } else if (key == "linkpath") {
+                    long_link_name = value;
+                } else if (key == "size") {
+                    long_size = std::stoull(std::string(value));
+                    has_long_size = true;
+                }
+            }
+            continue;
+        }
+        default:
+            break;
+        }
+
+        std::string name;
+
+        if (!long_name.empty()) {
+            name = std::move(long_name);
+        } else {
+            auto prefix = field(header.prefix, sizeof(header.prefix));
+
+            // only ustar has the prefix field, old GNU tar uses it for other things
+            if (field(header.magic, sizeof(header.magic)) == "ustar" && !prefix.empty()) {
+                name = prefix;
+                name += '/';
+            }
+
+            name += field(header.name, sizeof(header.name));
+        }
+
+        auto link_name = !long_link_name.empty() ? std::move(long_link_name) : std::string(field(header.link_name, sizeof(header.link_name)));
+
+        if (has_long_size)
+            size = long_size;
+
+        long_name.clear();
+        long_link_name.clear();
+        has_long_size = false;
+
+        // hard and symbolic links and device files don't have any data
+        if (header.type == '1' || header.type == '2' || header.type == '3' || header.type == '4' || header.type == '6')
+            size = 0;
+
+        callback({ std::move(name), std::move(link_name), header.type, size });
+        stream.skip(padding_of(size));
+    }
+}
+
+void Archive::store_cpio(BufferedStream& stream, DirectoryCache& directories, FSObjectSink& sink)
+{
+    static constexpr uint32_t type_mask = 0170000;
+    static constexpr uint32_t directory_type = 0040000;
+    static constexpr uint32_t regular_file_type = 0100000;
+
+    auto parse_number = [this](std::string_view digits, int base) -> uint64_t {
+        uint64_t value = 0;
+
+        for (char c : digits) {
+            int digit = -1;
+
+            if (c >= '0' && c <= '9')
+                digit = c - '0';
+            else if (c >= 'a' && c <= 'f')
+                digit = c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F')
+                digit = c - 'A' + 10;
+
+            if (digit < 0 || digit >= base)
+                throw std::runtime_error(m_path + " is not a valid cpio archive");
+
+            value = value * base + digit;
+        }
+
+        return value;
+    };
+
+    auto align_to = [&stream](size_t alignment) {
+        stream.skip((alignment - (stream.offset() % alignment)) % alignment);
+    };
+
+    // newc and crc archives only carry the data of a hard linked file with its last link,
+    // the names before it are held back until the data shows up. Keyed by device and inode.
+    std::map<std::tuple<uint64_t, uint64_t, uint64_t>, std::vector<std::string>> pending_links;
+
+    for (;;) {
+        char magic[6];
+        stream.read(reinterpret_cast<uint8_t*>(magic), sizeof(magic));
+
+        std::string_view magic_view(magic, sizeof(magic));
+        bool is_odc = magic_view == "070707";
+
+        if (!is_odc && magic_view != "070701" && magic_view != "070702")
+            throw std::runtime_error(m_path + " is not a valid cpio archive (bad magic)");
+
+        uint64_t mode = 0;
+        uint64_t name_size = 0;
+        uint64_t file_size = 0;
+        uint64_t link_count = 1;
+        std::tuple<uint64_t, uint64_t, uint64_t> inode;
+
+        if (is_odc) {
+            // dev ino mode uid gid nlink rdev mtime namesize filesize
+            char header[70];
+            stream.read(reinterpret_cast<uint8_t*>(header), sizeof(header));
+            std::string_view view(header, sizeof(header));
+
+            mode = parse_number(view.substr(12, 6), 8);
+            name_size = parse_number(view.substr(53, 6), 8);
+            file_size = parse_number(view.substr(59, 11), 8);
+        } else {
+            // ino mode uid gid nlink mtime filesize devmajor devminor rdevmajor rdevminor namesize check
+            char header[104];
+            stream.read(reinterpret_cast<uint8_t*>(header), sizeof(header));
+            std::string_view view(header, sizeof(header));
+
+            mode = parse_number(view.substr(8, 8), 16);
+            link_count = parse_number(view.substr(32, 8), 16);
+            file_size = parse_number(view.substr(48, 8), 16);
+            name_size = parse_number(view.substr(88, 8), 16);
+            inode = { parse_number(view.substr(56, 8), 16), parse_number(view.substr(64, 8), 16),
+                      parse_number(view.substr(0, 8), 16) };
+        }
+
+        std::string name(name_size, '\0');
+        stream.read(reinterpret_cast<uint8_t*>(name.data()), name.size());
+        name.resize(strnlen(name.data(), name.size()));
+
+        if (!is_odc)
+            align_to(4);
+
+        if (name == "TRAILER!!!")
+            break;
+
+        auto type = EntryType::OTHER;
+
+        if ((mode & type_mask) == regular_file_type)
+            type = EntryType::FILE;
+        else if ((mode & type_mask) == directory_type)
+            type = EntryType::DIRECTORY;
+
+        if (is_odc || type != EntryType::FILE || link_count < 2) {
+            store_entry(name, type, stream, file_size, directories, sink);
+        } else if (file_size == 0) {
+            pending_links[inode].push_back(std::move(name));
+        } else {
+            auto links = pending_links.extract(inode);
+            store_entry(name, type, stream, file_size, directories, sink, links ? links.mapped() : std::vector<std::string> {});
+        }
+
+        if (!is_odc)
+            align_to(4);
+    }
+
+    // whatever is left is genuinely empty
+    for (auto& [inode, names] : pending_links)
+        store_entry(names.front(), EntryType::FILE, stream, 0, directories, sink, { names.begin() + 1, names.end() });
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "FileSystems/FileSystem.h"
+#include "DirectoryCache.h"
+
+class BufferedStream;
+
+// A tar (ustar, GNU or pax) or cpio (newc, crc or odc) archive, optionally gzip compressed.
+// The archive is read front to back and every entry is stored as soon as its data has been
+// read, so it also works for archives piped in from standard input. Only tar hard links take
+// a second pass to pick up the data of the entries they point to, which standard input can't do.
+class Archive
+{
+public:
+    // "-" means standard input
+    Archive(const std::string& path);
+
+    void store_into(FSObjectSink& sink);
+
+private:
+    // opens the archive from the start, decompressing it if needed
+    void with_stream(const std::function<void(BufferedStream&)>& callback);
+
+    void store_tar(BufferedStream& stream, DirectoryCache& directories, FSObjectSink& sink);
+    void store_cpio(BufferedStream& stream, DirectoryCache& directories, FSObjectSink& sink);
+
+    enum class EntryType {
+        FILE,
+        DIRECTORY,
+        OTHER
+    };
+    struct TarEntry {
+        std::string name;
+        std::string link_name;
+        char type;
+        uint64_t size;
+    };
+    // 'callback' has to consume exactly 'size' bytes of the entry's data from the stream
+    void for_each_tar_entry(BufferedStream& stream, const std::function<void(const TarEntry&)>& callback);
+
+    // 'links' are further names of the same file that get a copy of its data
+    void store_entry(std::string_view name, EntryType type, BufferedStream& stream, size_t size,
+                     DirectoryCache& directories, FSObjectSink& sink, const std::vector<std::string>& links = {});
+
+private:
+    std::string m_path;
+};
@@ -0,0 +1,56 @@
+#include "DirectoryCache.h"
+
+DirectoryCache::DirectoryCache(FSObjectSink& sink)
+    : m_sink(sink)
+{
+    m_directories.emplace("", sink.open_directory("/"));
+}
+
+directory_handle_t DirectoryCache::directory_at(std::string_view path)
+{
+    while (!path.empty() && path.front() == '/')
+        path.remove_prefix(1);
+    while (!path.empty() && path.back() == '/')
+        path.remove_suffix(1);
+
+    // siblings usually come one after another
+    if (m_last_directory && path == m_last_directory_path)
+        return m_last_directory;
+
+    auto key = std::string(path);
+
+    auto cached = m_directories.find(key);
+    if (cached != m_directories.end()) {
+        m_last_directory_path = cached->first;
+        m_last_directory = cached->second;
+        return cached->second;
+    }
+
+    auto last_slash = path.find_last_of('/');
+    auto parent_path = last_slash == std::string_view::npos ? std::string_view() : path.substr(0, last_slash);
+    auto name = last_slash == std::string_view::npos ? path : path.substr(last_slash + 1);
+
+    auto parent = directory_at(parent_path);
+
+    auto directory = m_sink.find_directory_in(parent, name);
+    if (!directory)
+        directory = m_sink.store_directory_in(parent, name);
+
+    m_last_directory_path = key;
+    m_last_directory = directory;
+
+    m_directories.emplace(std::move(key), directory);
+    return directory;
+}
+
+std::pair<directory_handle_t, std::string_view> DirectoryCache::parent_of(std::string_view path)
+{
+    while (!path.empty() && path.back() == '/')
+        path.remove_suffix(1);
+
+    auto last_slash = path.find_last_of('/');
+    if (last_slash == std::string_view::npos)
+        return { directory_at({}), path };
+
+    return { directory_at(path.substr(0, last_slash)), path.substr(last_slash + 1) };
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "FileSystems/FileSystem.h"
+
+// Maps paths on the filesystem to directory handles for sources that
+// list objects in no particular order. Missing directories are created
+// on first use, only directories are remembered.
+class DirectoryCache
+{
+public:
+    DirectoryCache(FSObjectSink& sink);
+
+    // Returns the handle of the directory at 'path', creating it and all of its parents if needed
+    directory_handle_t directory_at(std::string_view path);
+
+    // Splits 'path' into the handle of its parent directory and the name within it
+    std::pair<directory_handle_t, std::string_view> parent_of(std::string_view path);
+
+private:
+    FSObjectSink& m_sink;
+
+    // keyed by path without the leading and trailing slashes
+    std::unordered_map<std::string, directory_handle_t> m_directories;
+
+    std::string m_last_directory_path;
+    directory_handle_t m_last_directory { nullptr };
+};
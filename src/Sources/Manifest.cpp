@@ -0,0 +1,205 @@
+#include <vector>
+#include <stdexcept>
+#include <charconv>
+
+#include "Manifest.h"
+
+Manifest::Manifest(const std::string& path)
+    : m_path(path)
+{
+}
+
+void Manifest::store_into(FSObjectSink& sink, DiskImage& image)
+{
+    AutoFile file(m_path, AutoFile::READ);
+
+    DirectoryCache directories(sink);
+    m_line_number = 0;
+
+    auto bytes_left = file.size();
+    std::vector<uint8_t> chunk;
+    std::string partial_line;
+
+    while (bytes_left) {
+        chunk.resize(std::min(read_chunk_size, bytes_left));
+        file.read(chunk.data(), chunk.size());
+        bytes_left -= chunk.size();
+
+        std::string_view data(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+
+        for (;;) {
+            auto newline = data.find('\n');
+
+            if (newline == std::string_view::npos) {
+                partial_line.append(data);
+                break;
+            }
+
+            if (partial_line.empty()) {
+                store_line(data.substr(0, newline), directories, sink, image);
+            } else {
+                partial_line.append(data.substr(0, newline));
+                store_line(partial_line, directories, sink, image);
+                partial_line.clear();
+            }
+
+            data.remove_prefix(newline + 1);
+        }
+    }
+
+    if (!partial_line.empty())
+        store_line(partial_line, directories, sink, image);
+}
+
+void Manifest::store_line(std::string_view line, DirectoryCache& directories, FSObjectSink& sink, DiskImage& image)
+{
+    ++m_line_number;
+
+    if (!line.empty() && line.back() == '\r')
+        line.remove_suffix(1);
+
+    if (line.empty() || line.front() == '#')
+        return;
+
+    auto error = [&](const std::string& message) {
+        return std::runtime_error(m_path + ":" + std::to_string(m_line_number) + ": " + message);
+    };
+
+    auto next_field = [&line]() -> std::string_view {
+        auto tab = line.find('\t');
+        auto field = line.substr(0, tab);
+
+        line.remove_prefix(tab == std::string_view::npos ? line.size() : tab + 1);
+        return field;
+    };
+
+    auto destination = next_field();
+    auto source = next_field();
+    auto hints = next_field();
+
+    if (destination.empty())
+        throw error("expected a destination");
+
+    // '.' and '..' would end up as directories of that name, empty components as nameless ones
+    auto validate_path = [&](std::string_view path) {
+        while (!path.empty() && path.front() == '/')
+            path.remove_prefix(1);
+        while (!path.empty() && path.back() == '/')
+            path.remove_suffix(1);
+
+        while (!path.empty()) {
+            auto slash = path.find('/');
+            auto component = path.substr(0, slash);
+            path.remove_prefix(slash == std::string_view::npos ? path.size() : slash + 1);
+
+            if (component.empty() || component == "." || component == "..")
+                throw error("invalid path component '" + std::string(component) + "' in " + std::string(destination));
+        }
+    };
+
+    if (destination.back() == '/') {
+        validate_path(destination);
+
+        if (!source.empty())
+            throw error("directories cannot have a source");
+
+        directories.directory_at(destination);
+        return;
+    }
+
+    if (source.empty())
+        throw error("expected a source for " + std::string(destination));
+
+    // plain unsigned decimals only, a sign or trailing garbage is an error
+    auto parse_number = [&](std::string_view key, const std::string& value) -> size_t {
+        uint64_t number = 0;
+        auto end = value.data() + value.size();
+        auto [last, status] = std::from_chars(value.data(), end, number);
+
+        if (value.empty() || status != std::errc() || last != end)
+            throw error("invalid " + std::string(key) + " value " + value);
+
+        return number;
+    };
+
+    size_t offset = 0;
+    size_t length = 0;
+    bool has_length = false;
+    uint8_t attributes = 0;
+    size_t sector = 0;
+    bool has_sector = false;
+
+    while (!hints.empty()) {
+        auto comma = hints.find(',');
+        auto hint = hints.substr(0, comma);
+        hints.remove_prefix(comma == std::string_view::npos ? hints.size() : comma + 1);
+
+        auto equals = hint.find('=');
+        if (equals == std::string_view::npos || equals == 0)
+            throw error("malformed hint " + std::string(hint));
+
+        auto key = hint.substr(0, equals);
+        auto value = std::string(hint.substr(equals + 1));
+
+        if (key == "offset") {
+            offset = parse_number(key, value);
+        } else if (key == "length") {
+            length = parse_number(key, value);
+            has_length = true;
+        } else if (key == "sector") {
+            sector = parse_number(key, value);
+            has_sector = true;
+        } else if (key == "attributes") {
+            for (char c : value) {
+                if (c == 'r')
+                    attributes |= FSObject::READ_ONLY;
+                else if (c == 'h')
+                    attributes |= FSObject::HIDDEN;
+                else if (c == 's')
+                    attributes |= FSObject::SYSTEM;
+                else
+                    throw error("unknown attribute " + std::string(1, c));
+            }
+        } else {
+            throw error("unknown hint " + std::string(key));
+        }
+    }
+
+    auto source_path = std::string(source);
+    HostFile source_file(source_path);
+    auto source_size = source_file.size();
+
+    if (offset > source_size)
+        throw error("offset is past the end of " + source_path);
+
+    if (!has_length)
+        length = source_size - offset;
+    else if (length > source_size - offset)
+        throw error("length is past the end of " + source_path);
+
+    source_file.narrow_to(offset, length);
+
+    if (has_sector) {
+        if (sector == 0 || sector >= image.geometry().total_sector_count)
+            throw error("invalid sector value " + std::to_string(sector));
+
+        Logger::the().info("storing ", source_path, " at sector ", sector);
+
+        if (sector * image.sector_size() + length > image.geometry().total_sector_count * image.sector_size())
+            throw error("data at sector " + std::to_string(sector) + " doesn't fit in the image");
+
+        image.write_file_at(source_file, sector * image.sector_size());
+        return;
+    }
+
+    if (destination.front() != '/')
+        throw error("destination must be an absolute path: " + std::string(destination));
+
+    validate_path(destination);
+
+    auto [parent, name] = directories.parent_of(destination);
+
+    Logger::the().info("storing file ", source_path, " as ", destination);
+
+    sink.store_file_in(parent, name, source_file, attributes);
+}
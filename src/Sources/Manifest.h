@@ -0,0 +1,42 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+#include "Utilities/Common.h"
+#include "DiskImages/DiskImage.h"
+#include "FileSystems/FileSystem.h"
+#include "DirectoryCache.h"
+
+// A text file listing objects to store, one per line, fields are separated by tabs:
+//
+// <destination> <source> [<hints>]
+//
+// Destinations are absolute paths on the filesystem, a destination ending with '/'
+// is a directory and doesn't take a source. Missing parent directories are created.
+// Hints are comma separated key=value pairs:
+//     offset=<bytes>     - skip this many bytes of the source file
+//     length=<bytes>     - only store this many bytes of the source file
+//     attributes=<rhs>   - read-only, hidden and/or system, if the filesystem supports them
+//     sector=<lba>       - store the data at this sector of the image, outside of the
+//                          filesystem, the destination should be '-' in this case
+// Empty lines and lines starting with '#' are ignored.
+//
+// The manifest is parsed while it's being read, only the handles of directories
+// that have been seen so far are kept around.
+class Manifest
+{
+public:
+    Manifest(const std::string& path);
+
+    void store_into(FSObjectSink& sink, DiskImage& image);
+
+private:
+    void store_line(std::string_view line, DirectoryCache& directories, FSObjectSink& sink, DiskImage& image);
+
+private:
+    static constexpr size_t read_chunk_size = 1 * MB;
+
+    std::string m_path;
+    size_t m_line_number { 0 };
+};
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// A zero-filled, page-aligned buffer that doesn't belong to any file.
+// Pages are only committed once they're touched.
+class AnonymousMemory
+{
+public:
+    // huge_pages is a hint, falls back to regular pages if they aren't available
+    AnonymousMemory(size_t size, bool huge_pages = false);
+
+    AnonymousMemory(const AnonymousMemory&) = delete;
+    AnonymousMemory& operator=(const AnonymousMemory&) = delete;
+
+    uint8_t* data() { return m_data; }
+    const uint8_t* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+    ~AnonymousMemory();
+
+private:
+    uint8_t* m_data { nullptr };
+    size_t m_size { 0 };
+    size_t m_mapped_size { 0 };
+};
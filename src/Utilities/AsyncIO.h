@@ -0,0 +1,82 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <functional>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+
+#include "AutoFile.h"
+
+// Positional reads and writes that complete asynchronously. Backed by io_uring on Linux,
+// elsewhere (or if the kernel refuses to set up a ring) every request is carried out
+// synchronously with AutoFile and completes right away.
+// Not thread safe, users are expected to serialize access themselves.
+class AsyncIO
+{
+public:
+    static constexpr size_t default_queue_depth = 64;
+
+    // called with the number of bytes transferred once a request is done, always from within
+    // submit(), complete() or wait_for_all(). Failed requests are done as well, their error is
+    // thrown right after, so whatever the request held on to can always be released here.
+    using completion_t = std::function<void(size_t)>;
+
+    AsyncIO(AutoFile& file, size_t queue_depth = default_queue_depth);
+
+    AsyncIO(const AsyncIO&) = delete;
+    AsyncIO& operator=(const AsyncIO&) = delete;
+
+    // Buffers known up front, requests that pass their index skip mapping the memory
+    // every time. Returns false if the kernel doesn't allow pinning them, the indices
+    // can still be passed in that case.
+    bool register_buffers(const std::vector<std::pair<uint8_t*, size_t>>& buffers);
+
+    // 'data' has to stay valid until the completion is called. Requests are only queued,
+    // they're handed to the kernel in batches once the queue fills up or submit() is called.
+    void write_at(const uint8_t* data, size_t size, size_t offset, completion_t on_complete, int buffer_index = -1);
+    void read_at(uint8_t* into, size_t size, size_t offset, completion_t on_complete, int buffer_index = -1);
+
+    void submit();
+
+    // reaps finished requests, waits for at least 'minimum' of them
+    size_t complete(size_t minimum = 0);
+    void wait_for_all();
+
+    // queued and submitted requests that haven't completed yet
+    size_t in_flight() const { return m_in_flight; }
+    size_t queue_depth() const { return m_queue_depth; }
+    bool is_asynchronous() const { return m_ring != nullptr; }
+
+    ~AsyncIO();
+
+private:
+    struct Ring;
+
+    struct Request {
+        bool is_write;
+        uint8_t* data;
+        size_t size;
+        size_t offset;
+        int buffer_index;
+        completion_t on_complete;
+        size_t transferred;
+    };
+
+    void enqueue(Request&& request);
+    void queue_to_ring(size_t slot);
+    void on_completion(size_t slot, int64_t result);
+
+    AutoFile& m_file;
+    size_t m_queue_depth;
+    size_t m_in_flight { 0 };
+    size_t m_queued { 0 };
+
+    std::unique_ptr<Ring> m_ring;
+
+    // indexed by slot, slots are handed out to requests while they're in flight
+    std::vector<Request> m_requests;
+    std::vector<size_t> m_free_slots;
+};
@@ -1,15 +1,26 @@
 #pragma once
 
 #include <string_view>
+#include <utility>
 #include <vector>
 
+// One piece of a vectored write, pieces are written back to back
+struct IOSlice {
+    const void* data;
+    size_t size;
+};
+
 class AutoFile
 {
 public:
     enum Mode {
         READ = 1,
         WRITE = 2,
-        TRUNCATE = 4
+        TRUNCATE = 4,
+
+        // bypasses the page cache, offsets, sizes and buffers of every
+        // read and write have to be aligned to the logical block size
+        DIRECT = 8
     };
 
     friend Mode operator|(Mode l, Mode r)
@@ -49,12 +60,21 @@ public:
         return *this;
     }
 
+    static AutoFile standard_input();
+
     void open(const char* path, Mode mode);
     void open(const std::string& path, Mode mode) { return open(path.data(), mode); }
 
+    // the capacity for block devices
     size_t size() const;
     size_t offset() const;
 
+    bool is_block_device() const;
+
+    // (offset, length) of every range that holds data, holes of sparse files are left out.
+    // Where holes can't be found the whole file is one range.
+    std::vector<std::pair<size_t, size_t>> data_extents() const;
+
     void write(std::string_view data)
     {
         write(data.data(), data.size());
@@ -68,13 +88,46 @@ public:
     void write(const uint8_t* data, size_t size);
     void read(uint8_t* into, size_t size);
 
+    // Reads at most 'size' bytes, returns 0 at the end of file.
+    // Unlike read() this works for pipes as well.
+    size_t read_some(uint8_t* into, size_t size);
+
+    // Positional write, doesn't use or modify the file offset on POSIX.
+    // Safe to call concurrently as long as the written ranges don't overlap.
+    void write_at(const uint8_t* data, size_t size, size_t offset);
+
+    // Writes 'count' slices back to back starting at 'offset', with a single pwritev where possible
+    void write_at(const IOSlice* slices, size_t count, size_t offset);
+
+    // Positional read, same guarantees as write_at()
+    void read_at(uint8_t* into, size_t size, size_t offset);
+
     size_t set_offset(size_t offset);
     size_t skip(size_t bytes);
     void set_size(size_t new_size);
 
+    // waits for everything written so far to reach the disk
+    void sync();
+
+    // preferred I/O size of the filesystem (or device) the file lives on
+    size_t block_size() const;
+
+    // smallest unit unbuffered (O_DIRECT) I/O can address, the logical sector size of a device
+    size_t logical_block_size() const;
+
+    // Allocates space for the first 'size' bytes up front, so that writing them out of order
+    // doesn't fragment the file. Returns false if the filesystem doesn't support it.
+    bool preallocate(size_t size);
+
+    // Makes a range of a block device read as zeros without writing them out, e.g. with
+    // the device's write zeroes command. Returns false if that isn't supported.
+    bool zero_range(size_t offset, size_t size);
+
     ~AutoFile();
 
 private:
+    friend class AsyncIO;
+
     void* m_platform_handle;
 };
 
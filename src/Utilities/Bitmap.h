@@ -0,0 +1,160 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Fixed size bitmap of allocated (set) and free (clear) bits that works a 64-bit word at a time.
+// The number of clear bits is tracked on every change, so it never has to be recounted.
+class Bitmap
+{
+public:
+    static constexpr size_t npos = static_cast<size_t>(-1);
+
+    explicit Bitmap(size_t bit_count = 0)
+        : m_words((bit_count + bits_per_word - 1) / bits_per_word)
+        , m_bit_count(bit_count)
+        , m_clear_count(bit_count)
+    {
+    }
+
+    [[nodiscard]] size_t size() const { return m_bit_count; }
+    [[nodiscard]] size_t clear_count() const { return m_clear_count; }
+    [[nodiscard]] size_t set_count() const { return m_bit_count - m_clear_count; }
+
+    [[nodiscard]] bool is_set(size_t bit) const
+    {
+        return m_words[bit / bits_per_word] & (uint64_t(1) << (bit % bits_per_word));
+    }
+
+    // Sets bits [begin, end), bits that were already set stay as they are
+    void set_range(size_t begin, size_t end)
+    {
+        end = std::min(end, m_bit_count);
+
+        auto covers_hint = begin <= m_first_clear_hint && m_first_clear_hint < end;
+
+        while (begin < end) {
+            auto& word = m_words[begin / bits_per_word];
+            auto offset = begin % bits_per_word;
+            auto length = std::min(bits_per_word - offset, end - begin);
+
+            auto mask = length == bits_per_word ? ~uint64_t(0) : ((uint64_t(1) << length) - 1) << offset;
+
+            m_clear_count -= popcount(mask & ~word);
+            word |= mask;
+
+            begin += length;
+        }
+
+        if (covers_hint) {
+            m_first_clear_hint = end;
+
+            auto first_clear = find_first_clear(end);
+            m_first_clear_hint = first_clear == npos ? m_bit_count : first_clear;
+        }
+    }
+
+    void set(size_t bit) { set_range(bit, bit + 1); }
+
+    // Index of the first clear bit at or after 'from', npos if there is none
+    [[nodiscard]] size_t find_first_clear(size_t from = 0) const
+    {
+        from = std::max(from, m_first_clear_hint);
+
+        for (auto index = from / bits_per_word; index < m_words.size(); ++index) {
+            auto free_bits = ~m_words[index];
+
+            if (index == from / bits_per_word)
+                free_bits &= ~uint64_t(0) << (from % bits_per_word);
+
+            if (free_bits) {
+                auto bit = index * bits_per_word + count_trailing_zeros(free_bits);
+                return bit < m_bit_count ? bit : npos;
+            }
+        }
+
+        return npos;
+    }
+
+    // Number of consecutive clear bits starting at 'from', stops counting at 'limit'
+    [[nodiscard]] size_t clear_run_length(size_t from, size_t limit = npos) const
+    {
+        auto end = std::min(m_bit_count, limit == npos ? m_bit_count : from + limit);
+        auto bit = from;
+
+        while (bit < end) {
+            auto used_bits = m_words[bit / bits_per_word] >> (bit % bits_per_word);
+
+            if (used_bits) {
+                bit += count_trailing_zeros(used_bits);
+                break;
+            }
+
+            bit += bits_per_word - (bit % bits_per_word);
+        }
+
+        return std::min(bit, end) - from;
+    }
+
+    // Start of the first run of at least 'length' clear bits at or after 'from', npos if there is none
+    [[nodiscard]] size_t find_clear_run(size_t length, size_t from = 0) const
+    {
+        for (auto start = find_first_clear(from); start != npos; start = find_first_clear(start)) {
+            auto run = clear_run_length(start, length);
+
+            if (run == length)
+                return start;
+
+            start += run;
+        }
+
+        return npos;
+    }
+
+    // Serializes the bitmap in on-disk order, bit N is bit N % 8 of byte N / 8
+    void copy_to(uint8_t* bytes) const
+    {
+        auto byte_count = (m_bit_count + 7) / 8;
+
+        for (size_t i = 0; i < byte_count; ++i)
+            bytes[i] = static_cast<uint8_t>(m_words[i / 8] >> ((i % 8) * 8));
+    }
+
+private:
+    static size_t popcount(uint64_t word)
+    {
+#if defined(_MSC_VER)
+        return static_cast<size_t>(__popcnt64(word));
+#else
+        return static_cast<size_t>(__builtin_popcountll(word));
+#endif
+    }
+
+    // 'word' must not be zero
+    static size_t count_trailing_zeros(uint64_t word)
+    {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward64(&index, word);
+        return index;
+#else
+        return static_cast<size_t>(__builtin_ctzll(word));
+#endif
+    }
+
+private:
+    static constexpr size_t bits_per_word = 64;
+
+    std::vector<uint64_t> m_words;
+    size_t m_bit_count { 0 };
+    size_t m_clear_count { 0 };
+
+    // nothing below this bit is clear
+    size_t m_first_clear_hint { 0 };
+};
@@ -9,6 +9,9 @@ struct DiskGeometry
     size_t heads;
     size_t sectors;
 
+    // logical sector size in bytes, every LBA and sector count on the disk is in these
+    size_t sector_size { 512 };
+
     bool within_chs_limit() const noexcept
     {
         if (heads > ((1 << 8) - 1))
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#include "AutoFile.h"
+#include "Disk.h"
+
+// A regular file on the host that's read piece by piece while it's being stored.
+// Only its data extents are ever read, holes of sparse files read as zeros.
+class HostFile
+{
+public:
+    HostFile(const std::string& path)
+        : m_file(path, AutoFile::READ)
+        , m_size(m_file.size())
+        , m_data_extents(m_file.data_extents())
+    {
+        for (auto& extent : m_data_extents) {
+            // the file might have grown since we looked at its size
+            extent.second = std::min(extent.second, m_size - std::min(extent.first, m_size));
+            m_data_size += extent.second;
+        }
+    }
+
+    size_t size() const { return m_size; }
+    bool is_sparse() const { return m_data_size < m_size; }
+
+    // From now on the file is only the 'length' bytes at 'offset', which have to be within it
+    void narrow_to(size_t offset, size_t length)
+    {
+        std::vector<std::pair<size_t, size_t>> extents;
+        m_data_size = 0;
+
+        for (auto [extent_offset, extent_length] : m_data_extents) {
+            auto begin = std::max(extent_offset, offset);
+            auto end = std::min(extent_offset + extent_length, offset + length);
+
+            if (begin >= end)
+                continue;
+
+            extents.emplace_back(begin - offset, end - begin);
+            m_data_size += end - begin;
+        }
+
+        m_base += offset;
+        m_size = length;
+        m_data_extents = std::move(extents);
+    }
+
+    std::vector<uint8_t> read_entire()
+    {
+        std::vector<uint8_t> data(m_size, 0);
+
+        for (auto [offset, length] : m_data_extents)
+            m_file.read_at(data.data() + offset, length, m_base + offset);
+
+        return data;
+    }
+
+    // Calls 'consume(data, size, offset within the file)' for the data extents in order,
+    // a piece is at most 'max_piece_size' bytes and only valid during the call
+    template <typename Callback>
+    void for_each_data_piece(Callback&& consume, size_t max_piece_size = default_piece_size)
+    {
+        std::vector<uint8_t> buffer(std::min(max_piece_size, m_data_size));
+
+        for (auto [offset, length] : m_data_extents) {
+            while (length) {
+                auto piece = std::min(length, buffer.size());
+                m_file.read_at(buffer.data(), piece, m_base + offset);
+
+                consume(buffer.data(), piece, offset);
+
+                offset += piece;
+                length -= piece;
+            }
+        }
+    }
+
+private:
+    static constexpr size_t default_piece_size = 4 * MB;
+
+    AutoFile m_file;
+
+    // where the part of the file we're looking at starts, offsets everywhere else are relative to it
+    size_t m_base { 0 };
+    size_t m_size { 0 };
+    size_t m_data_size { 0 };
+    std::vector<std::pair<size_t, size_t>> m_data_extents;
+};
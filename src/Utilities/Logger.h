@@ -1,6 +1,7 @@
 #pragma once
 
 #include <iostream>
+#include <mutex>
 
 class Logger {
 public:
@@ -35,6 +36,9 @@ public:
         if (l < m_level)
             return *this;
 
+        // keep lines from concurrent subtree builders from interleaving
+        std::lock_guard lock(m_lock);
+
         switch (l) {
         case Level::INFO:
             log("INFO: ");
@@ -77,4 +81,5 @@ public:
 
 private:
     Level m_level { Level::WARN };
+    std::mutex m_lock;
 };
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+// A file of a fixed size that is created (or truncated) and mapped into memory
+// in its entirety, writes into the mapping end up in the file.
+class MappedFile
+{
+public:
+    // 'preallocate' allocates all of the file's blocks up front where the filesystem supports it
+    MappedFile(const std::string& path, size_t size, bool preallocate = false);
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    uint8_t* data() { return m_data; }
+    size_t size() const { return m_size; }
+    bool is_preallocated() const { return m_is_preallocated; }
+
+    // Writes back the dirty pages of the range and waits for it to complete,
+    // with 'release' set the pages are also dropped from this process.
+    // Safe to call while other threads are writing into the range.
+    void flush(size_t offset, size_t size, bool release);
+
+    ~MappedFile();
+
+private:
+    uint8_t* m_data { nullptr };
+    size_t m_size { 0 };
+    bool m_is_preallocated { false };
+    void* m_platform_handle { nullptr };
+    void* m_platform_mapping { nullptr };
+};
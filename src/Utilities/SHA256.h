@@ -0,0 +1,148 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+// Plain FIPS 180-4 SHA-256, used wherever content has to be identified without keeping it around
+class SHA256
+{
+public:
+    using digest_t = std::array<uint8_t, 32>;
+
+    static digest_t of(const void* data, size_t size)
+    {
+        SHA256 hash;
+        hash.update(data, size);
+        return hash.digest();
+    }
+
+    void update(const void* data, size_t size)
+    {
+        auto* bytes = reinterpret_cast<const uint8_t*>(data);
+        m_length += size;
+
+        if (m_buffered) {
+            auto to_copy = std::min(size, block_size - m_buffered);
+            memcpy(m_buffer + m_buffered, bytes, to_copy);
+            m_buffered += to_copy;
+            bytes += to_copy;
+            size -= to_copy;
+
+            if (m_buffered < block_size)
+                return;
+
+            process(m_buffer);
+            m_buffered = 0;
+        }
+
+        for (; size >= block_size; size -= block_size, bytes += block_size)
+            process(bytes);
+
+        memcpy(m_buffer, bytes, size);
+        m_buffered = size;
+    }
+
+    digest_t digest()
+    {
+        uint64_t bit_length = m_length * 8;
+
+        static const uint8_t padding[block_size] = { 0x80 };
+        update(padding, 1 + ((block_size * 2 - 1 - 8 - m_buffered) % block_size));
+
+        uint8_t length_bytes[8];
+        for (size_t i = 0; i < 8; ++i)
+            length_bytes[i] = static_cast<uint8_t>(bit_length >> (56 - i * 8));
+        update(length_bytes, sizeof(length_bytes));
+
+        digest_t result;
+        for (size_t i = 0; i < 8; ++i) {
+            for (size_t j = 0; j < 4; ++j)
+                result[i * 4 + j] = static_cast<uint8_t>(m_state[i] >> (24 - j * 8));
+        }
+
+        return result;
+    }
+
+    static std::string to_hex(const digest_t& digest)
+    {
+        static constexpr char digits[] = "0123456789abcdef";
+
+        std::string hex;
+        for (auto byte : digest) {
+            hex.push_back(digits[byte >> 4]);
+            hex.push_back(digits[byte & 0xF]);
+        }
+
+        return hex;
+    }
+
+private:
+    static uint32_t rotate_right(uint32_t value, uint32_t count)
+    {
+        return (value >> count) | (value << (32 - count));
+    }
+
+    void process(const uint8_t* block)
+    {
+        static constexpr uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+        };
+
+        uint32_t w[64];
+        for (size_t i = 0; i < 16; ++i) {
+            w[i] = (uint32_t(block[i * 4]) << 24) | (uint32_t(block[i * 4 + 1]) << 16) |
+                   (uint32_t(block[i * 4 + 2]) << 8) | uint32_t(block[i * 4 + 3]);
+        }
+
+        for (size_t i = 16; i < 64; ++i) {
+            auto s0 = rotate_right(w[i - 15], 7) ^ rotate_right(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            auto s1 = rotate_right(w[i - 2], 17) ^ rotate_right(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        auto a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+        auto e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+
+        for (size_t i = 0; i < 64; ++i) {
+            auto s1 = rotate_right(e, 6) ^ rotate_right(e, 11) ^ rotate_right(e, 25);
+            auto choice = (e & f) ^ (~e & g);
+            auto t1 = h + s1 + choice + k[i] + w[i];
+            auto s0 = rotate_right(a, 2) ^ rotate_right(a, 13) ^ rotate_right(a, 22);
+            auto majority = (a & b) ^ (a & c) ^ (b & c);
+            auto t2 = s0 + majority;
+
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        m_state[0] += a; m_state[1] += b; m_state[2] += c; m_state[3] += d;
+        m_state[4] += e; m_state[5] += f; m_state[6] += g; m_state[7] += h;
+    }
+
+private:
+    static constexpr size_t block_size = 64;
+
+    uint32_t m_state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    uint8_t m_buffer[block_size] {};
+    size_t m_buffered { 0 };
+    uint64_t m_length { 0 };
+};
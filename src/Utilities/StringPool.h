@@ -0,0 +1,71 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <string_view>
+#include <cstring>
+#include <iterator>
+#include <algorithm>
+
+// Append-only storage for lots of small strings. Strings are packed into
+// large chunks that never move, so the returned views stay valid for as long
+// as the pool (or whatever pool absorbed it) is alive.
+class StringPool
+{
+public:
+    explicit StringPool(size_t chunk_size = default_chunk_size)
+        : m_chunk_size(chunk_size)
+    {
+    }
+
+    StringPool(const StringPool&) = delete;
+    StringPool& operator=(const StringPool&) = delete;
+
+    StringPool(StringPool&&) noexcept = default;
+    StringPool& operator=(StringPool&&) noexcept = default;
+
+    std::string_view add(std::string_view string)
+    {
+        if (string.empty())
+            return {};
+
+        if (m_chunks.empty() || (m_chunk_capacity - m_chunk_used) < string.size()) {
+            m_chunk_capacity = std::max(m_chunk_size, string.size());
+            m_chunks.emplace_back(new char[m_chunk_capacity]);
+            m_chunk_used = 0;
+        }
+
+        auto* location = m_chunks.back().get() + m_chunk_used;
+        memcpy(location, string.data(), string.size());
+        m_chunk_used += string.size();
+
+        return { location, string.size() };
+    }
+
+    // Takes ownership of all strings in 'other', views into it stay valid
+    void absorb(StringPool&& other)
+    {
+        if (m_chunks.empty()) {
+            m_chunks = std::move(other.m_chunks);
+            m_chunk_capacity = other.m_chunk_capacity;
+            m_chunk_used = other.m_chunk_used;
+        } else {
+            // put them in front of our current chunk so that we keep appending to it
+            m_chunks.insert(m_chunks.end() - 1,
+                            std::make_move_iterator(other.m_chunks.begin()),
+                            std::make_move_iterator(other.m_chunks.end()));
+        }
+
+        other.m_chunks.clear();
+        other.m_chunk_capacity = 0;
+        other.m_chunk_used = 0;
+    }
+
+private:
+    static constexpr size_t default_chunk_size = 64 * 1024;
+
+    size_t m_chunk_size { 0 };
+    size_t m_chunk_capacity { 0 };
+    size_t m_chunk_used { 0 };
+    std::vector<std::unique_ptr<char[]>> m_chunks;
+};
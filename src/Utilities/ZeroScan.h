@@ -0,0 +1,158 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "AutoFile.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#define VHC_ZERO_SCAN_SSE2
+
+// AVX2 is picked at runtime, so that the default build doesn't need -mavx2
+#if defined(__GNUC__) || defined(__clang__)
+#define VHC_ZERO_SCAN_AVX2
+#endif
+#endif
+
+// Finds blocks of zeros in data that's about to be written. Images that start out zeroed
+// don't write those at all, which leaves holes behind in the image file.
+class ZeroScan
+{
+public:
+    static bool is_zero(const void* data, size_t size)
+    {
+        auto* bytes = reinterpret_cast<const uint8_t*>(data);
+
+#ifdef VHC_ZERO_SCAN_AVX2
+        static const bool has_avx2 = __builtin_cpu_supports("avx2");
+        if (has_avx2)
+            return is_zero_avx2(bytes, size);
+#endif
+
+#ifdef VHC_ZERO_SCAN_SSE2
+        return is_zero_sse2(bytes, size);
+#else
+        return is_zero_scalar(bytes, size);
+#endif
+    }
+
+    // Calls 'write(data, size, offset)' for every part of 'data' that has to be written, that is
+    // everything except blocks of zeros aligned to 'granularity' relative to the start of the image.
+    // Partial blocks at either end are always written, they might share a block with other data.
+    template <typename Callback>
+    static void for_each_nonzero_range(const void* data, size_t size, size_t offset, size_t granularity, Callback&& write)
+    {
+        auto* bytes = reinterpret_cast<const uint8_t*>(data);
+        auto end = offset + size;
+
+        auto pending = offset;
+        auto block = ((offset + granularity - 1) / granularity) * granularity;
+
+        for (; block + granularity <= end; block += granularity) {
+            if (!is_zero(bytes + (block - offset), granularity))
+                continue;
+
+            if (pending < block)
+                write(bytes + (pending - offset), block - pending, pending);
+
+            pending = block + granularity;
+        }
+
+        if (pending < end)
+            write(bytes + (pending - offset), end - pending, pending);
+    }
+
+    // Same as above for a vectored write, ranges that are still back to back
+    // are handed to 'write(slices, count, offset)' together
+    template <typename Callback>
+    static void for_each_nonzero_run(const IOSlice* slices, size_t count, size_t offset, size_t granularity, Callback&& write)
+    {
+        std::vector<IOSlice> run;
+        size_t run_offset = offset;
+        size_t run_end = offset;
+
+        for (size_t i = 0; i < count; ++i) {
+            for_each_nonzero_range(slices[i].data, slices[i].size, offset, granularity,
+                [&](const uint8_t* range, size_t range_size, size_t range_offset) {
+                    if (range_offset != run_end && !run.empty()) {
+                        write(run.data(), run.size(), run_offset);
+                        run.clear();
+                    }
+
+                    if (run.empty())
+                        run_offset = range_offset;
+
+                    run.push_back({ range, range_size });
+                    run_end = range_offset + range_size;
+                });
+
+            offset += slices[i].size;
+        }
+
+        if (!run.empty())
+            write(run.data(), run.size(), run_offset);
+    }
+
+private:
+    static bool is_zero_scalar(const uint8_t* bytes, size_t size)
+    {
+        uint64_t any = 0;
+
+        for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), bytes += sizeof(uint64_t)) {
+            uint64_t word;
+            memcpy(&word, bytes, sizeof(word));
+            any |= word;
+
+            // bail out early, non-zero data is usually non-zero right away
+            if (any)
+                return false;
+        }
+
+        for (; size; --size)
+            any |= *bytes++;
+
+        return !any;
+    }
+
+#ifdef VHC_ZERO_SCAN_SSE2
+    static bool is_zero_sse2(const uint8_t* bytes, size_t size)
+    {
+        static constexpr size_t stride = 4 * sizeof(__m128i);
+
+        for (; size >= stride; size -= stride, bytes += stride) {
+            auto* vectors = reinterpret_cast<const __m128i*>(bytes);
+
+            auto any = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(vectors), _mm_loadu_si128(vectors + 1)),
+                                    _mm_or_si128(_mm_loadu_si128(vectors + 2), _mm_loadu_si128(vectors + 3)));
+
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xFFFF)
+                return false;
+        }
+
+        return is_zero_scalar(bytes, size);
+    }
+#endif
+
+#ifdef VHC_ZERO_SCAN_AVX2
+    __attribute__((target("avx2")))
+    static bool is_zero_avx2(const uint8_t* bytes, size_t size)
+    {
+        static constexpr size_t stride = 4 * sizeof(__m256i);
+
+        for (; size >= stride; size -= stride, bytes += stride) {
+            auto* vectors = reinterpret_cast<const __m256i*>(bytes);
+
+            auto any = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256(vectors), _mm256_loadu_si256(vectors + 1)),
+                                       _mm256_or_si256(_mm256_loadu_si256(vectors + 2), _mm256_loadu_si256(vectors + 3)));
+
+            if (!_mm256_testz_si256(any, any))
+                return false;
+        }
+
+        return is_zero_sse2(bytes, size);
+    }
+#endif
+};